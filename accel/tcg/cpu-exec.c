@@ -210,6 +210,48 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu, TCGTBCPUState s)
     return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
 }
 
+static CPUJumpCache *tb_jmp_cache_new(unsigned int bits)
+{
+    CPUJumpCache *jc;
+
+    jc = g_malloc0(sizeof(CPUJumpCache) + (sizeof(jc->array[0]) << bits));
+    jc->bits = bits;
+    return jc;
+}
+
+/*
+ * Account for a lookup which missed @cpu's jump cache but found a TB in
+ * the QHT.  At the end of each window, grow the cache if such misses were
+ * frequent; the new cache starts out empty.  Return the current cache.
+ */
+static CPUJumpCache *tb_jmp_cache_miss(CPUState *cpu, CPUJumpCache *jc)
+{
+    size_t lookups, misses;
+
+    qatomic_set(&jc->miss_count, jc->miss_count + 1);
+
+    lookups = jc->hit_count + jc->miss_count - jc->window_lookups;
+    if (likely(lookups < TB_JMP_CACHE_WINDOW)) {
+        return jc;
+    }
+
+    misses = jc->miss_count - jc->window_misses;
+    if (misses * TB_JMP_CACHE_GROW_RATIO > lookups &&
+        jc->bits < TB_JMP_CACHE_MAX_BITS) {
+        CPUJumpCache *old = jc;
+
+        jc = tb_jmp_cache_new(old->bits + 1);
+        jc->hit_count = old->hit_count;
+        jc->miss_count = old->miss_count;
+        qatomic_rcu_set(&cpu->tb_jmp_cache, jc);
+        g_free_rcu(old, rcu);
+        trace_tb_jmp_cache_grow(cpu->cpu_index, jc->bits);
+    }
+    jc->window_lookups = jc->hit_count + jc->miss_count;
+    jc->window_misses = jc->miss_count;
+    return jc;
+}
+
 /**
  * tb_lookup:
  * @cpu: CPU that will execute the returned translation block
@@ -233,8 +275,8 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, TCGTBCPUState s)
     /* we should never be trying to look up an INVALID tb */
     tcg_debug_assert(!(s.cflags & CF_INVALID));
 
-    hash = tb_jmp_cache_hash_func(s.pc);
     jc = cpu->tb_jmp_cache;
+    hash = tb_jmp_cache_hash_func(jc, s.pc);
 
     tb = qatomic_read(&jc->array[hash].tb);
     if (likely(tb &&
@@ -242,6 +284,7 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, TCGTBCPUState s)
                tb->cs_base == s.cs_base &&
                tb->flags == s.flags &&
                tb_cflags(tb) == s.cflags)) {
+        qatomic_set(&jc->hit_count, jc->hit_count + 1);
         goto hit;
     }
 
@@ -250,6 +293,8 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, TCGTBCPUState s)
         return NULL;
     }
 
+    jc = tb_jmp_cache_miss(cpu, jc);
+    hash = tb_jmp_cache_hash_func(jc, s.pc);
     jc->array[hash].pc = s.pc;
     qatomic_set(&jc->array[hash].tb, tb);
 
@@ -974,8 +1019,8 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
                  * We add the TB in the virtual pc hash table
                  * for the fast lookup
                  */
-                h = tb_jmp_cache_hash_func(s.pc);
                 jc = cpu->tb_jmp_cache;
+                h = tb_jmp_cache_hash_func(jc, s.pc);
                 jc->array[h].pc = s.pc;
                 qatomic_set(&jc->array[h].tb, tb);
             }
@@ -1065,7 +1110,7 @@ bool tcg_exec_realizefn(CPUState *cpu, Error **errp)
         tcg_target_initialized = true;
     }
 
-    cpu->tb_jmp_cache = g_new0(CPUJumpCache, 1);
+    cpu->tb_jmp_cache = tb_jmp_cache_new(TB_JMP_CACHE_BITS);
     tlb_init(cpu);
 #ifndef CONFIG_USER_ONLY
     tcg_iommu_init_notifier_list(cpu);
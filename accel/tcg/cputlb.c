@@ -102,6 +102,26 @@ static inline size_t sizeof_tlb(CPUTLBDescFast *fast)
     return fast->mask + (1 << CPU_TLB_ENTRY_BITS);
 }
 
+/* Number of entries in each victim tlb; see -accel tcg,victim-tlb-size. */
+unsigned int tlb_victim_size = CPU_VTLB_DEFAULT_SIZE;
+
+static inline size_t vtlb_n_entries(CPUTLBDesc *desc)
+{
+    return (desc->vmask + 1) * CPU_VTLB_WAYS;
+}
+
+/* Return the index of the first way of the victim tlb set for PAGE.  */
+static inline size_t vtlb_set_index(CPUTLBDesc *desc, vaddr page)
+{
+    /*
+     * Pages which conflict in the direct mapped main tlb share their
+     * low page number bits, so scramble those into the set index.
+     */
+    uint64_t h = (uint64_t)(page >> TARGET_PAGE_BITS) * 0x9e3779b97f4a7c15ull;
+
+    return ((h >> 32) & desc->vmask) * CPU_VTLB_WAYS;
+}
+
 static inline uint64_t tlb_read_idx(const CPUTLBEntry *entry,
                                     MMUAccessType access_type)
 {
@@ -155,7 +175,7 @@ static void tb_jmp_cache_clear_page(CPUState *cpu, vaddr page_addr)
         return;
     }
 
-    i0 = tb_jmp_cache_hash_page(page_addr);
+    i0 = tb_jmp_cache_hash_page(jc, page_addr);
     for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
         qatomic_set(&jc->array[i0 + i].tb, NULL);
     }
@@ -281,9 +301,10 @@ static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
     desc->n_used_entries = 0;
     desc->large_page_addr = -1;
     desc->large_page_mask = -1;
+    desc->lp_fill.lg_page_size = 0;
     desc->vindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
-    memset(desc->vtable, -1, sizeof(desc->vtable));
+    memset(desc->vtable, -1, vtlb_n_entries(desc) * sizeof(CPUTLBEntry));
 }
 
 static void tlb_flush_one_mmuidx_locked(CPUState *cpu, int mmu_idx,
@@ -305,6 +326,9 @@ static void tlb_mmu_init(CPUTLBDesc *desc, CPUTLBDescFast *fast, int64_t now)
     fast->mask = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
     fast->table = g_new(CPUTLBEntry, n_entries);
     desc->fulltlb = g_new(CPUTLBEntryFull, n_entries);
+    desc->vmask = tlb_victim_size / CPU_VTLB_WAYS - 1;
+    desc->vtable = g_new(CPUTLBEntry, vtlb_n_entries(desc));
+    desc->vfulltlb = g_new(CPUTLBEntryFull, vtlb_n_entries(desc));
     tlb_mmu_flush_locked(desc, fast);
 }
 
@@ -344,6 +368,8 @@ void tlb_destroy(CPUState *cpu)
 
         g_free(fast->table);
         g_free(desc->fulltlb);
+        g_free(desc->vtable);
+        g_free(desc->vfulltlb);
     }
 }
 
@@ -451,6 +477,31 @@ static inline bool tlb_hit_page_anyprot(CPUTLBEntry *tlb_entry, vaddr page)
     return tlb_hit_page_mask_anyprot(tlb_entry, page, -1);
 }
 
+/*
+ * Return true if @tlb_entry hits any page in [@addr, @addr + @len) under
+ * @mask, i.e. if tlb_hit_page_mask_anyprot() is true for any of them.
+ * @addr must be page aligned and @len must not exceed @mask.
+ */
+static bool tlb_hit_range_mask_anyprot(CPUTLBEntry *tlb_entry,
+                                       vaddr addr, vaddr len, vaddr mask)
+{
+    vaddr cmp[3] = {
+        tlb_entry->addr_read,
+        tlb_addr_write(tlb_entry),
+        tlb_entry->addr_code,
+    };
+    vaddr page_mask = mask & (TARGET_PAGE_MASK | TLB_INVALID_MASK);
+
+    for (int i = 0; i < ARRAY_SIZE(cmp); i++) {
+        vaddr diff = ((cmp[i] & page_mask) - addr) & mask;
+
+        if (diff < len && !(diff & ~TARGET_PAGE_MASK)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * tlb_entry_is_empty - return true if the entry is not in use
  * @te: pointer to CPUTLBEntry
@@ -460,6 +511,40 @@ static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
     return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
 }
 
+/**
+ * tlb_entry_page - return the page mapped by a non-empty entry
+ * @te: pointer to CPUTLBEntry
+ */
+static inline vaddr tlb_entry_page(const CPUTLBEntry *te)
+{
+    uint64_t addr = te->addr_read;
+
+    if (addr == -1) {
+        addr = tlb_addr_write(te);
+        if (addr == -1) {
+            addr = te->addr_code;
+        }
+    }
+    return addr & TARGET_PAGE_MASK;
+}
+
+/*
+ * Return the victim tlb entry in which to place the translation of PAGE,
+ * preferring an unused way of its set over round-robin replacement.
+ */
+static size_t vtlb_replace_index(CPUTLBDesc *desc, vaddr page)
+{
+    size_t set = vtlb_set_index(desc, page);
+    size_t i;
+
+    for (i = 0; i < CPU_VTLB_WAYS; i++) {
+        if (tlb_entry_is_empty(&desc->vtable[set + i])) {
+            return set + i;
+        }
+    }
+    return set + desc->vindex++ % CPU_VTLB_WAYS;
+}
+
 /* Called with tlb_c.lock held */
 static bool tlb_flush_entry_mask_locked(CPUTLBEntry *tlb_entry,
                                         vaddr page,
@@ -477,26 +562,41 @@ static inline bool tlb_flush_entry_locked(CPUTLBEntry *tlb_entry, vaddr page)
     return tlb_flush_entry_mask_locked(tlb_entry, page, -1);
 }
 
-/* Called with tlb_c.lock held */
-static void tlb_flush_vtlb_page_mask_locked(CPUState *cpu, int mmu_idx,
-                                            vaddr page,
-                                            vaddr mask)
+/*
+ * Called with tlb_c.lock held.  Entries that match under @mask may live in
+ * any set, so walk the whole victim tlb, but only once for the range.
+ */
+static void tlb_flush_vtlb_range_mask_locked(CPUState *cpu, int mmu_idx,
+                                             vaddr addr, vaddr len,
+                                             vaddr mask)
 {
     CPUTLBDesc *d = &cpu->neg.tlb.d[mmu_idx];
-    int k;
+    size_t k, n = vtlb_n_entries(d);
 
     assert_cpu_is_self(cpu);
-    for (k = 0; k < CPU_VTLB_SIZE; k++) {
-        if (tlb_flush_entry_mask_locked(&d->vtable[k], page, mask)) {
+    for (k = 0; k < n; k++) {
+        CPUTLBEntry *entry = &d->vtable[k];
+
+        if (tlb_hit_range_mask_anyprot(entry, addr, len, mask)) {
+            memset(entry, -1, sizeof(*entry));
             tlb_n_used_entries_dec(cpu, mmu_idx);
         }
     }
 }
 
-static inline void tlb_flush_vtlb_page_locked(CPUState *cpu, int mmu_idx,
-                                              vaddr page)
+/* Called with tlb_c.lock held */
+static void tlb_flush_vtlb_page_locked(CPUState *cpu, int mmu_idx,
+                                       vaddr page)
 {
-    tlb_flush_vtlb_page_mask_locked(cpu, mmu_idx, page, -1);
+    CPUTLBDesc *d = &cpu->neg.tlb.d[mmu_idx];
+    size_t k, set = vtlb_set_index(d, page);
+
+    assert_cpu_is_self(cpu);
+    for (k = set; k < set + CPU_VTLB_WAYS; k++) {
+        if (tlb_flush_entry_locked(&d->vtable[k], page)) {
+            tlb_n_used_entries_dec(cpu, mmu_idx);
+        }
+    }
 }
 
 static void tlb_flush_page_locked(CPUState *cpu, int midx, vaddr page)
@@ -706,8 +806,8 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
         if (tlb_flush_entry_mask_locked(entry, page, mask)) {
             tlb_n_used_entries_dec(cpu, midx);
         }
-        tlb_flush_vtlb_page_mask_locked(cpu, midx, page, mask);
     }
+    tlb_flush_vtlb_range_mask_locked(cpu, midx, addr & mask, len, mask);
 }
 
 typedef struct {
@@ -739,7 +839,7 @@ static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
      * If the length is larger than the jump cache size, then it will take
      * longer to clear each entry individually than it will to clear it all.
      */
-    if (d.len >= (TARGET_PAGE_SIZE * TB_JMP_CACHE_SIZE)) {
+    if (d.len >= TARGET_PAGE_SIZE * tb_jmp_cache_size(cpu->tb_jmp_cache)) {
         tcg_flush_jmp_cache(cpu);
         return;
     }
@@ -931,7 +1031,8 @@ void tlb_reset_dirty(CPUState *cpu, uintptr_t start, uintptr_t length)
                                          start, length);
         }
 
-        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        n = vtlb_n_entries(desc);
+        for (i = 0; i < n; i++) {
             tlb_reset_dirty_range_locked(&desc->vfulltlb[i], &desc->vtable[i],
                                          start, length);
         }
@@ -963,9 +1064,11 @@ static void tlb_set_dirty(CPUState *cpu, vaddr addr)
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_set_dirty1_locked(&cpu->neg.tlb.d[mmu_idx].vtable[k], addr);
+        CPUTLBDesc *desc = &cpu->neg.tlb.d[mmu_idx];
+        size_t k, set = vtlb_set_index(desc, addr);
+
+        for (k = set; k < set + CPU_VTLB_WAYS; k++) {
+            tlb_set_dirty1_locked(&desc->vtable[k], addr);
         }
     }
     qemu_spin_unlock(&cpu->neg.tlb.c.lock);
@@ -1042,6 +1145,11 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
     } else {
         sz = (hwaddr)1 << full->lg_page_size;
         tlb_add_large_page(cpu, mmu_idx, addr, sz);
+
+        /* Remember the translation for the rest of the large page. */
+        desc->lp_fill_page = addr & TARGET_PAGE_MASK;
+        desc->lp_fill = *full;
+        desc->lp_fill.phys_addr &= TARGET_PAGE_MASK;
     }
     addr_page = addr & TARGET_PAGE_MASK;
     paddr_page = full->phys_addr & TARGET_PAGE_MASK;
@@ -1128,7 +1236,7 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
      * different page; otherwise just overwrite the stale data.
      */
     if (!tlb_hit_page_anyprot(te, addr_page) && !tlb_entry_is_empty(te)) {
-        unsigned vidx = desc->vindex++ % CPU_VTLB_SIZE;
+        size_t vidx = vtlb_replace_index(desc, tlb_entry_page(te));
         CPUTLBEntry *tv = &desc->vtable[vidx];
 
         /* Evict the old entry into the victim tlb.  */
@@ -1229,6 +1337,46 @@ static inline bool tlb_hit(uint64_t tlb_addr, vaddr addr)
     return tlb_hit_page(tlb_addr, addr & TARGET_PAGE_MASK);
 }
 
+/*
+ * If ADDR lies within the large page of the last large page translation
+ * installed for MMU_IDX, and that translation grants access for TYPE,
+ * install the entry for ADDR from it rather than walking the guest page
+ * tables again.  The new entry is still subject to the usual MMIO,
+ * watchpoint and dirty tracking checks in tlb_set_page_full.
+ */
+static bool tlb_fill_from_large_page(CPUState *cpu, vaddr addr,
+                                     MMUAccessType type, int mmu_idx)
+{
+    static const int access_prot[MMU_ACCESS_COUNT] = {
+        [MMU_DATA_LOAD] = PAGE_READ,
+        [MMU_DATA_STORE] = PAGE_WRITE,
+        [MMU_INST_FETCH] = PAGE_EXEC,
+    };
+    CPUTLBDesc *desc = &cpu->neg.tlb.d[mmu_idx];
+    CPUTLBEntryFull full = desc->lp_fill;
+    vaddr page = addr & TARGET_PAGE_MASK;
+
+    if (full.lg_page_size == 0 ||
+        ((page ^ desc->lp_fill_page) >> full.lg_page_size) != 0) {
+        return false;
+    }
+    /*
+     * Without the permission, the target must decide whether to fault
+     * or e.g. to update accessed/dirty bits in the guest page tables.
+     * PAGE_WRITE_INV asks for every write to go through tlb_fill.
+     */
+    if (!(full.prot & access_prot[type]) || (full.prot & PAGE_WRITE_INV)) {
+        return false;
+    }
+
+    full.phys_addr += page - desc->lp_fill_page;
+    tlb_set_page_full(cpu, mmu_idx, page, &full);
+
+    qatomic_set(&cpu->neg.tlb.c.lp_fill_count,
+                cpu->neg.tlb.c.lp_fill_count + 1);
+    return true;
+}
+
 /*
  * Note: tlb_fill_align() can trigger a resize of the TLB.
  * This means that all of the caller's prior references to the TLB table
@@ -1243,6 +1391,16 @@ static bool tlb_fill_align(CPUState *cpu, vaddr addr, MMUAccessType type,
     CPUTLBEntryFull full;
 
     if (ops->tlb_fill_align) {
+        /*
+         * The target may raise alignment faults depending on the
+         * translation, so only bypass it for aligned accesses.
+         */
+        int align = MAX(size, 1 << memop_alignment_bits(memop));
+
+        if (is_power_of_2(align) && !(addr & (align - 1)) &&
+            tlb_fill_from_large_page(cpu, addr, type, mmu_idx)) {
+            return true;
+        }
         if (ops->tlb_fill_align(cpu, &full, addr, type, mmu_idx,
                                 memop, size, probe, ra)) {
             tlb_set_page_full(cpu, mmu_idx, addr, &full);
@@ -1253,6 +1411,9 @@ static bool tlb_fill_align(CPUState *cpu, vaddr addr, MMUAccessType type,
         if (addr & ((1u << memop_alignment_bits(memop)) - 1)) {
             ops->do_unaligned_access(cpu, addr, type, mmu_idx, ra);
         }
+        if (tlb_fill_from_large_page(cpu, addr, type, mmu_idx)) {
+            return true;
+        }
         if (ops->tlb_fill(cpu, addr, size, type, mmu_idx, probe, ra)) {
             return true;
         }
@@ -1306,30 +1467,50 @@ static void io_failed(CPUState *cpu, CPUTLBEntryFull *full, vaddr addr,
 static bool victim_tlb_hit(CPUState *cpu, size_t mmu_idx, size_t index,
                            MMUAccessType access_type, vaddr page)
 {
-    size_t vidx;
+    CPUTLBDesc *desc = &cpu->neg.tlb.d[mmu_idx];
+    size_t vidx, set = vtlb_set_index(desc, page);
 
     assert_cpu_is_self(cpu);
-    for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
-        CPUTLBEntry *vtlb = &cpu->neg.tlb.d[mmu_idx].vtable[vidx];
+    for (vidx = set; vidx < set + CPU_VTLB_WAYS; ++vidx) {
+        CPUTLBEntry *vtlb = &desc->vtable[vidx];
         uint64_t cmp = tlb_read_idx(vtlb, access_type);
 
         if (cmp == page) {
-            /* Found entry in victim tlb, swap tlb and iotlb.  */
             CPUTLBEntry tmptlb, *tlb = &cpu_tlb_fast(cpu, mmu_idx)->table[index];
+            CPUTLBEntryFull tmpf, *f1 = &desc->fulltlb[index];
+            size_t oidx = vidx;
 
+            /*
+             * Found entry in victim tlb.  Move it to the main tlb, and
+             * the entry it displaces to the victim set for its own page,
+             * which is this same slot when both pages share a set.
+             */
             qemu_spin_lock(&cpu->neg.tlb.c.lock);
             copy_tlb_helper_locked(&tmptlb, tlb);
             copy_tlb_helper_locked(tlb, vtlb);
-            copy_tlb_helper_locked(vtlb, &tmptlb);
+            if (tlb_entry_is_empty(&tmptlb)) {
+                memset(vtlb, -1, sizeof(*vtlb));
+            } else {
+                vaddr opage = tlb_entry_page(&tmptlb);
+                if (vtlb_set_index(desc, opage) != set) {
+                    memset(vtlb, -1, sizeof(*vtlb));
+                    oidx = vtlb_replace_index(desc, opage);
+                }
+                copy_tlb_helper_locked(&desc->vtable[oidx], &tmptlb);
+            }
             qemu_spin_unlock(&cpu->neg.tlb.c.lock);
 
-            CPUTLBEntryFull *f1 = &cpu->neg.tlb.d[mmu_idx].fulltlb[index];
-            CPUTLBEntryFull *f2 = &cpu->neg.tlb.d[mmu_idx].vfulltlb[vidx];
-            CPUTLBEntryFull tmpf;
-            tmpf = *f1; *f1 = *f2; *f2 = tmpf;
+            tmpf = *f1;
+            *f1 = desc->vfulltlb[vidx];
+            desc->vfulltlb[oidx] = tmpf;
+
+            qatomic_set(&cpu->neg.tlb.c.vtlb_hit_count,
+                        cpu->neg.tlb.c.vtlb_hit_count + 1);
             return true;
         }
     }
+    qatomic_set(&cpu->neg.tlb.c.vtlb_miss_count,
+                cpu->neg.tlb.c.vtlb_miss_count + 1);
     return false;
 }
 
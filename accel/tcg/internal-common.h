@@ -55,6 +55,9 @@ TranslationBlock *tb_link_page(TranslationBlock *tb);
 void cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
                                uintptr_t host_pc);
 
+/* Number of victim tlb entries per mmu_idx, set before any tlb_init. */
+extern unsigned int tlb_victim_size;
+
 /**
  * tlb_init - initialize a CPU's TLB
  * @cpu: CPU whose TLB should be initialized
@@ -138,6 +141,8 @@ G_NORETURN void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 #endif /* CONFIG_USER_ONLY */
 
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+void tb_reclaim__exclusive_or_serial(void);
+void queue_tb_reclaim(CPUState *cs);
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr);
 
 void tcg_get_stats(AccelState *accel, GString *buf);
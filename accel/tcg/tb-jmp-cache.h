@@ -12,8 +12,16 @@
 #include "qemu/rcu.h"
 #include "exec/cpu-common.h"
 
+/*
+ * The cache starts with 1 << TB_JMP_CACHE_BITS entries and is grown by
+ * its CPU, up to 1 << TB_JMP_CACHE_MAX_BITS, while more than 1 in
+ * TB_JMP_CACHE_GROW_RATIO of the lookups in a window of
+ * TB_JMP_CACHE_WINDOW lookups miss a TB that is present in the QHT.
+ */
 #define TB_JMP_CACHE_BITS 12
-#define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
+#define TB_JMP_CACHE_MAX_BITS 16
+#define TB_JMP_CACHE_WINDOW (1 << 16)
+#define TB_JMP_CACHE_GROW_RATIO 16
 
 /*
  * Invalidated in parallel; all accesses to 'tb' must be atomic.
@@ -21,13 +29,31 @@
  * no need for qatomic_rcu_read() and pc is always consistent with a
  * non-NULL value of 'tb'.  Strictly speaking pc is only needed for
  * CF_PCREL, but it's used always for simplicity.
+ *
+ * The cache itself is replaced when it grows, so other threads must
+ * use qatomic_rcu_read() on cpu->tb_jmp_cache within an RCU critical
+ * section.  The counters are only written by the owning CPU.
  */
 typedef struct CPUJumpCache {
     struct rcu_head rcu;
+    /* log2 of the number of entries in array.  */
+    unsigned int bits;
+    /* Lookups satisfied by the cache.  */
+    size_t hit_count;
+    /* Lookups missing the cache but found in the QHT.  */
+    size_t miss_count;
+    /* Value of hit_count + miss_count and miss_count at window start.  */
+    size_t window_lookups;
+    size_t window_misses;
     struct {
         TranslationBlock *tb;
         vaddr pc;
-    } array[TB_JMP_CACHE_SIZE];
+    } array[];
 } CPUJumpCache;
 
+static inline size_t tb_jmp_cache_size(const CPUJumpCache *jc)
+{
+    return (size_t)1 << jc->bits;
+}
+
 #endif /* ACCEL_TCG_TB_JMP_CACHE_H */
@@ -28,6 +28,7 @@
 #include "exec/target_page.h"
 #include "accel/tcg/cpu-ops.h"
 #include "tb-internal.h"
+#include "qemu/plugin.h"
 #include "system/tcg.h"
 #include "tcg/tcg.h"
 #include "tb-hash.h"
@@ -901,10 +902,9 @@ static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
             tcg_flush_jmp_cache(cpu);
         }
     } else {
-        uint32_t h = tb_jmp_cache_hash_func(tb->pc);
-
         CPU_FOREACH(cpu) {
-            CPUJumpCache *jc = cpu->tb_jmp_cache;
+            CPUJumpCache *jc = qatomic_rcu_read(&cpu->tb_jmp_cache);
+            uint32_t h = tb_jmp_cache_hash_func(jc, tb->pc);
 
             if (qatomic_read(&jc->array[h].tb) == tb) {
                 qatomic_set(&jc->array[h].tb, NULL);
@@ -980,6 +980,96 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
 }
 
+/*
+ * Unlink a TB whose code is about to be overwritten by tcg_region_reclaim.
+ * Unlike a plain invalidation, this must also undo the jumps of one-shot
+ * TBs, which are never added to the QHT.
+ */
+static void tb_reclaim_one(TranslationBlock *tb)
+{
+    if (tb_page_addr0(tb) != -1) {
+        /* No-op if the TB has already been invalidated. */
+        tb_phys_invalidate(tb, -1);
+        return;
+    }
+
+    qemu_spin_lock(&tb->jmp_lock);
+    qatomic_set(&tb->cflags, tb->cflags | CF_INVALID);
+    qemu_spin_unlock(&tb->jmp_lock);
+
+    tb_remove_from_jmp_list(tb, 0);
+    tb_remove_from_jmp_list(tb, 1);
+    tb_jmp_unlink(tb);
+}
+
+static bool tb_reclaim_possible(void)
+{
+#ifdef CONFIG_PLUGIN
+    CPUState *cpu;
+
+    /*
+     * Plugin instrumentation keeps per-TB state that is only released
+     * by a full flush, see qemu_plugin_flush_cb().
+     */
+    CPU_FOREACH(cpu) {
+        if (cpu->plugin_state &&
+            !bitmap_empty(cpu->plugin_state->event_mask, QEMU_PLUGIN_EV_MAX)) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+/*
+ * Make room in the code buffer after it has filled up.  Rather than
+ * throwing away every translation, recycle only the regions that were
+ * filled the longest time ago; fall back to a full flush when that is
+ * not possible.  Same calling constraints as tb_flush__exclusive_or_serial.
+ */
+void tb_reclaim__exclusive_or_serial(void)
+{
+    CPUState *cpu;
+    size_t n = 0;
+
+    assert(tcg_enabled());
+    assert(!runstate_is_running() ||
+           (current_cpu && cpu_in_serial_context(current_cpu)));
+
+    if (tb_reclaim_possible()) {
+        qemu_thread_jit_write();
+        n = tcg_region_reclaim(tb_reclaim_one);
+        qemu_thread_jit_execute();
+    }
+    if (n == 0) {
+        tb_flush__exclusive_or_serial();
+        return;
+    }
+
+    trace_tb_reclaim(n);
+    /* One-shot TBs are entered in the jump caches but not removed above. */
+    CPU_FOREACH(cpu) {
+        tcg_flush_jmp_cache(cpu);
+    }
+    qatomic_inc(&tb_ctx.tb_reclaim_count);
+}
+
+static void do_tb_reclaim(CPUState *cpu, run_on_cpu_data gen)
+{
+    /* Retry if another CPU has already made room in the meantime. */
+    if (tb_ctx.tb_flush_count + tb_ctx.tb_reclaim_count == gen.host_int) {
+        tb_reclaim__exclusive_or_serial();
+    }
+}
+
+void queue_tb_reclaim(CPUState *cs)
+{
+    unsigned gen = qatomic_read(&tb_ctx.tb_flush_count) +
+                   qatomic_read(&tb_ctx.tb_reclaim_count);
+
+    async_safe_run_on_cpu(cs, do_tb_reclaim, RUN_ON_CPU_HOST_INT(gen));
+}
+
 /*
  * Add a new TB and link it to the physical page tables.
  * Called with mmap_lock held for user-mode emulation.
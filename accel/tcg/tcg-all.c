@@ -36,8 +36,10 @@
 #include "qapi/qapi-builtin-visit.h"
 #include "qemu/units.h"
 #include "qemu/target-info.h"
+#include "qemu/host-utils.h"
 #ifndef CONFIG_USER_ONLY
 #include "hw/core/boards.h"
+#include "hw/core/cpu.h"
 #include "exec/tb-flush.h"
 #include "system/runstate.h"
 #endif
@@ -54,6 +56,7 @@ struct TCGState {
     bool one_insn_per_tb;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t victim_tlb_size;
 };
 typedef struct TCGState TCGState;
 
@@ -80,6 +83,9 @@ static void tcg_accel_instance_init(Object *obj)
 #else
     s->splitwx_enabled = 0;
 #endif
+#ifndef CONFIG_USER_ONLY
+    s->victim_tlb_size = CPU_VTLB_DEFAULT_SIZE;
+#endif
 }
 
 bool one_insn_per_tb;
@@ -145,6 +151,7 @@ static int tcg_init_machine(AccelState *as, MachineState *ms)
     }
 
     qemu_add_vm_change_state_handler(tcg_vm_change_state, NULL);
+    tlb_victim_size = s->victim_tlb_size;
 #endif
 
     tcg_allowed = true;
@@ -216,6 +223,39 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+#ifndef CONFIG_USER_ONLY
+static void tcg_get_victim_tlb_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->victim_tlb_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_victim_tlb_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    if (!is_power_of_2(value) || value < CPU_VTLB_WAYS ||
+        value > CPU_VTLB_MAX_SIZE) {
+        error_setg(errp, "victim-tlb-size must be a power of 2 "
+                   "between %d and %d", CPU_VTLB_WAYS, CPU_VTLB_MAX_SIZE);
+        return;
+    }
+
+    s->victim_tlb_size = value;
+}
+#endif
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -278,6 +318,14 @@ static void tcg_accel_class_init(ObjectClass *oc, const void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+#ifndef CONFIG_USER_ONLY
+    object_class_property_add(oc, "victim-tlb-size", "int",
+        tcg_get_victim_tlb_size, tcg_set_victim_tlb_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "victim-tlb-size",
+        "Number of entries in each softmmu victim TLB");
+#endif
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
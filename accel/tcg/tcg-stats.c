@@ -16,6 +16,7 @@
 #include "tcg/tcg.h"
 #include "internal-common.h"
 #include "tb-context.h"
+#include "tb-jmp-cache.h"
 #include <math.h>
 
 static void dump_drift_info(GString *buf)
@@ -132,6 +133,41 @@ static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
     return false;
 }
 
+static void tb_jmp_cache_counts(size_t *phit, size_t *pmiss, size_t *psize)
+{
+    CPUState *cpu;
+    size_t hit = 0, miss = 0, size = 0;
+
+    RCU_READ_LOCK_GUARD();
+    CPU_FOREACH(cpu) {
+        CPUJumpCache *jc = qatomic_rcu_read(&cpu->tb_jmp_cache);
+
+        if (jc) {
+            hit += qatomic_read(&jc->hit_count);
+            miss += qatomic_read(&jc->miss_count);
+            size = MAX(size, tb_jmp_cache_size(jc));
+        }
+    }
+    *phit = hit;
+    *pmiss = miss;
+    *psize = size;
+}
+
+static void tlb_victim_counts(size_t *phit, size_t *pmiss, size_t *plp)
+{
+    CPUState *cpu;
+    size_t hit = 0, miss = 0, lp = 0;
+
+    CPU_FOREACH(cpu) {
+        hit += qatomic_read(&cpu->neg.tlb.c.vtlb_hit_count);
+        miss += qatomic_read(&cpu->neg.tlb.c.vtlb_miss_count);
+        lp += qatomic_read(&cpu->neg.tlb.c.lp_fill_count);
+    }
+    *phit = hit;
+    *pmiss = miss;
+    *plp = lp;
+}
+
 static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 {
     CPUState *cpu;
@@ -150,16 +186,38 @@ static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 static void tcg_dump_flush_info(GString *buf)
 {
     size_t flush_full, flush_part, flush_elide;
+    size_t vtlb_hit, vtlb_miss, lp_fill;
+    size_t jc_hit, jc_miss, jc_size;
 
     g_string_append_printf(buf, "TB flush count      %u\n",
                            qatomic_read(&tb_ctx.tb_flush_count));
+    g_string_append_printf(buf, "TB reclaim count    %u\n",
+                           qatomic_read(&tb_ctx.tb_reclaim_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
 
+    tb_jmp_cache_counts(&jc_hit, &jc_miss, &jc_size);
+    g_string_append_printf(buf, "TB jmp cache size   %zu (largest vCPU)\n",
+                           jc_size);
+    g_string_append_printf(buf, "TB jmp cache hits   %zu (%zu%%)\n", jc_hit,
+                           jc_hit + jc_miss ?
+                           jc_hit * 100 / (jc_hit + jc_miss) : 0);
+    g_string_append_printf(buf, "TB jmp cache misses %zu\n", jc_miss);
+
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
     g_string_append_printf(buf, "TLB partial flushes %zu\n", flush_part);
     g_string_append_printf(buf, "TLB elided flushes  %zu\n", flush_elide);
+
+    tlb_victim_counts(&vtlb_hit, &vtlb_miss, &lp_fill);
+#ifndef CONFIG_USER_ONLY
+    g_string_append_printf(buf, "TLB victim size     %u\n", tlb_victim_size);
+#endif
+    g_string_append_printf(buf, "TLB victim hits     %zu (%zu%%)\n", vtlb_hit,
+                           vtlb_hit + vtlb_miss ?
+                           vtlb_hit * 100 / (vtlb_hit + vtlb_miss) : 0);
+    g_string_append_printf(buf, "TLB victim misses   %zu\n", vtlb_miss);
+    g_string_append_printf(buf, "TLB huge page fills %zu\n", lp_fill);
 }
 
 static void dump_exec_info(GString *buf)
@@ -111,6 +111,11 @@ void aio_task_pool_free(AioTaskPool *pool)
     g_free(pool);
 }
 
+int aio_task_pool_busy_tasks(AioTaskPool *pool)
+{
+    return pool->busy_tasks;
+}
+
 int aio_task_pool_status(AioTaskPool *pool)
 {
     if (!pool) {
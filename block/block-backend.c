@@ -2834,6 +2834,32 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * Like blk_co_copy_range(), but copy from @src, for block jobs that read
+ * their source through a child of their own filter node.
+ */
+int coroutine_fn
+blk_co_copy_range_from(BdrvChild *src, int64_t off_in,
+                       BlockBackend *blk_out, int64_t off_out,
+                       int64_t bytes, BdrvRequestFlags read_flags,
+                       BdrvRequestFlags write_flags)
+{
+    int r;
+    IO_CODE();
+    assert_bdrv_graph_readable();
+
+    r = blk_check_byte_request(blk_out, off_out, bytes);
+    if (r) {
+        return r;
+    }
+
+    blk_inc_in_flight(blk_out);
+    r = bdrv_co_copy_range(src, off_in, blk_out->root, off_out,
+                           bytes, read_flags, write_flags);
+    blk_dec_in_flight(blk_out);
+    return r;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     GLOBAL_STATE_CODE();
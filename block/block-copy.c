@@ -25,6 +25,7 @@
 #include "qemu/co-shared-resource.h"
 #include "qemu/coroutine.h"
 #include "qemu/ratelimit.h"
+#include "qemu/timer.h"
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
@@ -36,6 +37,15 @@
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
+/*
+ * The latency of background and copy-before-write copies is measured against
+ * a baseline taken over the first slices that have such copies.  Latency
+ * counts as grown when it exceeds the baseline by BLOCK_COPY_LATENCY_FACTOR.
+ * See block_copy_adapt().
+ */
+#define BLOCK_COPY_BASELINE_SLICES 4
+#define BLOCK_COPY_LATENCY_FACTOR 2
+
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
     COPY_READ_WRITE,
@@ -54,6 +64,8 @@ typedef struct BlockCopyCallState {
     int max_workers;
     int64_t max_chunk;
     bool ignore_ratelimit;
+    /* Started by block_copy_async(), as opposed to a guest write */
+    bool background;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
     /* Coroutine where async block-copy is running */
@@ -129,6 +141,7 @@ typedef struct BlockCopyState {
     int64_t max_transfer;
     uint64_t len;
     BdrvRequestFlags write_flags;
+    bool default_copy_range;
 
     /*
      * Fields whose state changes throughout the execution
@@ -140,6 +153,29 @@ typedef struct BlockCopyState {
     bool discard_source;
     BlockReqList reqs;
     QLIST_HEAD(, BlockCopyCallState) calls;
+
+    /*
+     * Limits for background calls, reduced by block_copy_adapt() while the
+     * latency of foreground calls is above its baseline.  bg_chunk_size 0
+     * means no limit besides the copy method's chunk size.  While
+     * foreground calls are running and their latency has grown, background
+     * calls are also limited to a single worker.
+     */
+    int bg_workers;
+    int64_t bg_chunk_size;
+    int fg_calls;
+    bool fg_latency_grew;
+    /* Latency baselines, and the number of slices they are taken over */
+    int baseline_slices;
+    uint64_t latency_baseline_ns;
+    int fg_baseline_slices;
+    uint64_t fg_latency_baseline_ns;
+    /* Statistics over the current slice of BLOCK_COPY_SLICE_TIME */
+    int64_t slice_start_ns;
+    uint64_t slice_bytes;
+    uint64_t slice_tasks;
+    uint64_t slice_latency_ns;
+    uint64_t slice_fg_latency_ns;
     /*
      * skip_unallocated:
      *
@@ -194,6 +230,9 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
 
     QEMU_LOCK_GUARD(&s->lock);
     max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    if (call_state->background) {
+        max_chunk = MIN_NON_ZERO(max_chunk, s->bg_chunk_size);
+    }
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -282,6 +321,23 @@ static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
                                      target->bs->bl.max_transfer));
 }
 
+/*
+ * Offloaded copies bypass detect-zeroes on the target, and format drivers
+ * that could have kept zeroes sparse.  Only use them by default between raw
+ * nodes, like mirror does.
+ */
+static bool GRAPH_RDLOCK
+block_copy_can_copy_range(BlockDriverState *source, BlockDriverState *target)
+{
+    return source->drv == &bdrv_raw && target->drv == &bdrv_raw &&
+           target->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
+}
+
+bool block_copy_default_copy_range(BlockCopyState *s)
+{
+    return s->default_copy_range;
+}
+
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress)
 {
@@ -366,7 +422,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     BlockCopyState *s;
     int64_t cluster_size;
     BdrvDirtyBitmap *copy_bitmap;
-    bool is_fleecing;
+    bool is_fleecing, can_copy_range;
 
     GLOBAL_STATE_CODE();
 
@@ -420,6 +476,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
      */
     bdrv_graph_rdlock_main_loop();
     is_fleecing = bdrv_chain_contains(target->bs, source->bs);
+    can_copy_range = block_copy_can_copy_range(source->bs, target->bs);
     bdrv_graph_rdunlock_main_loop();
 
     s = g_new(BlockCopyState, 1);
@@ -430,6 +487,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         .cluster_size = cluster_size,
         .len = bdrv_dirty_bitmap_size(copy_bitmap),
         .write_flags = (is_fleecing ? BDRV_REQ_SERIALISING : 0),
+        .default_copy_range = can_copy_range,
         .mem = shres_create(BLOCK_COPY_MAX_MEM),
         .max_transfer = QEMU_ALIGN_DOWN(
                                     block_copy_max_transfer(source, target),
@@ -437,7 +495,10 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     };
 
     s->discard_source = discard_source;
-    block_copy_set_copy_opts(s, false, false);
+    block_copy_set_copy_opts(s, can_copy_range, false);
+
+    s->bg_workers = BLOCK_COPY_MAX_WORKERS;
+    s->slice_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     ratelimit_init(&s->rate_limit);
     qemu_co_mutex_init(&s->lock);
@@ -535,7 +596,10 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
         }
 
         trace_block_copy_copy_range_fail(s, offset, ret);
-        *method = COPY_READ_WRITE;
+        if (ret != -ENOSPC) {
+            /* Unsupported for this source and target, stop trying */
+            *method = COPY_READ_WRITE;
+        }
         /* Fall through to read+write with allocated buffer */
 
     case COPY_READ_WRITE_CLUSTER:
@@ -578,24 +642,118 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
     return ret;
 }
 
+/*
+ * Add @value to the running mean @baseline over the first
+ * BLOCK_COPY_BASELINE_SLICES samples.  Return whether the baseline was
+ * already complete; only then is @value compared against it.
+ */
+static bool block_copy_update_baseline(uint64_t *baseline, int *slices,
+                                       uint64_t value)
+{
+    if (*slices >= BLOCK_COPY_BASELINE_SLICES) {
+        return true;
+    }
+    *baseline = (*baseline * *slices + value) / (*slices + 1);
+    (*slices)++;
+    return false;
+}
+
+/*
+ * Called with lock held at the end of each task and foreground call.  Once
+ * per slice, adjust the limits for background calls.
+ *
+ * Background calls start with max-workers and the copy method's chunk size,
+ * as they did before they adapted.  They only go below that if foreground
+ * (copy-before-write) calls take longer than at the start of the job, which
+ * is what makes guest writes wait during backup; then the limits are
+ * halved.  Otherwise, they grow back towards the starting point, unless
+ * background copies themselves take longer than at the start of the job.
+ * An absolute latency target would throttle slow targets needlessly.
+ */
+static void block_copy_adapt(BlockCopyState *s, int64_t now)
+{
+    int64_t elapsed = now - s->slice_start_ns;
+    int64_t max_chunk;
+    uint64_t throughput, latency;
+    bool latency_grew = false;
+
+    if (elapsed < BLOCK_COPY_SLICE_TIME) {
+        return;
+    }
+
+    throughput = muldiv64(s->slice_bytes, NANOSECONDS_PER_SECOND, elapsed);
+    latency = s->slice_tasks ? s->slice_latency_ns / s->slice_tasks : 0;
+
+    if (s->slice_tasks &&
+        block_copy_update_baseline(&s->latency_baseline_ns,
+                                   &s->baseline_slices, latency)) {
+        latency_grew = latency >
+            s->latency_baseline_ns * BLOCK_COPY_LATENCY_FACTOR;
+    }
+    if (s->slice_fg_latency_ns &&
+        block_copy_update_baseline(&s->fg_latency_baseline_ns,
+                                   &s->fg_baseline_slices,
+                                   s->slice_fg_latency_ns)) {
+        s->fg_latency_grew = s->slice_fg_latency_ns >
+            s->fg_latency_baseline_ns * BLOCK_COPY_LATENCY_FACTOR;
+    }
+
+    max_chunk = block_copy_chunk_size(s);
+    if (s->slice_fg_latency_ns && s->fg_latency_grew) {
+        s->bg_workers = MAX(s->bg_workers / 2, 1);
+        s->bg_chunk_size = MAX(MIN_NON_ZERO(s->bg_chunk_size, max_chunk) / 2,
+                               s->cluster_size);
+    } else if (latency_grew) {
+        /* Growing would only add to the queue in the target */
+    } else {
+        s->bg_workers = MIN(s->bg_workers + 1, BLOCK_COPY_MAX_WORKERS);
+        if (s->bg_chunk_size) {
+            s->bg_chunk_size *= 2;
+            if (s->bg_chunk_size >= max_chunk) {
+                s->bg_chunk_size = 0;
+            }
+        }
+    }
+
+    trace_block_copy_adapt(s, throughput, latency, s->slice_fg_latency_ns,
+                           s->bg_workers, s->bg_chunk_size);
+
+    s->slice_start_ns = now;
+    s->slice_bytes = 0;
+    s->slice_tasks = 0;
+    s->slice_latency_ns = 0;
+    s->slice_fg_latency_ns = 0;
+}
+
 static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
     BlockCopyState *s = t->s;
     bool error_is_read = false;
     BlockCopyMethod method = t->method;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t end_ns;
     int ret = -1;
 
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = block_copy_do_copy(s, t->req.offset, t->req.bytes, &method,
                                  &error_is_read);
     }
+    end_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     WITH_QEMU_LOCK_GUARD(&s->lock) {
         if (s->method == t->method) {
             s->method = method;
         }
 
+        if (t->call_state->background && ret >= 0 &&
+            t->method != COPY_WRITE_ZEROES) {
+            s->slice_bytes += t->req.bytes;
+            s->slice_tasks++;
+            s->slice_latency_ns += end_ns - start_ns;
+        }
+        block_copy_adapt(s, end_ns);
+
         if (ret < 0) {
             if (!t->call_state->ret) {
                 t->call_state->ret = ret;
@@ -619,12 +777,25 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     return ret;
 }
 
+/*
+ * Block status of the source, queried in batches for the whole range of a
+ * block_copy_dirty_clusters() call.
+ */
+typedef struct BlockCopyStatusCache {
+    BlockStatusExtent extents[BDRV_BLOCK_STATUS_BATCH];
+    BlockDriverState *base;
+    int nb;
+    int idx;
+} BlockCopyStatusCache;
+
 static coroutine_fn GRAPH_RDLOCK
-int block_copy_block_status(BlockCopyState *s, int64_t offset, int64_t bytes,
+int block_copy_block_status(BlockCopyState *s, BlockCopyStatusCache *cache,
+                            int64_t offset, int64_t bytes, int64_t end,
                             int64_t *pnum)
 {
-    int64_t num;
+    int64_t num = 0;
     BlockDriverState *base;
+    BlockStatusExtent *e;
     int ret;
 
     if (qatomic_read(&s->skip_unallocated)) {
@@ -633,9 +804,27 @@ int block_copy_block_status(BlockCopyState *s, int64_t offset, int64_t bytes,
         base = NULL;
     }
 
-    ret = bdrv_co_block_status_above(s->source->bs, base, offset, bytes, &num,
-                                     NULL, NULL);
-    if (ret < 0 || num < s->cluster_size) {
+    while (cache->idx < cache->nb &&
+           offset >= cache->extents[cache->idx].offset +
+                     cache->extents[cache->idx].bytes) {
+        cache->idx++;
+    }
+    if (cache->idx == cache->nb || cache->base != base ||
+        offset < cache->extents[cache->idx].offset) {
+        ret = bdrv_co_block_status_above_batch(s->source->bs, base, offset,
+                                               end - offset, cache->extents,
+                                               BDRV_BLOCK_STATUS_BATCH);
+        cache->base = base;
+        cache->nb = MAX(ret, 0);
+        cache->idx = 0;
+    }
+
+    if (cache->nb) {
+        e = &cache->extents[cache->idx];
+        num = MIN(e->offset + e->bytes - offset, bytes);
+        ret = e->ret;
+    }
+    if (!cache->nb || num < s->cluster_size) {
         /*
          * On error or if failed to obtain large enough chunk just fallback to
          * copy one cluster.
@@ -661,38 +850,45 @@ block_copy_is_cluster_allocated(BlockCopyState *s, int64_t offset,
                                 int64_t *pnum)
 {
     BlockDriverState *bs = s->source->bs;
-    int64_t count, total_count = 0;
+    BlockStatusExtent extents[BDRV_BLOCK_STATUS_BATCH];
+    int64_t total_count = 0;
     int64_t bytes = s->len - offset;
-    int ret;
+    int i, n;
 
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
 
     while (true) {
         /* protected in backup_run() */
-        ret = bdrv_co_is_allocated(bs, offset, bytes, &count);
-        if (ret < 0) {
-            return ret;
+        n = bdrv_co_is_allocated_above_batch(bs, bs, true, offset, bytes,
+                                             extents, BDRV_BLOCK_STATUS_BATCH);
+        if (n < 0) {
+            return n;
         }
 
-        total_count += count;
-
-        if (ret || count == 0) {
-            /*
-             * ret: partial segment(s) are considered allocated.
-             * otherwise: unallocated tail is treated as an entire segment.
-             */
+        if (n == 0) {
+            /* Unallocated tail is treated as an entire segment */
             *pnum = DIV_ROUND_UP(total_count, s->cluster_size);
-            return ret;
-        }
-
-        /* Unallocated segment(s) with uncertain following segment(s) */
-        if (total_count >= s->cluster_size) {
-            *pnum = total_count / s->cluster_size;
             return 0;
         }
 
-        offset += count;
-        bytes -= count;
+        for (i = 0; i < n; i++) {
+            total_count += extents[i].bytes;
+
+            if (extents[i].depth) {
+                /* Partial segment(s) are considered allocated */
+                *pnum = DIV_ROUND_UP(total_count, s->cluster_size);
+                return 1;
+            }
+
+            /* Unallocated segment(s) with uncertain following segment(s) */
+            if (total_count >= s->cluster_size) {
+                *pnum = total_count / s->cluster_size;
+                return 0;
+            }
+
+            offset += extents[i].bytes;
+            bytes -= extents[i].bytes;
+        }
     }
 }
 
@@ -736,6 +932,31 @@ int64_t coroutine_fn block_copy_reset_unallocated(BlockCopyState *s,
     return ret;
 }
 
+/*
+ * Wait until background call @call_state may start another task.  Only
+ * tasks that are already running are waited for, so that foreground calls
+ * never have to wait for a background task that is held back.
+ */
+static void coroutine_fn
+block_copy_wait_background_slot(BlockCopyCallState *call_state,
+                                 AioTaskPool *aio)
+{
+    BlockCopyState *s = call_state->s;
+    int max_workers;
+
+    while (aio_task_pool_busy_tasks(aio) > 0) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            max_workers = s->fg_calls && s->fg_latency_grew ?
+                          1 : s->bg_workers;
+        }
+        if (aio_task_pool_busy_tasks(aio) <
+            MIN(max_workers, call_state->max_workers)) {
+            break;
+        }
+        aio_task_pool_wait_one(aio);
+    }
+}
+
 /*
  * block_copy_dirty_clusters
  *
@@ -754,6 +975,7 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     bool found_dirty = false;
     int64_t end = offset + bytes;
     AioTaskPool *aio = NULL;
+    BlockCopyStatusCache status_cache = { 0 };
 
     /*
      * block_copy() user is responsible for keeping source and target in same
@@ -770,6 +992,10 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         BlockCopyTask *task;
         int64_t status_bytes;
 
+        if (aio && call_state->background) {
+            block_copy_wait_background_slot(call_state, aio);
+        }
+
         task = block_copy_task_create(s, call_state, offset, bytes);
         if (!task) {
             /* No more dirty bits in the bitmap */
@@ -782,8 +1008,8 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         found_dirty = true;
 
-        ret = block_copy_block_status(s, task->req.offset, task->req.bytes,
-                                      &status_bytes);
+        ret = block_copy_block_status(s, &status_cache, task->req.offset,
+                                      task->req.bytes, end, &status_bytes);
         assert(ret >= 0); /* never fail */
         if (status_bytes < task->req.bytes) {
             block_copy_task_shrink(task, status_bytes);
@@ -871,9 +1097,14 @@ block_copy_common(BlockCopyCallState *call_state)
 {
     int ret;
     BlockCopyState *s = call_state->s;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t end_ns;
 
     qemu_co_mutex_lock(&s->lock);
     QLIST_INSERT_HEAD(&s->calls, call_state, list);
+    if (!call_state->background) {
+        s->fg_calls++;
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     do {
@@ -925,6 +1156,13 @@ block_copy_common(BlockCopyCallState *call_state)
 
     qemu_co_mutex_lock(&s->lock);
     QLIST_REMOVE(call_state, list);
+    if (!call_state->background) {
+        end_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        s->fg_calls--;
+        s->slice_fg_latency_ns = MAX(s->slice_fg_latency_ns,
+                                     end_ns - start_ns);
+        block_copy_adapt(s, end_ns);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -983,6 +1221,7 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .background = true,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
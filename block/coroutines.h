@@ -55,6 +55,16 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
                                   BlockDriverState **file,
                                   int *depth);
 
+int coroutine_fn GRAPH_RDLOCK
+bdrv_co_common_block_status_above_batch(BlockDriverState *bs,
+                                        BlockDriverState *base,
+                                        bool include_base,
+                                        unsigned int mode,
+                                        int64_t offset,
+                                        int64_t bytes,
+                                        BlockStatusExtent *extents,
+                                        int max_extents);
+
 int coroutine_fn GRAPH_RDLOCK
 bdrv_co_readv_vmstate(BlockDriverState *bs, QEMUIOVector *qiov, int64_t pos);
 
@@ -38,6 +38,7 @@
 #include "block/raw-aio.h"
 #include "qobject/qdict.h"
 #include "qobject/qstring.h"
+#include "system/memory.h" /* for ram_block_discard_disable() */
 
 #include "scsi/pr-manager.h"
 #include "scsi/constants.h"
@@ -180,9 +181,13 @@ typedef struct BDRVRawState {
 
     bool has_discard:1;
     bool has_write_zeroes:1;
+    bool has_clone_range:1;
     bool use_linux_aio:1;
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
+    bool use_fixed_buffers:1;
+    bool use_io_uring_poll:1;
+    bool use_io_uring_sqpoll:1;
     bool use_mpath:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
@@ -585,6 +590,17 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "aio-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM as io_uring fixed buffers (default: off)",
+        },
+        {
+            .name = "aio-poll",
+            .type = QEMU_OPT_STRING,
+            .help = "io_uring completion polling (off, iopoll, sqpoll, "
+                    "default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -613,6 +629,29 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+/*
+ * With aio=io_uring, the file descriptor is registered as an io_uring fixed
+ * file so that the kernel does not have to look it up for every request.
+ */
+static void raw_register_fixed_file(BDRVRawState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        aio_register_fixed_file(s->fd);
+    }
+#endif
+}
+
+/* Must be called before closing a file descriptor that may be registered */
+static void raw_unregister_fixed_file(BDRVRawState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        aio_unregister_fixed_file(s->fd);
+    }
+#endif
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -623,6 +662,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     const char *filename = NULL;
     const char *str;
     BlockdevAioOptions aio, aio_default;
+#ifdef CONFIG_LINUX_IO_URING
+    BlockdevAioPoll aio_poll;
+#endif
     int fd, ret;
     struct stat st;
     OnOffAuto locking;
@@ -665,6 +707,20 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
+    s->use_fixed_buffers = qemu_opt_get_bool(opts, "aio-fixed-buffers", false);
+
+#ifdef CONFIG_LINUX_IO_URING
+    aio_poll = qapi_enum_parse(&BlockdevAioPoll_lookup,
+                               qemu_opt_get(opts, "aio-poll"),
+                               BLOCKDEV_AIO_POLL_OFF, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->use_io_uring_poll = (aio_poll != BLOCKDEV_AIO_POLL_OFF);
+    s->use_io_uring_sqpoll = (aio_poll == BLOCKDEV_AIO_POLL_SQPOLL);
+#endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -773,6 +829,27 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif /* !defined(CONFIG_LINUX_IO_URING) */
     }
 
+    if (s->use_fixed_buffers && !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed-buffers requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (s->use_io_uring_poll) {
+        if (!s->use_linux_io_uring) {
+            error_setg(errp, "aio-poll requires aio=io_uring");
+            ret = -EINVAL;
+            goto fail;
+        }
+        /* The kernel only polls for direct I/O completions */
+        if (!(s->open_flags & O_DIRECT)) {
+            error_setg(errp, "aio-poll requires cache.direct=on, which was "
+                             "not specified");
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     s->has_discard = true;
     s->has_write_zeroes = true;
 
@@ -790,6 +867,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
             goto fail;
         } else {
             s->has_fallocate = true;
+            s->has_clone_range = true;
         }
     } else {
         if (!(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))) {
@@ -838,6 +916,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+    /* Fixed buffers stay pinned for as long as they are registered */
+    if (s->use_fixed_buffers) {
+        ret = ram_block_discard_disable(true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "ram_block_discard_disable() failed");
+            goto fail;
+        }
+    }
+
+    raw_register_fixed_file(s);
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2270,6 +2359,44 @@ static int handle_aiocb_zone_mgmt(void *opaque)
 }
 #endif
 
+/*
+ * Try to share the source data with the destination instead of copying it.
+ * This fails unless both files are on the same filesystem, which must
+ * support reflinks, and the range is aligned to its block size (except at
+ * the end of the source file).
+ */
+static int handle_aiocb_clone_range(RawPosixAIOData *aiocb)
+{
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range range = {
+        .src_fd         = aiocb->aio_fildes,
+        .src_offset     = aiocb->aio_offset,
+        .src_length     = aiocb->aio_nbytes,
+        .dest_offset    = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    if (!s->has_clone_range) {
+        return -ENOTSUP;
+    }
+
+    ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    ret = ret < 0 ? -errno : 0;
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret);
+    if (ret == -EOPNOTSUPP || ret == -ENOTTY || ret == -ENOSYS) {
+        /* The filesystem can't do it, don't try again */
+        s->has_clone_range = false;
+    }
+    return ret;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2277,6 +2404,11 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+    /* Fall back to copying if cloning fails, whatever the reason */
+    if (handle_aiocb_clone_range(aiocb) == 0) {
+        return 0;
+    }
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -2547,6 +2679,35 @@ static bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
     return true;
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static inline bool raw_check_io_uring_poll(BDRVRawState *s, int type,
+                                           int flags)
+{
+    Error *local_err = NULL;
+    AioContext *ctx;
+
+    /*
+     * Polled rings only support reads and writes.  FUA writes may have to
+     * flush the disk cache on completion, so leave them to the normal ring.
+     */
+    if (!s->use_io_uring_poll ||
+        (type != QEMU_AIO_READ && type != QEMU_AIO_WRITE) ||
+        (flags & BDRV_REQ_FUA)) {
+        return false;
+    }
+
+    ctx = qemu_get_current_aio_context();
+    if (unlikely(!aio_setup_linux_io_uring_poll(ctx, s->use_io_uring_sqpoll,
+                                                &local_err))) {
+        error_reportf_err(local_err, "Unable to use polled io_uring, "
+                                     "falling back to interrupts: ");
+        s->use_io_uring_poll = false;
+        return false;
+    }
+    return true;
+}
+#endif
+
 #ifdef CONFIG_LINUX_AIO
 static inline bool raw_check_linux_aio(BDRVRawState *s)
 {
@@ -2601,6 +2762,16 @@ raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr, uint64_t bytes,
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
         assert(qiov->size == bytes);
+        if (raw_check_io_uring_poll(s, type, flags)) {
+            ret = luring_poll_co_submit(bs, s->use_io_uring_sqpoll, s->fd,
+                                        offset, qiov, type, flags);
+            if (ret != -EOPNOTSUPP) {
+                goto out;
+            }
+            warn_report("'%s' does not support polled I/O, falling back "
+                        "to interrupts", bs->filename);
+            s->use_io_uring_poll = false;
+        }
         ret = luring_co_submit(bs, s->fd, offset, qiov, type, flags);
         goto out;
 #endif
@@ -2716,11 +2887,39 @@ static void raw_close(BlockDriverState *bs)
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
 #endif
+        raw_unregister_fixed_file(s);
         qemu_close(s->fd);
         s->fd = -1;
     }
+
+    if (s->use_fixed_buffers) {
+        ram_block_discard_disable(false);
+    }
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* Requests outside of fixed buffers still work, so this is best effort */
+    if (s->use_fixed_buffers) {
+        aio_register_fixed_buf(host, size);
+    }
+    return true;
 }
 
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_fixed_buffers) {
+        aio_unregister_fixed_buf(host, size);
+    }
+}
+#endif
+
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
  * new space according to @prealloc.
@@ -3348,6 +3547,98 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
     return ret | BDRV_BLOCK_OFFSET_VALID;
 }
 
+/*
+ * Find the end of the data (if @in_data) or hole (otherwise) extent that
+ * starts at @start, with a single lseek(), and store it in @end.
+ * Return -ENXIO if @start is in a trailing hole, and another negative
+ * errno if we can't find out.
+ */
+static int find_allocation_end(BlockDriverState *bs, off_t start,
+                               bool in_data, off_t *end)
+{
+#if defined SEEK_HOLE && defined SEEK_DATA
+    BDRVRawState *s = bs->opaque;
+    off_t offs;
+
+    offs = lseek(s->fd, start, in_data ? SEEK_HOLE : SEEK_DATA);
+    if (offs < 0) {
+        return -errno;
+    }
+    if (offs <= start) {
+        /* The file changed behind our back, or lseek() misbehaves */
+        return -EBUSY;
+    }
+
+    *end = offs;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+/*
+ * Like raw_co_block_status(), but describe up to @nb_extents extents.
+ * Data and holes alternate, so after the first extent each further one
+ * only costs a single lseek().
+ */
+static int coroutine_fn raw_co_block_status_batch(BlockDriverState *bs,
+                                                  unsigned int mode,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  BlockStatusExtent *extents,
+                                                  int nb_extents)
+{
+    int64_t end = offset + bytes;
+    int64_t pnum, map;
+    BlockDriverState *file;
+    off_t next;
+    int i, ret;
+
+    ret = raw_co_block_status(bs, mode, offset, bytes, &pnum, &map, &file);
+    if (ret < 0) {
+        return ret;
+    }
+    extents[0] = (BlockStatusExtent) {
+        .bytes = pnum,
+        .ret = ret,
+        .map = map,
+        .file = file,
+    };
+
+    for (i = 1; i < nb_extents; i++) {
+        bool in_data = !(extents[i - 1].ret & BDRV_BLOCK_DATA);
+
+        offset += extents[i - 1].bytes;
+        if (offset >= end) {
+            break;
+        }
+
+        ret = find_allocation_end(bs, offset, in_data, &next);
+        if (ret == -ENXIO && !in_data) {
+            /* Trailing hole */
+            next = end;
+        } else if (ret < 0) {
+            break;
+        }
+
+        pnum = next - offset;
+        if (in_data && !QEMU_IS_ALIGNED(pnum, bs->bl.request_alignment)) {
+            /* Partial sector at EOF */
+            pnum = ROUND_UP(pnum, bs->bl.request_alignment);
+        }
+
+        extents[i] = (BlockStatusExtent) {
+            .bytes = pnum,
+            .ret = (in_data ? BDRV_BLOCK_DATA : BDRV_BLOCK_ZERO) |
+                   BDRV_BLOCK_OFFSET_VALID,
+            .map = offset,
+            .file = bs,
+        };
+    }
+
+    return i;
+}
+
 #if defined(__linux__)
 /* Verify that the file is not in the page cache */
 static void check_cache_dropped(BlockDriverState *bs, Error **errp)
@@ -3908,9 +4199,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_unregister_fixed_file(s);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_register_fixed_file(s);
     }
     s->perm_change_fd = 0;
 
@@ -3994,6 +4287,7 @@ BlockDriver bdrv_file = {
     .bdrv_co_create_opts = raw_co_create_opts,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_block_status = raw_co_block_status,
+    .bdrv_co_block_status_batch = raw_co_block_status_batch,
     .bdrv_co_invalidate_cache = raw_co_invalidate_cache,
     .bdrv_co_pwrite_zeroes = raw_co_pwrite_zeroes,
     .bdrv_co_delete_file = raw_co_delete_file,
@@ -4015,6 +4309,10 @@ BlockDriver bdrv_file = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .create_opts = &raw_create_opts,
     .mutable_opts = mutable_opts,
 };
@@ -4487,6 +4785,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_abort_perm_update = raw_abort_perm_update,
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
     .bdrv_probe_geometry = hdev_probe_geometry,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     /* generic scsi device */
 #ifdef __linux__
@@ -2367,6 +2367,109 @@ int bdrv_flush_all(void)
     return result;
 }
 
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_do_block_status(BlockDriverState *bs, unsigned int mode,
+                        int64_t offset, int64_t bytes,
+                        int64_t *pnum, int64_t *map, BlockDriverState **file);
+
+/*
+ * Turn the successful result @ret of a driver's block status query for the
+ * aligned region starting at @aligned_offset into the result for @offset
+ * and @bytes.  On input, *pnum, *map and *file are what the driver
+ * returned; see bdrv_co_do_block_status() for their meaning on output.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_block_status_finish(BlockDriverState *bs, unsigned int mode,
+                            int64_t offset, int64_t bytes,
+                            int64_t aligned_offset, int ret, int64_t *pnum,
+                            int64_t *map, BlockDriverState **file)
+{
+    uint32_t align = bs->bl.request_alignment;
+
+    /*
+     * The driver's result must be a non-zero multiple of request_alignment.
+     * Clamp pnum and adjust map to original request.
+     */
+    assert(*pnum && QEMU_IS_ALIGNED(*pnum, align) &&
+           align > offset - aligned_offset);
+    if (ret & BDRV_BLOCK_RECURSE) {
+        assert(ret & BDRV_BLOCK_DATA);
+        assert(ret & BDRV_BLOCK_OFFSET_VALID);
+        assert(!(ret & BDRV_BLOCK_ZERO));
+    }
+
+    *pnum -= offset - aligned_offset;
+    if (*pnum > bytes) {
+        *pnum = bytes;
+    }
+    if (ret & BDRV_BLOCK_OFFSET_VALID) {
+        *map += offset - aligned_offset;
+    }
+
+    if (ret & BDRV_BLOCK_RAW) {
+        assert(ret & BDRV_BLOCK_OFFSET_VALID && *file);
+        return bdrv_co_do_block_status(*file, mode, *map, *pnum, pnum,
+                                       map, file);
+    }
+
+    if (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) {
+        ret |= BDRV_BLOCK_ALLOCATED;
+    } else if (bs->drv->supports_backing) {
+        BlockDriverState *cow_bs = bdrv_cow_bs(bs);
+
+        if (!cow_bs) {
+            ret |= BDRV_BLOCK_ZERO;
+        } else if (mode == BDRV_WANT_PRECISE) {
+            int64_t size2 = bdrv_co_getlength(cow_bs);
+
+            if (size2 >= 0 && offset >= size2) {
+                ret |= BDRV_BLOCK_ZERO;
+            }
+        }
+    }
+
+    if (mode == BDRV_WANT_PRECISE && ret & BDRV_BLOCK_RECURSE &&
+        *file && *file != bs &&
+        (ret & BDRV_BLOCK_DATA) && !(ret & BDRV_BLOCK_ZERO) &&
+        (ret & BDRV_BLOCK_OFFSET_VALID)) {
+        int64_t file_pnum;
+        int ret2;
+
+        ret2 = bdrv_co_do_block_status(*file, mode, *map,
+                                       *pnum, &file_pnum, NULL, NULL);
+        if (ret2 >= 0) {
+            /* Ignore errors.  This is just providing extra information, it
+             * is useful but not necessary.
+             */
+            if (ret2 & BDRV_BLOCK_EOF &&
+                (!file_pnum || ret2 & BDRV_BLOCK_ZERO)) {
+                /*
+                 * It is valid for the format block driver to read
+                 * beyond the end of the underlying file's current
+                 * size; such areas read as zero.
+                 */
+                ret |= BDRV_BLOCK_ZERO;
+            } else {
+                /* Limit request to the range reported by the protocol driver */
+                *pnum = file_pnum;
+                ret |= (ret2 & BDRV_BLOCK_ZERO);
+            }
+        }
+
+        /*
+         * Now that the recursive search was done, clear the flag. Otherwise,
+         * with more complicated block graphs like snapshot-access ->
+         * copy-before-write -> qcow2, where the return value will be propagated
+         * further up to a parent bdrv_co_do_block_status() call, both the
+         * BDRV_BLOCK_RECURSE and BDRV_BLOCK_ZERO flags would be set, which is
+         * not allowed.
+         */
+        ret &= ~BDRV_BLOCK_RECURSE;
+    }
+
+    return ret;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -2532,101 +2635,210 @@ bdrv_co_do_block_status(BlockDriverState *bs, unsigned int mode,
         goto out;
     }
 
-    /*
-     * The driver's result must be a non-zero multiple of request_alignment.
-     * Clamp pnum and adjust map to original request.
-     */
-    assert(*pnum && QEMU_IS_ALIGNED(*pnum, align) &&
-           align > offset - aligned_offset);
-    if (ret & BDRV_BLOCK_RECURSE) {
-        assert(ret & BDRV_BLOCK_DATA);
-        assert(ret & BDRV_BLOCK_OFFSET_VALID);
-        assert(!(ret & BDRV_BLOCK_ZERO));
-    }
+    ret = bdrv_co_block_status_finish(bs, mode, offset, bytes, aligned_offset,
+                                      ret, pnum, &local_map, &local_file);
 
-    *pnum -= offset - aligned_offset;
-    if (*pnum > bytes) {
-        *pnum = bytes;
+out:
+    bdrv_dec_in_flight(bs);
+    if (ret >= 0 && offset + *pnum == total_size) {
+        ret |= BDRV_BLOCK_EOF;
     }
-    if (ret & BDRV_BLOCK_OFFSET_VALID) {
-        local_map += offset - aligned_offset;
+early_out:
+    if (file) {
+        *file = local_file;
     }
+    if (map) {
+        *map = local_map;
+    }
+    return ret;
+}
 
-    if (ret & BDRV_BLOCK_RAW) {
-        assert(ret & BDRV_BLOCK_OFFSET_VALID && local_file);
-        ret = bdrv_co_do_block_status(local_file, mode, local_map,
-                                      *pnum, pnum, &local_map, &local_file);
-        goto out;
+/*
+ * Like bdrv_co_do_block_status(), but return the status of up to
+ * @max_extents consecutive extents starting at @offset in @extents, with
+ * a single call into drivers that implement .bdrv_co_block_status_batch.
+ * Filters, and drivers that return BDRV_BLOCK_RAW for their last extent,
+ * pass the rest of the query on to their child in the same way.
+ * The depth of the extents is not set.
+ *
+ * Returns the number of extents, which is 0 only if @offset is at or beyond
+ * the end of the disk image or @bytes is 0, or negative errno on failure.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_do_block_status_batch(BlockDriverState *bs, unsigned int mode,
+                              int64_t offset, int64_t bytes,
+                              BlockStatusExtent *extents, int max_extents)
+{
+    int64_t total_size, end, aligned_offset, aligned_bytes, start;
+    int64_t pnum, data_offset = 0, data_bytes = 0;
+    uint32_t align;
+    bool is_filter;
+    int i, n, nb;
+
+    assert(max_extents > 0);
+    assert_bdrv_graph_readable();
+
+    is_filter = bs->drv && !bs->drv->bdrv_co_block_status &&
+                bdrv_filter_child(bs);
+    if (!bs->drv || max_extents == 1 ||
+        !(bs->drv->bdrv_co_block_status_batch || is_filter)) {
+        int64_t map;
+        BlockDriverState *file;
+        int ret;
+
+        ret = bdrv_co_do_block_status(bs, mode, offset, bytes, &pnum, &map,
+                                      &file);
+        if (ret < 0 || !pnum) {
+            return MIN(ret, 0);
+        }
+        extents[0] = (BlockStatusExtent) {
+            .offset = offset,
+            .bytes  = pnum,
+            .ret    = ret,
+            .map    = map,
+            .file   = file,
+        };
+        return 1;
     }
 
-    if (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) {
-        ret |= BDRV_BLOCK_ALLOCATED;
-    } else if (bs->drv->supports_backing) {
-        BlockDriverState *cow_bs = bdrv_cow_bs(bs);
+    total_size = bdrv_co_getlength(bs);
+    if (total_size < 0) {
+        return total_size;
+    }
+    if (offset >= total_size || !bytes) {
+        return 0;
+    }
+    bytes = MIN(bytes, total_size - offset);
+    end = offset + bytes;
 
-        if (!cow_bs) {
-            ret |= BDRV_BLOCK_ZERO;
-        } else if (mode == BDRV_WANT_PRECISE) {
-            int64_t size2 = bdrv_co_getlength(cow_bs);
+    bdrv_inc_in_flight(bs);
 
-            if (size2 >= 0 && offset >= size2) {
-                ret |= BDRV_BLOCK_ZERO;
+    align = bs->bl.request_alignment;
+    aligned_offset = QEMU_ALIGN_DOWN(offset, align);
+    aligned_bytes = ROUND_UP(end, align) - aligned_offset;
+
+    if (is_filter) {
+        /* Default code for filters, as in bdrv_co_do_block_status() */
+        extents[0] = (BlockStatusExtent) {
+            .bytes  = aligned_bytes,
+            .ret    = BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID,
+            .map    = aligned_offset,
+            .file   = bdrv_filter_bs(bs),
+        };
+        n = 1;
+    } else if (QLIST_EMPTY(&bs->children) &&
+               bdrv_bsc_is_data(bs, aligned_offset, &pnum)) {
+        /* See bdrv_co_do_block_status() for the block-status cache */
+        extents[0] = (BlockStatusExtent) {
+            .bytes  = pnum,
+            .ret    = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID,
+            .map    = aligned_offset,
+            .file   = bs,
+        };
+        n = 1;
+    } else {
+        n = bs->drv->bdrv_co_block_status_batch(bs, mode, aligned_offset,
+                                                aligned_bytes, extents,
+                                                max_extents);
+        if (n < 0) {
+            goto out;
+        }
+        assert(n > 0 && n <= max_extents);
+
+        if (mode == BDRV_WANT_PRECISE && QLIST_EMPTY(&bs->children)) {
+            /*
+             * Cache the last data extent, where the next query is the most
+             * likely to start.
+             */
+            start = aligned_offset;
+            for (i = 0; i < n; i++) {
+                if (extents[i].ret ==
+                    (BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID)) {
+                    assert(extents[i].file == bs);
+                    assert(extents[i].map == start);
+                    data_offset = start;
+                    data_bytes = extents[i].bytes;
+                }
+                start += extents[i].bytes;
+            }
+            if (data_bytes) {
+                bdrv_bsc_fill(bs, data_offset, data_bytes);
             }
         }
     }
 
-    if (mode == BDRV_WANT_PRECISE && ret & BDRV_BLOCK_RECURSE &&
-        local_file && local_file != bs &&
-        (ret & BDRV_BLOCK_DATA) && !(ret & BDRV_BLOCK_ZERO) &&
-        (ret & BDRV_BLOCK_OFFSET_VALID)) {
-        int64_t file_pnum;
-        int ret2;
+    /*
+     * Finish the extents in place.  The first one starts at @offset, the
+     * others at the aligned offset where the driver's previous extent ended.
+     */
+    start = aligned_offset;
+    for (i = 0, nb = 0; i < n && start < end; i++) {
+        BlockStatusExtent e = extents[i];
+        int64_t e_offset = MAX(start, offset);
+        int ret, j, sub;
 
-        ret2 = bdrv_co_do_block_status(local_file, mode, local_map,
-                                       *pnum, &file_pnum, NULL, NULL);
-        if (ret2 >= 0) {
-            /* Ignore errors.  This is just providing extra information, it
-             * is useful but not necessary.
+        start += e.bytes;
+        pnum = e.bytes;
+
+        if (e.ret & BDRV_BLOCK_RAW && i == n - 1) {
+            /*
+             * Like bdrv_co_block_status_finish(), but query the file child
+             * in a batch too, writing its extents over the ones that are
+             * already finished.
              */
-            if (ret2 & BDRV_BLOCK_EOF &&
-                (!file_pnum || ret2 & BDRV_BLOCK_ZERO)) {
-                /*
-                 * It is valid for the format block driver to read
-                 * beyond the end of the underlying file's current
-                 * size; such areas read as zero.
-                 */
-                ret |= BDRV_BLOCK_ZERO;
-            } else {
-                /* Limit request to the range reported by the protocol driver */
-                *pnum = file_pnum;
-                ret |= (ret2 & BDRV_BLOCK_ZERO);
+            assert(e.ret & BDRV_BLOCK_OFFSET_VALID && e.file);
+            pnum = MIN(start, end) - e_offset;
+            e.map += e_offset - (start - e.bytes);
+            sub = bdrv_co_do_block_status_batch(e.file, mode, e.map, pnum,
+                                                extents + nb,
+                                                max_extents - nb);
+            if (sub <= 0 && !nb) {
+                n = sub;
+                goto out;
+            }
+            for (j = nb; j < nb + MAX(sub, 0); j++) {
+                extents[j].offset += e_offset - e.map;
+                extents[j].ret &= ~BDRV_BLOCK_EOF;
+                if (extents[j].offset + extents[j].bytes == total_size) {
+                    extents[j].ret |= BDRV_BLOCK_EOF;
+                }
             }
+            nb += MAX(sub, 0);
+            break;
         }
 
-        /*
-         * Now that the recursive search was done, clear the flag. Otherwise,
-         * with more complicated block graphs like snapshot-access ->
-         * copy-before-write -> qcow2, where the return value will be propagated
-         * further up to a parent bdrv_co_do_block_status() call, both the
-         * BDRV_BLOCK_RECURSE and BDRV_BLOCK_ZERO flags would be set, which is
-         * not allowed.
-         */
-        ret &= ~BDRV_BLOCK_RECURSE;
+        ret = bdrv_co_block_status_finish(bs, mode, e_offset, end - e_offset,
+                                          start - e.bytes, e.ret, &pnum,
+                                          &e.map, &e.file);
+        if (ret < 0) {
+            if (!nb) {
+                n = ret;
+                goto out;
+            }
+            break;
+        }
+        if (e_offset + pnum == total_size) {
+            ret |= BDRV_BLOCK_EOF;
+        }
+
+        extents[nb++] = (BlockStatusExtent) {
+            .offset = e_offset,
+            .bytes  = pnum,
+            .ret    = ret,
+            .map    = e.map,
+            .file   = e.file,
+        };
+
+        /* Recursing into the file child may have shortened the extent */
+        if (e_offset + pnum < MIN(start, end)) {
+            break;
+        }
     }
+    n = nb;
 
 out:
     bdrv_dec_in_flight(bs);
-    if (ret >= 0 && offset + *pnum == total_size) {
-        ret |= BDRV_BLOCK_EOF;
-    }
-early_out:
-    if (file) {
-        *file = local_file;
-    }
-    if (map) {
-        *map = local_map;
-    }
-    return ret;
+    return n;
 }
 
 int coroutine_fn
@@ -2733,6 +2945,145 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Append @e to @extents, merging it into the last extent if both have the
+ * same status.
+ */
+static void bdrv_block_status_extent_append(BlockStatusExtent *extents,
+                                            int *nb, BlockStatusExtent e)
+{
+    BlockStatusExtent *last = *nb ? &extents[*nb - 1] : NULL;
+
+    if (last && last->ret == e.ret && last->depth == e.depth &&
+        last->file == e.file &&
+        (!(e.ret & BDRV_BLOCK_OFFSET_VALID) ||
+         last->map + last->bytes == e.map)) {
+        assert(last->offset + last->bytes == e.offset);
+        last->bytes += e.bytes;
+    } else {
+        extents[(*nb)++] = e;
+    }
+}
+
+/*
+ * Batched version of bdrv_co_common_block_status_above(): return the status
+ * of up to @max_extents consecutive extents starting at @offset in @extents,
+ * including the depth of the layer that determines each status (0 if no
+ * layer between @bs and @base does).  Adjacent extents with the same status
+ * are merged.
+ *
+ * Returns the number of extents, which is 0 only at or beyond the end of
+ * the disk image, or negative errno on failure.  The extents need not
+ * cover all of @bytes; call again for the rest.
+ */
+int coroutine_fn
+bdrv_co_common_block_status_above_batch(BlockDriverState *bs,
+                                        BlockDriverState *base,
+                                        bool include_base,
+                                        unsigned int mode,
+                                        int64_t offset,
+                                        int64_t bytes,
+                                        BlockStatusExtent *extents,
+                                        int max_extents)
+{
+    g_autofree BlockStatusExtent *top = NULL;
+    BlockDriverState *p;
+    int i, n, nb = 0;
+    IO_CODE();
+
+    assert(!include_base || base); /* Can't include NULL base */
+    assert(max_extents > 0);
+    assert_bdrv_graph_readable();
+
+    if (!include_base && bs == base) {
+        extents[0] = (BlockStatusExtent) {
+            .offset = offset,
+            .bytes  = bytes,
+        };
+        return 1;
+    }
+
+    /* The results of lower layers are written to @extents directly */
+    top = g_new(BlockStatusExtent, max_extents);
+    n = bdrv_co_do_block_status_batch(bs, mode, offset, bytes, top,
+                                      max_extents);
+    if (n <= 0) {
+        return n;
+    }
+
+    p = bdrv_filter_or_cow_bs(bs);
+    for (i = 0; i < n && nb < max_extents; i++) {
+        BlockStatusExtent e = top[i];
+        int64_t e_end = e.offset + e.bytes;
+        int64_t covered;
+        bool sub_eof = false;
+        int j, first, sub;
+
+        e.depth = !!(e.ret & BDRV_BLOCK_ALLOCATED);
+        if (e.ret & BDRV_BLOCK_ALLOCATED || bs == base || !p ||
+            (p == base && !include_base)) {
+            bdrv_block_status_extent_append(extents, &nb, e);
+            continue;
+        }
+
+        /*
+         * [e.offset, e_end) is unallocated on this layer, continue the diving
+         * with the space left in @extents.
+         */
+        first = nb;
+        sub = bdrv_co_common_block_status_above_batch(p, base, include_base,
+                                                      mode, e.offset, e.bytes,
+                                                      extents + first,
+                                                      max_extents - first);
+        if (sub < 0) {
+            return nb ? nb : sub;
+        }
+
+        for (j = 0; j < sub; j++) {
+            BlockStatusExtent lower = extents[first + j];
+
+            /*
+             * BDRV_BLOCK_EOF of a lower layer is not for this layer, which
+             * may be larger.
+             */
+            sub_eof = lower.ret & BDRV_BLOCK_EOF;
+            lower.ret &= ~BDRV_BLOCK_EOF;
+            if (lower.offset + lower.bytes == e_end) {
+                lower.ret |= e.ret & BDRV_BLOCK_EOF;
+            }
+            if (lower.depth) {
+                lower.depth++;
+            }
+            bdrv_block_status_extent_append(extents, &nb, lower);
+        }
+
+        covered = sub ? extents[nb - 1].offset + extents[nb - 1].bytes
+                      : e.offset;
+        if (nb < max_extents && (!sub || sub_eof) && covered < e_end) {
+            /*
+             * The lower layer ended before this one.  Any zeroes that we
+             * synthesize beyond its EOF behave as if they were allocated
+             * at that layer.
+             */
+            bdrv_block_status_extent_append(extents, &nb, (BlockStatusExtent) {
+                .offset = covered,
+                .bytes  = e_end - covered,
+                .ret    = BDRV_BLOCK_ZERO | BDRV_BLOCK_ALLOCATED |
+                          (e.ret & BDRV_BLOCK_EOF),
+                .depth  = 2,
+                .file   = p,
+            });
+        }
+
+        if (extents[nb - 1].offset + extents[nb - 1].bytes < e_end) {
+            /* Out of space for the rest of this extent */
+            break;
+        }
+    }
+
+    return nb;
+}
+
 int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
                                             BlockDriverState *base,
                                             int64_t offset, int64_t bytes,
@@ -2754,6 +3105,18 @@ int coroutine_fn bdrv_co_block_status(BlockDriverState *bs, int64_t offset,
                                       offset, bytes, pnum, map, file);
 }
 
+int coroutine_fn
+bdrv_co_block_status_above_batch(BlockDriverState *bs, BlockDriverState *base,
+                                 int64_t offset, int64_t bytes,
+                                 BlockStatusExtent *extents, int max_extents)
+{
+    IO_CODE();
+    return bdrv_co_common_block_status_above_batch(bs, base, false,
+                                                   BDRV_WANT_PRECISE, offset,
+                                                   bytes, extents,
+                                                   max_extents);
+}
+
 /*
  * Check @bs (and its backing chain) to see if the range defined
  * by @offset and @bytes is known to read as zeroes.
@@ -2900,6 +3263,24 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *bs,
     return 0;
 }
 
+/*
+ * Batched version of bdrv_co_is_allocated_above(): the depth of each extent
+ * in @extents is the allocation depth, 0 if it is not allocated between
+ * @bs and @base.  Returns the number of extents or negative errno.
+ */
+int coroutine_fn
+bdrv_co_is_allocated_above_batch(BlockDriverState *bs, BlockDriverState *base,
+                                 bool include_base, int64_t offset,
+                                 int64_t bytes, BlockStatusExtent *extents,
+                                 int max_extents)
+{
+    IO_CODE();
+    return bdrv_co_common_block_status_above_batch(bs, base, include_base,
+                                                   BDRV_WANT_ALLOCATED,
+                                                   offset, bytes, extents,
+                                                   max_extents);
+}
+
 int coroutine_fn
 bdrv_co_readv_vmstate(BlockDriverState *bs, QEMUIOVector *qiov, int64_t pos)
 {
@@ -11,13 +11,19 @@
 #include "qemu/osdep.h"
 #include <liburing.h>
 #include "qemu/aio.h"
+#include "qemu/defer-call.h"
+#include "qemu/event_notifier.h"
+#include "qapi/error.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "system/block-backend.h"
 #include "trace.h"
 
-typedef struct {
+/* Number of SQ entries of a polled ring, and its limit of requests in flight */
+#define LURING_POLL_ENTRIES 128
+
+typedef struct LuringRequest {
     Coroutine *co;
     QEMUIOVector *qiov;
     uint64_t offset;
@@ -34,14 +40,53 @@ typedef struct {
     QEMUIOVector resubmit_qiov;
 
     CqeHandler cqe_handler;
+
+    /* Polled ring the request is submitted to, NULL for the AioContext's */
+    LuringPollState *poll;
+    QSIMPLEQ_ENTRY(LuringRequest) next;
 } LuringRequest;
 
+/*
+ * A ring set up with IORING_SETUP_IOPOLL.  The kernel does not wait for an
+ * interrupt to complete its requests, but busy-polls the device whenever
+ * completions are reaped.  Without SQPOLL, this happens only when the
+ * AioContext asks for completions, so the AioContext does not block while
+ * requests are in flight.  With SQPOLL, a kernel thread submits requests and
+ * reaps their completions.
+ *
+ * Polled rings only support reads and writes, so they are separate from the
+ * ring that fdmon-io_uring uses for everything else.
+ */
+struct LuringPollState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+    bool sqpoll;
+    EventNotifier e;
+
+    /* No locking required, only accessed from AioContext home thread */
+    QEMUBH *completion_bh;
+    unsigned int in_flight;
+    unsigned int in_queue;
+    /* Requests with an SQE in the ring that was not submitted yet */
+    QSIMPLEQ_HEAD(, LuringRequest) queued;
+    /* Requests waiting for a free SQE */
+    QSIMPLEQ_HEAD(, LuringRequest) pending;
+    /* Set once io_uring_submit() failed for good, no SQEs are queued after */
+    int submit_error;
+};
+
+static void luring_poll_queue(LuringPollState *s, LuringRequest *req);
+
 static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
 {
     LuringRequest *req = opaque;
     QEMUIOVector *qiov = req->qiov;
     uint64_t offset = req->offset;
-    int fd = req->fd;
+    /* Fixed buffers and files are only registered with fdmon-io_uring */
+    bool use_fixed = !req->poll;
+    int fixed_file = use_fixed ? aio_get_fixed_file(req->fd) : -1;
+    int fd = fixed_file >= 0 ? fixed_file : req->fd;
     BdrvRequestFlags flags = req->flags;
 
     switch (req->type) {
@@ -64,7 +109,16 @@ static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
         } else {
             /* The man page says non-vectored is faster than vectored */
             struct iovec *iov = qiov->iov;
-            io_uring_prep_write(sqe, fd, iov->iov_base, iov->iov_len, offset);
+            int buf_index = use_fixed ?
+                aio_get_fixed_buf(iov->iov_base, iov->iov_len) : -1;
+
+            if (buf_index >= 0) {
+                io_uring_prep_write_fixed(sqe, fd, iov->iov_base, iov->iov_len,
+                                          offset, buf_index);
+            } else {
+                io_uring_prep_write(sqe, fd, iov->iov_base, iov->iov_len,
+                                    offset);
+            }
         }
         break;
     }
@@ -82,8 +136,16 @@ static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
         } else {
             /* The man page says non-vectored is faster than vectored */
             struct iovec *iov = qiov->iov;
-            io_uring_prep_read(sqe, fd, iov->iov_base, iov->iov_len,
-                               offset + req->total_read);
+            int buf_index = use_fixed ?
+                aio_get_fixed_buf(iov->iov_base, iov->iov_len) : -1;
+
+            if (buf_index >= 0) {
+                io_uring_prep_read_fixed(sqe, fd, iov->iov_base, iov->iov_len,
+                                         offset + req->total_read, buf_index);
+            } else {
+                io_uring_prep_read(sqe, fd, iov->iov_base, iov->iov_len,
+                                   offset + req->total_read);
+            }
         }
         break;
     }
@@ -95,6 +157,19 @@ static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
                         __func__, req->type);
         abort();
     }
+
+    if (fixed_file >= 0) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+static void luring_submit(LuringRequest *req)
+{
+    if (req->poll) {
+        luring_poll_queue(req->poll, req);
+    } else {
+        aio_add_sqe(luring_prep_sqe, req, &req->cqe_handler);
+    }
 }
 
 /**
@@ -123,7 +198,7 @@ static void luring_resubmit_short_read(LuringRequest *req, int nread)
     }
     qemu_iovec_concat(resubmit_qiov, req->qiov, req->total_read, remaining);
 
-    aio_add_sqe(luring_prep_sqe, req, &req->cqe_handler);
+    luring_submit(req);
 }
 
 static void luring_cqe_handler(CqeHandler *cqe_handler)
@@ -149,7 +224,7 @@ static void luring_cqe_handler(CqeHandler *cqe_handler)
          * immediately.
          */
         if (ret == -EINTR || ret == -EAGAIN) {
-            aio_add_sqe(luring_prep_sqe, req, &req->cqe_handler);
+            luring_submit(req);
             return;
         }
     } else if (req->qiov) {
@@ -189,9 +264,10 @@ static void luring_cqe_handler(CqeHandler *cqe_handler)
     }
 }
 
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
-                                  uint64_t offset, QEMUIOVector *qiov,
-                                  int type, BdrvRequestFlags flags)
+static int coroutine_fn luring_do_co_submit(BlockDriverState *bs,
+                                            LuringPollState *poll, int fd,
+                                            uint64_t offset, QEMUIOVector *qiov,
+                                            int type, BdrvRequestFlags flags)
 {
     LuringRequest req = {
         .co         = qemu_coroutine_self(),
@@ -201,12 +277,13 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
         .fd         = fd,
         .offset     = offset,
         .flags      = flags,
+        .poll       = poll,
     };
 
     req.cqe_handler.cb = luring_cqe_handler;
 
     trace_luring_co_submit(bs, &req, fd, offset, qiov ? qiov->size : 0, type);
-    aio_add_sqe(luring_prep_sqe, &req, &req.cqe_handler);
+    luring_submit(&req);
 
     if (req.ret == -EINPROGRESS) {
         qemu_coroutine_yield();
@@ -214,6 +291,260 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
     return req.ret;
 }
 
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov,
+                                  int type, BdrvRequestFlags flags)
+{
+    return luring_do_co_submit(bs, NULL, fd, offset, qiov, type, flags);
+}
+
+int coroutine_fn luring_poll_co_submit(BlockDriverState *bs, bool sqpoll,
+                                       int fd, uint64_t offset,
+                                       QEMUIOVector *qiov, int type,
+                                       BdrvRequestFlags flags)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    assert(type == QEMU_AIO_READ || type == QEMU_AIO_WRITE);
+    return luring_do_co_submit(bs, aio_get_linux_io_uring_poll(ctx, sqpoll),
+                               fd, offset, qiov, type, flags);
+}
+
+/* Without SQPOLL, nothing but the AioContext reaps completions */
+static void luring_poll_kick(LuringPollState *s)
+{
+    if (!s->sqpoll && (s->in_flight || s->in_queue)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static void luring_poll_fail(LuringPollState *s, LuringRequest *req)
+{
+    req->cqe_handler.cqe.res = s->submit_error;
+    req->cqe_handler.cb(&req->cqe_handler);
+}
+
+static void luring_poll_submit(LuringPollState *s)
+{
+    LuringRequest *req;
+    int ret = io_uring_submit(&s->ring);
+
+    /*
+     * With SQPOLL, the kernel thread may pick up the SQEs even if waking it
+     * up failed, so they can only be submitted again.
+     */
+    if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY ||
+        (ret < 0 && s->sqpoll)) {
+        /* The SQEs stay in the ring, try again from the BH */
+        qemu_bh_schedule(s->completion_bh);
+        return;
+    }
+
+    if (ret < 0) {
+        /*
+         * The error will not go away.  The SQEs stay in the ring, so it must
+         * not be entered for submission again; fail every request that has
+         * not been submitted, and all requests queued later.
+         */
+        s->submit_error = ret;
+        s->in_queue = 0;
+        while ((req = QSIMPLEQ_FIRST(&s->queued))) {
+            QSIMPLEQ_REMOVE_HEAD(&s->queued, next);
+            luring_poll_fail(s, req);
+        }
+        while ((req = QSIMPLEQ_FIRST(&s->pending))) {
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            luring_poll_fail(s, req);
+        }
+        return;
+    }
+
+    /* SQEs are submitted in the order they were queued */
+    for (int i = 0; i < ret; i++) {
+        QSIMPLEQ_REMOVE_HEAD(&s->queued, next);
+    }
+    s->in_flight += ret;
+    s->in_queue -= ret;
+    luring_poll_kick(s);
+}
+
+static void luring_poll_deferred_fn(void *opaque)
+{
+    LuringPollState *s = opaque;
+
+    if (s->in_queue) {
+        luring_poll_submit(s);
+    }
+}
+
+static void luring_poll_queue(LuringPollState *s, LuringRequest *req)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    if (s->submit_error) {
+        luring_poll_fail(s, req);
+        return;
+    }
+
+    if (s->in_flight + s->in_queue < LURING_POLL_ENTRIES) {
+        sqe = io_uring_get_sqe(&s->ring);
+    }
+    if (!sqe) {
+        QSIMPLEQ_INSERT_TAIL(&s->pending, req, next);
+        return;
+    }
+
+    luring_prep_sqe(sqe, req);
+    io_uring_sqe_set_data(sqe, req);
+    QSIMPLEQ_INSERT_TAIL(&s->queued, req, next);
+    s->in_queue++;
+    defer_call(luring_poll_deferred_fn, s);
+}
+
+/*
+ * Reap completions and invoke their callbacks.  Without SQPOLL, peeking at
+ * the CQ ring enters the kernel, which polls the device for completions.
+ *
+ * Each CQE is consumed before its callback runs, so this can be called again
+ * from a nested event loop.
+ */
+static void luring_poll_process_completions(LuringPollState *s)
+{
+    struct io_uring_cqe *cqe;
+    LuringRequest *req;
+
+    defer_call_begin();
+
+    while (s->in_flight && io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        req = io_uring_cqe_get_data(cqe);
+        req->cqe_handler.cqe = *cqe;
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->in_flight--;
+        req->cqe_handler.cb(&req->cqe_handler);
+    }
+
+    while ((req = QSIMPLEQ_FIRST(&s->pending)) &&
+           s->in_flight + s->in_queue < LURING_POLL_ENTRIES) {
+        QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+        luring_poll_queue(s, req);
+    }
+
+    /* Submits the SQEs queued above */
+    defer_call_end();
+
+    if (s->in_queue) {
+        luring_poll_submit(s);
+    } else {
+        luring_poll_kick(s);
+    }
+}
+
+static void luring_poll_completion_bh(void *opaque)
+{
+    LuringPollState *s = opaque;
+
+    luring_poll_process_completions(s);
+}
+
+static void luring_poll_completion_cb(EventNotifier *e)
+{
+    LuringPollState *s = container_of(e, LuringPollState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_poll_process_completions(s);
+    }
+}
+
+static bool luring_poll_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringPollState *s = container_of(e, LuringPollState, e);
+    struct io_uring_cqe *cqe;
+
+    if (s->sqpoll) {
+        return io_uring_cq_ready(&s->ring);
+    }
+
+    /* This is where the device is busy-polled during adaptive polling */
+    return s->in_flight && io_uring_peek_cqe(&s->ring, &cqe) == 0;
+}
+
+static void luring_poll_poll_ready(EventNotifier *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringPollState *s = container_of(e, LuringPollState, e);
+
+    luring_poll_process_completions(s);
+}
+
+void luring_poll_detach_aio_context(LuringPollState *s,
+                                    AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_poll_attach_aio_context(LuringPollState *s,
+                                    AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, luring_poll_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e,
+                           luring_poll_completion_cb,
+                           luring_poll_poll_cb,
+                           luring_poll_poll_ready);
+}
+
+LuringPollState *luring_poll_init(bool sqpoll, Error **errp)
+{
+    unsigned flags = IORING_SETUP_IOPOLL | (sqpoll ? IORING_SETUP_SQPOLL : 0);
+    LuringPollState *s;
+    int rc;
+
+    s = g_new0(LuringPollState, 1);
+    s->sqpoll = sqpoll;
+    QSIMPLEQ_INIT(&s->queued);
+    QSIMPLEQ_INIT(&s->pending);
+
+    rc = event_notifier_init(&s->e, false);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to initialize event notifier");
+        goto out_free_state;
+    }
+
+    rc = io_uring_queue_init(LURING_POLL_ENTRIES, &s->ring, flags);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to create polled io_uring");
+        goto out_close_efd;
+    }
+
+    rc = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to register eventfd");
+        goto out_exit_ring;
+    }
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_poll_cleanup(LuringPollState *s)
+{
+    assert(!s->in_flight && !s->in_queue && QSIMPLEQ_EMPTY(&s->pending));
+
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
+
 bool luring_has_fua(void)
 {
 #ifdef HAVE_IO_URING_PREP_WRITEV2
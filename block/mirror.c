@@ -87,6 +87,8 @@ typedef struct MirrorBlockJob {
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int ret;
     bool unmap;
+    /* Try to offload copies; cleared once that failed */
+    bool use_copy_range;
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
@@ -402,6 +404,24 @@ static void coroutine_fn mirror_co_read(void *opaque)
     op->is_in_flight = true;
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
+    if (s->use_copy_range) {
+        WITH_GRAPH_RDLOCK_GUARD() {
+            ret = blk_co_copy_range_from(s->mirror_top_bs->backing,
+                                         op->offset, s->target, op->offset,
+                                         op->bytes, 0, 0);
+        }
+        if (ret >= 0) {
+            mirror_write_complete(op, 0);
+            return;
+        }
+
+        trace_mirror_copy_range_fail(s, op->offset, ret);
+        if (ret != -ENOSPC) {
+            /* Unsupported for this source and target, stop trying */
+            s->use_copy_range = false;
+        }
+    }
+
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
                              &op->qiov, 0);
@@ -526,6 +546,8 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
     int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    BlockStatusExtent extents[BDRV_BLOCK_STATUS_BATCH];
+    int nb_extents = 0, ext_idx = 0;
 
     bdrv_graph_co_rdlock();
     source = s->mirror_top_bs->backing->bs;
@@ -609,10 +631,32 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
         MirrorMethod mirror_method = MIRROR_METHOD_COPY;
 
         assert(!(offset % s->granularity));
-        WITH_GRAPH_RDLOCK_GUARD() {
-            ret = bdrv_co_block_status_above(source, NULL, offset,
-                                             nb_chunks * s->granularity,
-                                             &io_bytes, NULL, NULL);
+
+        /*
+         * The status of the whole range is queried at once.  It can be
+         * stale by the time we get to later extents, but that is fine for
+         * the same reason as above: the dirty bits are already clear, so
+         * any write in the meantime will be copied again.
+         */
+        while (ext_idx < nb_extents &&
+               offset >= extents[ext_idx].offset + extents[ext_idx].bytes) {
+            ext_idx++;
+        }
+        if (ext_idx == nb_extents) {
+            WITH_GRAPH_RDLOCK_GUARD() {
+                nb_extents = bdrv_co_block_status_above_batch(
+                    source, NULL, offset, nb_chunks * s->granularity,
+                    extents, BDRV_BLOCK_STATUS_BATCH);
+            }
+            ext_idx = 0;
+        }
+        if (nb_extents > 0) {
+            ret = extents[ext_idx].ret;
+            io_bytes = extents[ext_idx].offset + extents[ext_idx].bytes -
+                       offset;
+        } else {
+            ret = nb_extents ?: -EIO;
+            nb_extents = 0;
         }
         if (ret < 0) {
             io_bytes = MIN(nb_chunks * s->granularity, max_io_bytes);
@@ -889,7 +933,6 @@ static int coroutine_fn GRAPH_UNLOCKED mirror_dirty_init(MirrorBlockJob *s)
     BlockDriverState *bs;
     BlockDriverState *target_bs = blk_bs(s->target);
     int ret = -EIO;
-    int64_t count;
     bool punch_holes =
         target_bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP &&
         bdrv_can_write_zeroes_with_unmap(target_bs);
@@ -973,9 +1016,8 @@ static int coroutine_fn GRAPH_UNLOCKED mirror_dirty_init(MirrorBlockJob *s)
 
     /* First part, loop on the sectors and initialize the dirty bitmap.  */
     for (offset = 0; offset < s->bdev_length; ) {
-        /* Just to make sure we are not exceeding int limit. */
-        int bytes = MIN(s->bdev_length - offset,
-                        QEMU_ALIGN_DOWN(INT_MAX, s->granularity));
+        BlockStatusExtent extents[BDRV_BLOCK_STATUS_BATCH];
+        int i;
 
         mirror_throttle(s);
 
@@ -984,18 +1026,24 @@ static int coroutine_fn GRAPH_UNLOCKED mirror_dirty_init(MirrorBlockJob *s)
         }
 
         WITH_GRAPH_RDLOCK_GUARD() {
-            ret = bdrv_co_is_allocated_above(bs, s->base_overlay, true, offset,
-                                             bytes, &count);
+            ret = bdrv_co_is_allocated_above_batch(bs, s->base_overlay, true,
+                                                   offset,
+                                                   s->bdev_length - offset,
+                                                   extents,
+                                                   BDRV_BLOCK_STATUS_BATCH);
         }
         if (ret < 0) {
             return ret;
         }
 
-        assert(count);
-        if (ret > 0) {
-            bdrv_set_dirty_bitmap(s->dirty_bitmap, offset, count);
+        assert(ret > 0);
+        for (i = 0; i < ret; i++) {
+            if (extents[i].depth) {
+                bdrv_set_dirty_bitmap(s->dirty_bitmap, extents[i].offset,
+                                      extents[i].bytes);
+            }
+            offset += extents[i].bytes;
         }
-        offset += count;
     }
     return 0;
 }
@@ -1824,6 +1872,18 @@ static BlockDriver bdrv_mirror_top = {
     .filtered_child_is_backing  = true,
 };
 
+/*
+ * Offloaded copies bypass detect-zeroes on the target, and format drivers
+ * that could have kept zeroes sparse.  Only use them between raw nodes,
+ * falling back to read/write if the protocol layer can't offload.
+ */
+static bool GRAPH_RDLOCK
+mirror_can_copy_range(BlockDriverState *bs, BlockDriverState *target)
+{
+    return bs->drv == &bdrv_raw && target->drv == &bdrv_raw &&
+           target->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
+}
+
 static BlockJob *mirror_start_job(
                              const char *job_id, BlockDriverState *bs,
                              int creation_flags, BlockDriverState *target,
@@ -2000,6 +2060,7 @@ static BlockJob *mirror_start_job(
     s->sync_mode = sync_mode;
     s->backing_mode = backing_mode;
     s->target_is_zero = target_is_zero;
+    s->use_copy_range = mirror_can_copy_range(bs, target);
     qatomic_set(&s->copy_mode, copy_mode);
     s->base = base;
     s->base_overlay = bdrv_find_overlay(bs, base);
@@ -612,19 +612,25 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
 
 /*
  * nbd_parse_blockstatus_payload
- * Based on our request, we expect only one extent in reply, for the
- * base:allocation context.
+ * Parse up to *@nb_extents extents for the base:allocation context into
+ * @extents, and store the number of extents parsed in *@nb_extents.  If
+ * the request used NBD_CMD_FLAG_REQ_ONE, we expect only one extent.
  */
 static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, bool wide,
                                          uint64_t orig_length,
-                                         NBDExtent64 *extent, Error **errp)
+                                         NBDExtent64 *extents, int *nb_extents,
+                                         Error **errp)
 {
     uint32_t context_id;
     uint32_t count;
-    size_t ext_len = wide ? sizeof(*extent) : sizeof(NBDExtent32);
-    size_t pay_len = sizeof(context_id) + wide * sizeof(count) + ext_len;
+    size_t ext_len = wide ? sizeof(*extents) : sizeof(NBDExtent32);
+    size_t hdr_len = sizeof(context_id) + wide * sizeof(count);
+    size_t pay_len = hdr_len + ext_len;
+    uint64_t avail, total = 0;
+    bool aligned = true;
+    int i;
 
     /* The server succeeded, so it must have sent [at least] one extent */
     if (chunk->length < pay_len) {
@@ -642,74 +648,89 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
         return -EINVAL;
     }
 
-    if (wide) {
-        count = payload_advance32(&payload);
-        extent->length = payload_advance64(&payload);
-        extent->flags = payload_advance64(&payload);
-    } else {
-        count = 0;
-        extent->length = payload_advance32(&payload);
-        extent->flags = payload_advance32(&payload);
-    }
+    count = wide ? payload_advance32(&payload) : 0;
+    avail = (chunk->length - hdr_len) / ext_len;
 
-    if (extent->length == 0) {
-        error_setg(errp, "Protocol error: server sent status chunk with "
-                   "zero length");
-        return -EINVAL;
-    }
+    for (i = 0; i < *nb_extents && i < avail && total < orig_length &&
+                aligned; i++) {
+        NBDExtent64 *extent = &extents[i];
 
-    /*
-     * A server sending unaligned block status is in violation of the
-     * protocol, but as qemu-nbd 3.1 is such a server (at least for
-     * POSIX files that are not a multiple of 512 bytes, since qemu
-     * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
-     * still sees an implicit hole beyond the real EOF), it's nicer to
-     * work around the misbehaving server. If the request included
-     * more than the final unaligned block, truncate it back to an
-     * aligned result; if the request was only the final block, round
-     * up to the full block and change the status to fully-allocated
-     * (always a safe status, even if it loses information).
-     */
-    if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
-                                              s->info.min_block)) {
-        trace_nbd_parse_blockstatus_compliance("extent length is unaligned");
-        if (extent->length > s->info.min_block) {
-            extent->length = QEMU_ALIGN_DOWN(extent->length,
-                                             s->info.min_block);
+        if (wide) {
+            extent->length = payload_advance64(&payload);
+            extent->flags = payload_advance64(&payload);
         } else {
-            extent->length = s->info.min_block;
-            extent->flags = 0;
+            extent->length = payload_advance32(&payload);
+            extent->flags = payload_advance32(&payload);
         }
-    }
 
-    /*
-     * We used NBD_CMD_FLAG_REQ_ONE, so the server should not have
-     * sent us any more than one extent, nor should it have included
-     * status beyond our request in that extent. Furthermore, a wide
-     * server should have replied with an accurate count (we left
-     * count at 0 for a narrow server).  However, it's easy enough to
-     * ignore the server's noncompliance without killing the
-     * connection; just ignore trailing extents, and clamp things to
-     * the length of our request.
-     */
-    if (count != wide || chunk->length > pay_len) {
-        trace_nbd_parse_blockstatus_compliance("unexpected extent count");
-    }
-    if (extent->length > orig_length) {
-        extent->length = orig_length;
-        trace_nbd_parse_blockstatus_compliance("extent length too large");
+        if (extent->length == 0) {
+            error_setg(errp, "Protocol error: server sent status chunk with "
+                       "zero length");
+            return -EINVAL;
+        }
+
+        /*
+         * A server sending unaligned block status is in violation of the
+         * protocol, but as qemu-nbd 3.1 is such a server (at least for
+         * POSIX files that are not a multiple of 512 bytes, since qemu
+         * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
+         * still sees an implicit hole beyond the real EOF), it's nicer to
+         * work around the misbehaving server. If the request included
+         * more than the final unaligned block, truncate it back to an
+         * aligned result; if the request was only the final block, round
+         * up to the full block and change the status to fully-allocated
+         * (always a safe status, even if it loses information).  Either
+         * way, the following extents no longer line up, so drop them.
+         */
+        if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
+                                                  s->info.min_block)) {
+            trace_nbd_parse_blockstatus_compliance(
+                "extent length is unaligned");
+            if (extent->length > s->info.min_block) {
+                extent->length = QEMU_ALIGN_DOWN(extent->length,
+                                                 s->info.min_block);
+            } else {
+                extent->length = s->info.min_block;
+                extent->flags = 0;
+            }
+            aligned = false;
+        }
+
+        /*
+         * The server should not have included status beyond our request,
+         * but it's easy enough to ignore that without killing the
+         * connection; just clamp things to the length of our request.
+         */
+        if (extent->length > orig_length - total) {
+            extent->length = orig_length - total;
+            trace_nbd_parse_blockstatus_compliance("extent length too large");
+        }
+        total += extent->length;
+
+        /*
+         * HACK: if we are using x-dirty-bitmaps to access
+         * qemu:allocation-depth, treat all depths > 2 the same as 2,
+         * since nbd_client_co_block_status_batch is only expecting the
+         * low two bits to be set.
+         */
+        if (s->alloc_depth && extent->flags > 2) {
+            extent->flags = 2;
+        }
     }
 
     /*
-     * HACK: if we are using x-dirty-bitmaps to access
-     * qemu:allocation-depth, treat all depths > 2 the same as 2,
-     * since nbd_client_co_block_status is only expecting the low two
-     * bits to be set.
+     * If we used NBD_CMD_FLAG_REQ_ONE, the server should not have sent
+     * us any more than one extent.  Furthermore, a wide server should
+     * have replied with an accurate count (we left count at 0 for a
+     * narrow server).  Again, just ignore trailing extents.
      */
-    if (s->alloc_depth && extent->flags > 2) {
-        extent->flags = 2;
+    if ((wide && count != avail) ||
+        chunk->length != hdr_len + avail * ext_len ||
+        (*nb_extents == 1 && avail > 1)) {
+        trace_nbd_parse_blockstatus_compliance("unexpected extent count");
     }
 
+    *nb_extents = i;
     return 0;
 }
 
@@ -1138,18 +1159,24 @@ nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t cookie,
     return iter.ret;
 }
 
+/*
+ * On entry, *@nb_extents is the number of elements in @extents; on
+ * success, it is set to the number of extents received.
+ */
 static int coroutine_fn
 nbd_co_receive_blockstatus_reply(BDRVNBDState *s, uint64_t cookie,
-                                 uint64_t length, NBDExtent64 *extent,
-                                 int *request_ret, Error **errp)
+                                 uint64_t length, NBDExtent64 *extents,
+                                 int *nb_extents, int *request_ret,
+                                 Error **errp)
 {
     NBDReplyChunkIter iter;
     NBDReply reply;
     void *payload = NULL;
     Error *local_err = NULL;
     bool received = false;
+    int max_extents = *nb_extents;
 
-    assert(!extent->length);
+    *nb_extents = 0;
     NBD_FOREACH_REPLY_CHUNK(s, iter, cookie, false, NULL, &reply, &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
@@ -1171,10 +1198,12 @@ nbd_co_receive_blockstatus_reply(BDRVNBDState *s, uint64_t cookie,
             }
             received = true;
 
+            *nb_extents = max_extents;
             ret = nbd_parse_blockstatus_payload(
                 s, &reply.structured, payload, wide,
-                length, extent, &local_err);
+                length, extents, nb_extents, &local_err);
             if (ret < 0) {
+                *nb_extents = 0;
                 nbd_channel_error(s, ret);
                 nbd_iter_channel_error(&iter, ret, &local_err);
             }
@@ -1194,7 +1223,7 @@ nbd_co_receive_blockstatus_reply(BDRVNBDState *s, uint64_t cookie,
         payload = NULL;
     }
 
-    if (!extent->length && !iter.request_ret) {
+    if (!*nb_extents && !iter.request_ret) {
         error_setg(&local_err, "Server did not reply with any status extents");
         nbd_iter_channel_error(&iter, -EIO, &local_err);
     }
@@ -1398,12 +1427,16 @@ nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
     return nbd_co_request(bs, &request, NULL);
 }
 
-static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
+/*
+ * Unless only a single extent is wanted, omit NBD_CMD_FLAG_REQ_ONE so that
+ * the server can describe a whole range of extents in a single round trip.
+ */
+static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status_batch(
         BlockDriverState *bs, unsigned int mode, int64_t offset,
-        int64_t bytes, int64_t *pnum, int64_t *map, BlockDriverState **file)
+        int64_t bytes, BlockStatusExtent *extents, int nb_extents)
 {
-    int ret, request_ret;
-    NBDExtent64 extent = { 0 };
+    int ret, request_ret, i, n;
+    g_autofree NBDExtent64 *nbd_extents = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     Error *local_err = NULL;
 
@@ -1411,14 +1444,17 @@ static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
         .type = NBD_CMD_BLOCK_STATUS,
         .from = offset,
         .len = MIN(bytes, s->info.size - offset),
-        .flags = NBD_CMD_FLAG_REQ_ONE,
+        .flags = nb_extents == 1 ? NBD_CMD_FLAG_REQ_ONE : 0,
     };
 
     if (!s->info.base_allocation) {
-        *pnum = bytes;
-        *map = offset;
-        *file = bs;
-        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+        extents[0] = (BlockStatusExtent) {
+            .bytes = bytes,
+            .ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID,
+            .map = offset,
+            .file = bs,
+        };
+        return 1;
     }
     if (s->info.mode < NBD_MODE_EXTENDED) {
         request.len = MIN(QEMU_ALIGN_DOWN(INT_MAX, bs->bl.request_alignment),
@@ -1433,23 +1469,28 @@ static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
      * called on just the hole.
      */
     if (offset >= s->info.size) {
-        *pnum = bytes;
         assert(bytes < BDRV_SECTOR_SIZE);
         /* Intentionally don't report offset_valid for the hole */
-        return BDRV_BLOCK_ZERO;
+        extents[0] = (BlockStatusExtent) {
+            .bytes = bytes,
+            .ret = BDRV_BLOCK_ZERO,
+        };
+        return 1;
     }
 
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
+    nbd_extents = g_new0(NBDExtent64, nb_extents);
     do {
         ret = nbd_co_send_request(bs, &request, NULL);
         if (ret < 0) {
             continue;
         }
 
+        n = nb_extents;
         ret = nbd_co_receive_blockstatus_reply(s, request.cookie, bytes,
-                                               &extent, &request_ret,
+                                               nbd_extents, &n, &request_ret,
                                                &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request.from, request.len, request.cookie,
@@ -1465,13 +1506,43 @@ static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
         return ret ? ret : request_ret;
     }
 
-    assert(extent.length);
-    *pnum = extent.length;
-    *map = offset;
-    *file = bs;
-    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
-        (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
-        BDRV_BLOCK_OFFSET_VALID;
+    assert(n > 0);
+    for (i = 0; i < n; i++) {
+        uint64_t flags = nbd_extents[i].flags;
+
+        assert(nbd_extents[i].length);
+        extents[i] = (BlockStatusExtent) {
+            .bytes = nbd_extents[i].length,
+            .ret = (flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+                   (flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
+                   BDRV_BLOCK_OFFSET_VALID,
+            .map = offset,
+            .file = bs,
+        };
+        offset += nbd_extents[i].length;
+    }
+    return n;
+}
+
+static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
+        BlockDriverState *bs, unsigned int mode, int64_t offset,
+        int64_t bytes, int64_t *pnum, int64_t *map, BlockDriverState **file)
+{
+    BlockStatusExtent extent;
+    int ret;
+
+    ret = nbd_client_co_block_status_batch(bs, mode, offset, bytes,
+                                           &extent, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *pnum = extent.bytes;
+    if (extent.ret & BDRV_BLOCK_OFFSET_VALID) {
+        *map = extent.map;
+        *file = extent.file;
+    }
+    return extent.ret;
 }
 
 static int nbd_client_reopen_prepare(BDRVReopenState *state,
@@ -2161,6 +2232,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_getlength          = nbd_co_getlength,
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
+    .bdrv_co_block_status_batch = nbd_client_co_block_status_batch,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
@@ -2189,6 +2261,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_getlength          = nbd_co_getlength,
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
+    .bdrv_co_block_status_batch = nbd_client_co_block_status_batch,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
@@ -2217,6 +2290,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_getlength          = nbd_co_getlength,
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
+    .bdrv_co_block_status_batch = nbd_client_co_block_status_batch,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
@@ -28,13 +28,34 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Replacement follows the 2Q algorithm (Johnson and Shasha, VLDB '94).
+ * A table that is read for the first time goes to the "recent" FIFO, and
+ * is only promoted to the "frequent" LRU list if it is read again after
+ * having been evicted from the FIFO.  Evicted offsets are remembered in a
+ * ghost list for that purpose.  A sequential scan, e.g. by a backup job,
+ * thus only cycles through the FIFO and leaves the working set alone.
+ */
+typedef enum Qcow2CacheList {
+    QCOW2_CACHE_FREE,
+    QCOW2_CACHE_RECENT,
+    QCOW2_CACHE_FREQUENT,
+    QCOW2_CACHE_LIST_MAX
+} Qcow2CacheList;
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    Qcow2CacheList list;
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) list_next;
 } Qcow2CachedTable;
 
+typedef QLIST_HEAD(, Qcow2CachedTable) Qcow2CacheBucket;
+typedef QTAILQ_HEAD(, Qcow2CachedTable) Qcow2CacheQueue;
+
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
@@ -44,6 +65,21 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Cached tables by offset */
+    Qcow2CacheBucket       *buckets;
+    unsigned                bucket_mask;
+
+    /* Least recently used (or first loaded) entries first */
+    Qcow2CacheQueue         lists[QCOW2_CACHE_LIST_MAX];
+    int                     list_len[QCOW2_CACHE_LIST_MAX];
+    int                     recent_max;
+
+    /* Offsets recently evicted from the recent list, as a ring */
+    int64_t                *ghost;
+    GHashTable             *ghost_set;
+    int                     ghost_size;
+    int                     ghost_next;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -86,6 +122,117 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
+static inline Qcow2CacheBucket *qcow2_cache_bucket(Qcow2Cache *c,
+                                                   uint64_t offset)
+{
+    return &c->buckets[(offset / c->table_size) & c->bucket_mask];
+}
+
+static Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *t;
+
+    QLIST_FOREACH(t, qcow2_cache_bucket(c, offset), hash_next) {
+        if (t->offset == offset) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void qcow2_cache_move(Qcow2Cache *c, Qcow2CachedTable *t,
+                             Qcow2CacheList list)
+{
+    QTAILQ_REMOVE(&c->lists[t->list], t, list_next);
+    c->list_len[t->list]--;
+    QTAILQ_INSERT_TAIL(&c->lists[list], t, list_next);
+    c->list_len[list]++;
+    t->list = list;
+}
+
+/* Forget the contents of an unreferenced entry */
+static void qcow2_cache_set_free(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->offset) {
+        QLIST_REMOVE(t, hash_next);
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+    qcow2_cache_move(c, t, QCOW2_CACHE_FREE);
+}
+
+static void qcow2_cache_ghost_add(Qcow2Cache *c, int64_t offset)
+{
+    int64_t *slot = &c->ghost[c->ghost_next];
+
+    if (g_hash_table_contains(c->ghost_set, &offset)) {
+        return;
+    }
+    if (*slot) {
+        g_hash_table_remove(c->ghost_set, slot);
+    }
+    *slot = offset;
+    g_hash_table_add(c->ghost_set, slot);
+    c->ghost_next = (c->ghost_next + 1) % c->ghost_size;
+}
+
+/* Remove @offset from the ghost list, returning whether it was there */
+static bool qcow2_cache_ghost_take(Qcow2Cache *c, int64_t offset)
+{
+    gpointer slot;
+
+    if (!g_hash_table_steal_extended(c->ghost_set, &offset, &slot, NULL)) {
+        return false;
+    }
+    *(int64_t *)slot = 0;
+    return true;
+}
+
+static void qcow2_cache_ghost_clear(Qcow2Cache *c)
+{
+    g_hash_table_remove_all(c->ghost_set);
+    memset(c->ghost, 0, sizeof(*c->ghost) * c->ghost_size);
+    c->ghost_next = 0;
+}
+
+static Qcow2CachedTable *qcow2_cache_find_unused(Qcow2Cache *c,
+                                                 Qcow2CacheList list)
+{
+    Qcow2CachedTable *t;
+
+    QTAILQ_FOREACH(t, &c->lists[list], list_next) {
+        if (t->ref == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Pick the entry to replace: a free one if possible, otherwise the head
+ * of the recent FIFO once it exceeds its share of the cache, otherwise
+ * the least recently used frequent entry.  Returns -1 if all entries are
+ * in use.
+ */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    Qcow2CachedTable *t = qcow2_cache_find_unused(c, QCOW2_CACHE_FREE);
+
+    if (!t && (c->list_len[QCOW2_CACHE_RECENT] > c->recent_max ||
+               c->list_len[QCOW2_CACHE_FREQUENT] == 0)) {
+        t = qcow2_cache_find_unused(c, QCOW2_CACHE_RECENT);
+    }
+    if (!t) {
+        t = qcow2_cache_find_unused(c, QCOW2_CACHE_FREQUENT);
+    }
+    if (!t) {
+        t = qcow2_cache_find_unused(c, QCOW2_CACHE_RECENT);
+    }
+    return t ? t - c->entries : -1;
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
@@ -106,8 +253,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_set_free(c, i);
             i++;
             to_clean++;
         }
@@ -125,6 +271,8 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned num_buckets;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -138,13 +286,34 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    num_buckets = pow2ceil(num_tables);
+    c->bucket_mask = num_buckets - 1;
+    c->buckets = g_try_new0(Qcow2CacheBucket, num_buckets);
+
+    c->recent_max = MAX(num_tables / 4, 1);
+    c->ghost_size = MAX(num_tables / 2, 1);
+    c->ghost = g_try_new0(int64_t, c->ghost_size);
+
+    if (!c->entries || !c->table_array || !c->buckets || !c->ghost) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->buckets);
+        g_free(c->ghost);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    c->ghost_set = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < QCOW2_CACHE_LIST_MAX; i++) {
+        QTAILQ_INIT(&c->lists[i]);
+    }
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].list = QCOW2_CACHE_FREE;
+        QTAILQ_INSERT_TAIL(&c->lists[QCOW2_CACHE_FREE], &c->entries[i],
+                           list_next);
+    }
+    c->list_len[QCOW2_CACHE_FREE] = num_tables;
+
     return c;
 }
 
@@ -157,6 +326,9 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_hash_table_destroy(c->ghost_set);
+    g_free(c->ghost);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -309,9 +481,9 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_set_free(c, i);
     }
+    qcow2_cache_ghost_clear(c);
 
     qcow2_cache_table_release(c, 0, c->size);
 
@@ -325,11 +497,9 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                    void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -344,29 +514,23 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
+    t = qcow2_cache_lookup(c, offset);
+    if (t) {
+        i = t - c->entries;
+        if (t->list == QCOW2_CACHE_FREQUENT) {
+            qcow2_cache_move(c, t, QCOW2_CACHE_FREQUENT);
         }
-    } while (i != lookup_index);
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    i = qcow2_cache_find_victim(c);
+    if (i == -1) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -377,7 +541,11 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    t = &c->entries[i];
+    if (t->list == QCOW2_CACHE_RECENT) {
+        qcow2_cache_ghost_add(c, t->offset);
+    }
+    qcow2_cache_set_free(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -390,7 +558,13 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         }
     }
 
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    QLIST_INSERT_HEAD(qcow2_cache_bucket(c, offset), t, hash_next);
+    if (qcow2_cache_ghost_take(c, offset)) {
+        qcow2_cache_move(c, t, QCOW2_CACHE_FREQUENT);
+    } else {
+        qcow2_cache_move(c, t, QCOW2_CACHE_RECENT);
+    }
 
     /* And return the right table */
 found:
@@ -438,14 +612,9 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    Qcow2CachedTable *t = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return t ? qcow2_cache_get_table_addr(c, t - c->entries) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
@@ -454,8 +623,7 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_set_free(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
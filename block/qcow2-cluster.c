@@ -1116,12 +1116,104 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         }
     }
 
+    if (m->dedup) {
+        assert(m->nb_clusters == 1);
+        qcow2_dedup_insert(bs, m->dedup_hash, m->alloc_offset, m->offset);
+    }
+
     ret = 0;
 err:
     g_free(old_cluster);
     return ret;
  }
 
+/*
+ * Clears QCOW_OFLAG_COPIED in the L2 entry of the guest cluster at @offset,
+ * if that entry maps a normal cluster at @host_offset with the flag set.
+ * This must be done before the host cluster gets a second reference.
+ *
+ * Returns 1 if the flag was cleared, 0 if the guest cluster is mapped
+ * differently, or -errno on failure.
+ */
+int qcow2_cluster_clear_copied(BlockDriverState *bs, uint64_t offset,
+                               uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    uint64_t *l2_slice, l2_entry;
+    int l2_index, ret;
+
+    /* An L2 table that is not ours alone cannot map a cluster that is */
+    if (l1_index >= s->l1_size ||
+        !(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
+        return 0;
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+        (l2_entry & L2E_OFFSET_MASK) != host_offset ||
+        !(l2_entry & QCOW_OFLAG_COPIED)) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        return 0;
+    }
+
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, l2_entry & ~QCOW_OFLAG_COPIED);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 1;
+}
+
+/*
+ * Maps the guest cluster at @offset to the data cluster at @host_offset,
+ * which is shared with other guest clusters.  The caller must already have
+ * increased the refcount of @host_offset for this mapping.  The cluster
+ * previously mapped at @offset is released.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int qcow2_cluster_link_shared(BlockDriverState *bs, uint64_t offset,
+                              uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice, old_l2_entry;
+    int l2_index, ret;
+
+    assert(!has_data_file(bs));
+    assert(!offset_into_cluster(s, host_offset));
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    old_l2_entry = get_l2_entry(s, l2_slice, l2_index);
+
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_slice, l2_index, QCOW_L2_BITMAP_ALL_ALLOC);
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    qcow2_free_any_cluster(bs, old_l2_entry, QCOW2_DISCARD_OTHER);
+
+    return 0;
+}
+
 /**
  * Frees the allocated clusters because the request failed and they won't
  * actually be linked.
@@ -1582,6 +1674,88 @@ out:
     return ret;
 }
 
+/*
+ * Return the allocation extent of the current AioContext, or NULL if
+ * allocating writes have only been coming from a single AioContext so far.
+ * In that case clusters are allocated one request at a time, which keeps
+ * the image layout compact.
+ */
+static Qcow2AllocExtent *qcow2_get_alloc_extent(BDRVQcow2State *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    Qcow2AllocExtent *e;
+
+    if (!s->alloc_extents_enabled) {
+        if (!s->alloc_last_ctx || s->alloc_last_ctx == ctx) {
+            s->alloc_last_ctx = ctx;
+            return NULL;
+        }
+        s->alloc_extents_enabled = true;
+    }
+
+    QLIST_FOREACH(e, &s->alloc_extents, next) {
+        if (e->ctx == ctx) {
+            return e;
+        }
+    }
+
+    e = g_new0(Qcow2AllocExtent, 1);
+    e->ctx = ctx;
+    QLIST_INSERT_HEAD(&s->alloc_extents, e, next);
+    return e;
+}
+
+/*
+ * Take up to *nb_clusters clusters from @e, refilling it first if it is
+ * empty.  The refcounts of the whole extent are updated when it is
+ * refilled, so the clusters handed out are already allocated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+alloc_from_extent(BlockDriverState *bs, Qcow2AllocExtent *e,
+                  uint64_t *host_offset, uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (e->nb_clusters == 0) {
+        uint64_t n = MAX(*nb_clusters,
+                         QCOW2_ALLOC_EXTENT_SIZE >> s->cluster_bits);
+        int64_t offset = qcow2_alloc_clusters(bs, n << s->cluster_bits);
+
+        if (offset < 0) {
+            return offset;
+        }
+        e->offset = offset;
+        e->nb_clusters = n;
+    }
+
+    *host_offset = e->offset;
+    *nb_clusters = MIN(*nb_clusters, e->nb_clusters);
+    e->offset += *nb_clusters << s->cluster_bits;
+    e->nb_clusters -= *nb_clusters;
+    return 0;
+}
+
+/*
+ * Free the clusters that are reserved in allocation extents but not used
+ * yet.  This must be done before the image is closed or made read-only, and
+ * before operations that expect all allocated clusters to be referenced.
+ */
+void qcow2_release_alloc_extents(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2AllocExtent *e, *next;
+
+    QLIST_FOREACH_SAFE(e, &s->alloc_extents, next, next) {
+        if (e->nb_clusters) {
+            qcow2_free_clusters(bs, e->offset,
+                                e->nb_clusters << s->cluster_bits,
+                                QCOW2_DISCARD_NEVER);
+        }
+        QLIST_REMOVE(e, next);
+        g_free(e);
+    }
+}
+
 /*
  * Allocates new clusters for the given guest_offset.
  *
@@ -1606,6 +1780,7 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
                         uint64_t *host_offset, uint64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2AllocExtent *e;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
@@ -1619,6 +1794,11 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    e = qcow2_get_alloc_extent(s);
+    if (e && (*host_offset == INV_OFFSET ||
+              (e->nb_clusters && *host_offset == e->offset))) {
+        return alloc_from_extent(bs, e, host_offset, nb_clusters);
+    }
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
@@ -0,0 +1,380 @@
+/*
+ * Decompressed cluster cache and readahead for the QCOW2 format
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Reading from a compressed cluster means reading and decompressing the
+ * whole cluster, however small the request.  A guest that reads a
+ * compressed image sequentially with requests smaller than a cluster
+ * would therefore decompress every cluster several times, and never have
+ * more than one decompression in flight.
+ *
+ * To avoid that, a few recently decompressed clusters are kept in memory.
+ * When sequential access is detected, the following compressed clusters
+ * are read and decompressed ahead of time, in parallel, into the same
+ * cache.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/memalign.h"
+#include "block/aio_task.h"
+#include "block/block_int-io.h"
+#include "qcow2.h"
+
+/* Memory used for decompressed clusters, and the minimum number of them */
+#define QCOW2_COMPRESSED_CACHE_SIZE (2 * MiB)
+#define QCOW2_COMPRESSED_CACHE_MIN_ENTRIES 4
+
+typedef struct Qcow2DecompressedCluster {
+    /* Host offset of the compressed data; 0 if the entry is unused */
+    uint64_t coffset;
+    int csize;
+    uint8_t *data;
+    uint64_t lru_counter;
+    /* Being read, coffset is set but data is not valid yet */
+    bool busy;
+    /* Value of Qcow2CompressedCache.generation when the read started */
+    uint64_t generation;
+} Qcow2DecompressedCluster;
+
+struct Qcow2CompressedCache {
+    QemuMutex lock;
+    /* Requests waiting for a busy entry */
+    CoQueue waiters;
+
+    Qcow2DecompressedCluster *entries;
+    int nb_entries;
+    uint64_t lru_counter;
+    /* Incremented when the cache is invalidated */
+    uint64_t generation;
+
+    /* Sequential access detection, in guest clusters */
+    uint64_t last_cluster;
+    uint64_t readahead_end;
+    int readahead_clusters;
+    bool readahead_running;
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = g_new0(Qcow2CompressedCache, 1);
+
+    qemu_mutex_init(&c->lock);
+    qemu_co_queue_init(&c->waiters);
+    c->nb_entries = MAX(QCOW2_COMPRESSED_CACHE_SIZE >> s->cluster_bits,
+                        QCOW2_COMPRESSED_CACHE_MIN_ENTRIES);
+    c->entries = g_new0(Qcow2DecompressedCluster, c->nb_entries);
+    c->readahead_clusters = c->nb_entries / 2;
+
+    return c;
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    assert(!c->readahead_running);
+    for (i = 0; i < c->nb_entries; i++) {
+        assert(!c->entries[i].busy);
+        qemu_vfree(c->entries[i].data);
+    }
+    g_free(c->entries);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+/*
+ * Forget all cached clusters.  Must be called whenever a compressed cluster
+ * is allocated, because its host offset may have been used by a compressed
+ * cluster that has since been freed.
+ */
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    c->generation++;
+    for (i = 0; i < c->nb_entries; i++) {
+        /* Busy entries are dropped when their read completes */
+        if (!c->entries[i].busy) {
+            c->entries[i].coffset = 0;
+        }
+    }
+}
+
+static Qcow2DecompressedCluster *
+qcow2_compressed_cache_lookup(Qcow2CompressedCache *c, uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        if (c->entries[i].coffset == coffset) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static Qcow2DecompressedCluster *
+qcow2_compressed_cache_find_victim(Qcow2CompressedCache *c)
+{
+    Qcow2DecompressedCluster *victim = NULL;
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        Qcow2DecompressedCluster *e = &c->entries[i];
+
+        if (e->busy) {
+            continue;
+        }
+        if (!e->coffset) {
+            return e;
+        }
+        if (!victim || e->lru_counter < victim->lru_counter) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Return a valid entry for the cluster at @coffset, reading it if needed.
+ * Called with c->lock held, which is dropped while waiting for I/O.
+ *
+ * Returns NULL and sets *ret to 0 if no entry can be used, in which case
+ * the caller must read the cluster without the cache.  If @wait is false,
+ * this is also the case when another request is already reading the
+ * cluster.
+ */
+static Qcow2DecompressedCluster * coroutine_fn GRAPH_RDLOCK
+qcow2_compressed_cache_co_get_locked(BlockDriverState *bs, uint64_t coffset,
+                                     int csize, bool wait, int *ret)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2DecompressedCluster *e;
+    uint64_t generation;
+
+    *ret = 0;
+
+    while ((e = qcow2_compressed_cache_lookup(c, coffset)) && e->busy) {
+        if (!wait) {
+            return NULL;
+        }
+        qemu_co_queue_wait(&c->waiters, &c->lock);
+    }
+    if (e) {
+        e->lru_counter = ++c->lru_counter;
+        return e;
+    }
+
+    e = qcow2_compressed_cache_find_victim(c);
+    if (!e) {
+        return NULL;
+    }
+    if (!e->data) {
+        e->data = qemu_try_blockalign(bs, s->cluster_size);
+        if (!e->data) {
+            return NULL;
+        }
+    }
+
+    e->coffset = coffset;
+    e->csize = csize;
+    e->busy = true;
+    e->generation = generation = c->generation;
+
+    qemu_mutex_unlock(&c->lock);
+    *ret = qcow2_co_read_compressed_cluster(bs, coffset, csize, e->data);
+    qemu_mutex_lock(&c->lock);
+
+    e->busy = false;
+    e->lru_counter = ++c->lru_counter;
+    qemu_co_queue_restart_all(&c->waiters);
+
+    if (*ret < 0) {
+        e->coffset = 0;
+        return NULL;
+    }
+    if (generation != c->generation) {
+        /*
+         * The data is what the caller asked for, but the cache was
+         * invalidated meanwhile, so do not keep it.
+         */
+        e->coffset = 0;
+    }
+    return e;
+}
+
+typedef struct Qcow2ReadaheadTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t coffset;
+    int csize;
+} Qcow2ReadaheadTask;
+
+/*
+ * This function can count as GRAPH_RDLOCK because
+ * qcow2_compressed_readahead_entry() holds the graph lock and keeps it
+ * until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_compressed_readahead_task_entry(AioTask *task)
+{
+    Qcow2ReadaheadTask *t = container_of(task, Qcow2ReadaheadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    int ret;
+
+    /* Errors are reported when the guest actually reads the cluster */
+    qemu_mutex_lock(&c->lock);
+    qcow2_compressed_cache_co_get_locked(t->bs, t->coffset, t->csize,
+                                         false, &ret);
+    qemu_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+typedef struct Qcow2Readahead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t end;
+} Qcow2Readahead;
+
+static void coroutine_fn qcow2_compressed_readahead_entry(void *opaque)
+{
+    Qcow2Readahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    AioTaskPool *pool = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    uint64_t offset = ra->offset;
+
+    bdrv_graph_co_rdlock();
+
+    while (offset < ra->end) {
+        QCow2SubclusterType type;
+        uint64_t l2_entry, coffset;
+        unsigned int bytes = s->cluster_size;
+        Qcow2ReadaheadTask *t;
+        int csize, ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            break;
+        }
+
+        offset += s->cluster_size;
+        if (type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            continue;
+        }
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        t = g_new(Qcow2ReadaheadTask, 1);
+        *t = (Qcow2ReadaheadTask) {
+            .task.func = qcow2_compressed_readahead_task_entry,
+            .bs = bs,
+            .coffset = coffset,
+            .csize = csize,
+        };
+        aio_task_pool_start_task(pool, &t->task);
+    }
+
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+
+    bdrv_graph_co_rdunlock();
+
+    qemu_mutex_lock(&c->lock);
+    c->readahead_running = false;
+    qemu_mutex_unlock(&c->lock);
+
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Track the guest clusters read, and start reading ahead once two
+ * consecutive clusters have been read.  Called with c->lock held.
+ */
+static void qcow2_compressed_cache_update_readahead(BlockDriverState *bs,
+                                                    uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t nb_clusters = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                        s->cluster_size);
+    bool sequential = cluster == c->last_cluster + 1 ||
+                      (cluster == c->last_cluster && c->readahead_end);
+    Qcow2Readahead *ra;
+    Coroutine *co;
+    uint64_t start, end;
+
+    c->last_cluster = cluster;
+    if (!sequential) {
+        c->readahead_end = 0;
+        return;
+    }
+
+    start = MAX(cluster + 1, c->readahead_end);
+    end = MIN(cluster + 1 + c->readahead_clusters, nb_clusters);
+    /* Only refill once half the window has been consumed */
+    if (c->readahead_running ||
+        start >= end || end - start < c->readahead_clusters / 2) {
+        return;
+    }
+
+    c->readahead_end = end;
+    c->readahead_running = true;
+
+    ra = g_new(Qcow2Readahead, 1);
+    *ra = (Qcow2Readahead) {
+        .bs = bs,
+        .offset = start << s->cluster_bits,
+        .end = end << s->cluster_bits,
+    };
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_compressed_readahead_entry, ra);
+    aio_co_enter(qemu_get_current_aio_context(), co);
+}
+
+/*
+ * Read @bytes at guest @offset from the compressed cluster at @coffset
+ * through the cache.
+ *
+ * Returns 1 on success, 0 if the caller must read the cluster itself, or
+ * -errno on failure.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_compressed_cache_co_preadv(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, uint64_t offset, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2DecompressedCluster *e;
+    int ret;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    e = qcow2_compressed_cache_co_get_locked(bs, coffset, csize, true, &ret);
+    if (!e) {
+        return ret;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset,
+                        e->data + offset_into_cluster(s, offset), bytes);
+    qcow2_compressed_cache_update_readahead(bs, offset);
+
+    return 1;
+}
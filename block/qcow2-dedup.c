@@ -0,0 +1,636 @@
+/*
+ * Cluster deduplication for the QCOW2 format
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * With the "dedup" option, whole clusters written by the guest are hashed,
+ * and when the image already has a cluster with the same contents, the
+ * guest cluster is mapped to it instead of getting a new one.  Sharing
+ * relies on the refcounts just like internal snapshots do: a cluster that
+ * has more than one reference is never written in place.
+ *
+ * The index maps SHA-256 hashes to data clusters.  It has two kinds of
+ * entries:
+ *
+ * - Candidates, for clusters that are only used by the guest cluster they
+ *   were written for (their owner).  The index holds no reference to them,
+ *   and they are forgotten as soon as they are freed or written in place.
+ *
+ * - Shared entries, which a candidate becomes when a duplicate is found.
+ *   The index holds a reference to the cluster, so that L2 entries pointing
+ *   to it never have QCOW_OFLAG_COPIED set, even if only one guest cluster
+ *   is left using it.  The reference is dropped once no guest cluster uses
+ *   the cluster anymore.
+ *
+ * The index is stored in the image by qcow2_dedup_store() and described by
+ * the deduplication index header extension.  Its autoclear bit is cleared
+ * while the image is in use, so that an index that was not stored cleanly,
+ * or that was stored before a program without deduplication support
+ * modified the image, is dropped on the next open.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "block/block-io.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Owner of shared entries, which are not used by a single guest cluster */
+#define QCOW2_DEDUP_SHARED UINT64_MAX
+
+/*
+ * Number of candidates kept in the index.  Shared entries are not limited,
+ * as the index holds references to their clusters.
+ */
+#define QCOW2_DEDUP_MAX_CANDIDATES (4 * 1024 * 1024)
+
+#define QCOW2_DEDUP_MAX_INDEX_SIZE (1 * GiB)
+
+/* Also the on-disk format of index entries, in big endian */
+typedef struct Qcow2DedupEntry {
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    uint64_t host_offset;
+    uint64_t owner;
+} Qcow2DedupEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(Qcow2DedupEntry) != 48);
+
+struct Qcow2Dedup {
+    /* Entries by hash, and by host offset (the latter owns them) */
+    GHashTable *by_hash;
+    GHashTable *by_offset;
+    uint64_t nb_candidates;
+
+    /* Shared entries whose cluster is not used by any guest cluster */
+    GPtrArray *orphans;
+
+    /* The autoclear bit was cleared, the index must be stored again */
+    bool in_use;
+};
+
+static guint qcow2_dedup_hash_func(gconstpointer key)
+{
+    guint h;
+
+    /* Any part of a SHA-256 hash is as good as another */
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean qcow2_dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, QCOW2_DEDUP_HASH_SIZE);
+}
+
+static Qcow2Dedup *qcow2_dedup_new(void)
+{
+    Qcow2Dedup *d = g_new0(Qcow2Dedup, 1);
+
+    d->by_hash = g_hash_table_new(qcow2_dedup_hash_func,
+                                  qcow2_dedup_hash_equal);
+    d->by_offset = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                         NULL, g_free);
+    d->orphans = g_ptr_array_new_with_free_func(g_free);
+
+    return d;
+}
+
+void qcow2_dedup_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+
+    if (!d) {
+        return;
+    }
+
+    g_hash_table_destroy(d->by_hash);
+    g_hash_table_destroy(d->by_offset);
+    g_ptr_array_free(d->orphans, true);
+    g_free(d);
+    s->dedup = NULL;
+}
+
+static void qcow2_dedup_add(Qcow2Dedup *d, Qcow2DedupEntry *e)
+{
+    g_hash_table_insert(d->by_hash, e->hash, e);
+    g_hash_table_insert(d->by_offset, &e->host_offset, e);
+    if (e->owner != QCOW2_DEDUP_SHARED) {
+        d->nb_candidates++;
+    }
+}
+
+/* Takes @e out of the index without freeing it */
+static void qcow2_dedup_steal(Qcow2Dedup *d, Qcow2DedupEntry *e)
+{
+    if (e->owner != QCOW2_DEDUP_SHARED) {
+        d->nb_candidates--;
+    }
+    g_hash_table_remove(d->by_hash, e->hash);
+    g_hash_table_steal(d->by_offset, &e->host_offset);
+}
+
+static void qcow2_dedup_remove(Qcow2Dedup *d, Qcow2DedupEntry *e)
+{
+    qcow2_dedup_steal(d, e);
+    g_free(e);
+}
+
+int coroutine_fn qcow2_dedup_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *entries;
+    Qcow2Dedup *d;
+    uint64_t i;
+    int ret;
+
+    assert(!s->dedup);
+
+    if (!s->has_dedup_index) {
+        return 0;
+    }
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP)) {
+        if (s->dedup_nb_entries) {
+            warn_report("the deduplication index is inconsistent, the image "
+                        "was not closed cleanly or was modified by a program "
+                        "lacking deduplication support");
+            error_printf("Some clusters may be leaked, "
+                         "run 'qemu-img check -r all' on the image "
+                         "file to fix.\n");
+        }
+        s->dedup_nb_entries = 0;
+        s->dedup_index_offset = 0;
+        s->dedup = qcow2_dedup_new();
+        return 0;
+    }
+
+    d = qcow2_dedup_new();
+    if (!s->dedup_nb_entries) {
+        s->dedup = d;
+        return 0;
+    }
+
+    ret = qcow2_validate_table(bs, s->dedup_index_offset, s->dedup_nb_entries,
+                               sizeof(Qcow2DedupEntry),
+                               QCOW2_DEDUP_MAX_INDEX_SIZE,
+                               "Deduplication index", errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    entries = g_try_new(Qcow2DedupEntry, s->dedup_nb_entries);
+    if (!entries) {
+        error_setg(errp, "Could not allocate memory for the deduplication "
+                   "index");
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->dedup_index_offset,
+                        s->dedup_nb_entries * sizeof(Qcow2DedupEntry),
+                        entries, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the deduplication index");
+        g_free(entries);
+        goto fail;
+    }
+
+    for (i = 0; i < s->dedup_nb_entries; i++) {
+        Qcow2DedupEntry *e = g_new(Qcow2DedupEntry, 1);
+
+        memcpy(e->hash, entries[i].hash, QCOW2_DEDUP_HASH_SIZE);
+        e->host_offset = be64_to_cpu(entries[i].host_offset);
+        e->owner = be64_to_cpu(entries[i].owner);
+
+        if (!e->host_offset || offset_into_cluster(s, e->host_offset) ||
+            (e->owner != QCOW2_DEDUP_SHARED &&
+             offset_into_cluster(s, e->owner)) ||
+            g_hash_table_contains(d->by_hash, e->hash) ||
+            g_hash_table_contains(d->by_offset, &e->host_offset)) {
+            error_setg(errp, "Invalid deduplication index entry %" PRIu64, i);
+            g_free(e);
+            g_free(entries);
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        qcow2_dedup_add(d, e);
+    }
+    g_free(entries);
+
+    s->dedup = d;
+    return 0;
+
+fail:
+    s->dedup = d;
+    qcow2_dedup_free(bs);
+    return ret;
+}
+
+/*
+ * Called before an image with a loaded index is written to: the autoclear
+ * bit is cleared, so that the stored index is dropped if the image is not
+ * closed cleanly.  If the dedup option is set for an image that has no
+ * index, an empty one is created.
+ */
+int qcow2_dedup_activate(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->dedup) {
+        if (!s->dedup_enabled) {
+            return 0;
+        }
+        s->dedup = qcow2_dedup_new();
+        s->has_dedup_index = true;
+        s->dedup_nb_entries = 0;
+        s->dedup_index_offset = 0;
+    } else if (s->dedup->in_use) {
+        return 0;
+    }
+
+    s->dedup->in_use = true;
+    s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DEDUP;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the index to the image and sets the autoclear bit again.  With
+ * @release, the index is dropped from memory afterwards, also on failure.
+ */
+int qcow2_dedup_store(BlockDriverState *bs, bool release, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    uint64_t old_offset = s->dedup_index_offset;
+    uint64_t old_size = s->dedup_nb_entries * sizeof(Qcow2DedupEntry);
+    uint64_t nb_entries, size, i = 0;
+    int64_t offset = 0;
+    Qcow2DedupEntry *entries = NULL;
+    GHashTableIter iter;
+    gpointer value;
+    int ret = 0;
+
+    if (!d || !d->in_use) {
+        goto out;
+    }
+
+    qcow2_dedup_release_orphans(bs);
+
+    nb_entries = g_hash_table_size(d->by_offset);
+    size = nb_entries * sizeof(Qcow2DedupEntry);
+    if (size > QCOW2_DEDUP_MAX_INDEX_SIZE) {
+        error_setg(errp, "Deduplication index too large");
+        ret = -EFBIG;
+        goto out;
+    }
+
+    if (nb_entries) {
+        entries = g_try_malloc(size);
+        if (!entries) {
+            error_setg(errp, "Could not allocate memory for the "
+                       "deduplication index");
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        g_hash_table_iter_init(&iter, d->by_offset);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            Qcow2DedupEntry *e = value;
+
+            memcpy(entries[i].hash, e->hash, QCOW2_DEDUP_HASH_SIZE);
+            entries[i].host_offset = cpu_to_be64(e->host_offset);
+            entries[i].owner = cpu_to_be64(e->owner);
+            i++;
+        }
+
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            error_setg_errno(errp, -offset, "Could not allocate clusters for "
+                             "the deduplication index");
+            ret = offset;
+            goto out;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+        if (ret >= 0) {
+            ret = bdrv_pwrite(bs->file, offset, size, entries, 0);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the deduplication "
+                             "index");
+            qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+            goto out;
+        }
+    }
+
+    /* The references held by the index must be on disk before the index */
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush the metadata caches");
+        if (nb_entries) {
+            qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+        }
+        goto out;
+    }
+
+    s->dedup_index_offset = offset;
+    s->dedup_nb_entries = nb_entries;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        /* The old index is still referenced by the previous header */
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DEDUP;
+        goto out;
+    }
+
+    d->in_use = false;
+    if (old_size) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+out:
+    g_free(entries);
+    if (release) {
+        qcow2_dedup_free(bs);
+    }
+    return ret;
+}
+
+/*
+ * Records that the cluster at @host_offset, which has just been written
+ * for the guest cluster at @owner and is only used by it, hashes to @hash.
+ * Called with s->lock held.
+ */
+void qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                        uint64_t host_offset, uint64_t owner)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    Qcow2DedupEntry *e;
+
+    if (!d || d->nb_candidates >= QCOW2_DEDUP_MAX_CANDIDATES ||
+        g_hash_table_contains(d->by_hash, hash)) {
+        return;
+    }
+
+    e = g_hash_table_lookup(d->by_offset, &host_offset);
+    if (e) {
+        qcow2_dedup_remove(d, e);
+    }
+
+    e = g_new(Qcow2DedupEntry, 1);
+    memcpy(e->hash, hash, QCOW2_DEDUP_HASH_SIZE);
+    e->host_offset = host_offset;
+    e->owner = owner;
+    qcow2_dedup_add(d, e);
+}
+
+/*
+ * Forgets the candidates in [@host_offset, @host_offset + @bytes), which
+ * are about to be written in place.  Called with s->lock held.
+ */
+void qcow2_dedup_forget_range(BlockDriverState *bs, uint64_t host_offset,
+                              uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    uint64_t offset;
+
+    if (!d || !d->nb_candidates) {
+        return;
+    }
+
+    for (offset = start_of_cluster(s, host_offset);
+         offset < host_offset + bytes;
+         offset += s->cluster_size)
+    {
+        Qcow2DedupEntry *e = g_hash_table_lookup(d->by_offset, &offset);
+
+        /* Shared clusters are never written in place */
+        if (e && e->owner != QCOW2_DEDUP_SHARED) {
+            qcow2_dedup_remove(d, e);
+        }
+    }
+}
+
+/*
+ * Called by update_refcount() when the refcount of the cluster at
+ * @host_offset has been decreased to @refcount.
+ */
+void qcow2_dedup_refcount_dropped(BlockDriverState *bs, uint64_t host_offset,
+                                  uint64_t refcount)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    Qcow2DedupEntry *e;
+
+    if (!d || refcount > 1) {
+        return;
+    }
+
+    e = g_hash_table_lookup(d->by_offset, &host_offset);
+    if (!e) {
+        return;
+    }
+
+    if (refcount == 0) {
+        qcow2_dedup_remove(d, e);
+    } else if (e->owner == QCOW2_DEDUP_SHARED) {
+        /*
+         * Only the index uses the cluster now.  Its reference cannot be
+         * dropped from within update_refcount(), so this is deferred to
+         * qcow2_dedup_release_orphans().
+         */
+        qcow2_dedup_steal(d, e);
+        g_ptr_array_add(d->orphans, e);
+    }
+}
+
+/*
+ * Drops the references that the index holds to clusters no guest cluster
+ * uses anymore.  Called with s->lock held, or from the main loop.
+ */
+void qcow2_dedup_release_orphans(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+
+    if (!d) {
+        return;
+    }
+
+    while (d->orphans->len) {
+        Qcow2DedupEntry *e = g_ptr_array_steal_index_fast(d->orphans,
+                                                          d->orphans->len - 1);
+        uint64_t refcount;
+        int ret;
+
+        ret = qcow2_get_refcount(bs, e->host_offset >> s->cluster_bits,
+                                 &refcount);
+        if (ret == 0 && refcount == 1) {
+            qcow2_free_clusters(bs, e->host_offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        } else if (ret == 0 && refcount > 1 &&
+                   !g_hash_table_contains(d->by_hash, e->hash)) {
+            /* Used again since it was orphaned (e.g. by reverting an update) */
+            qcow2_dedup_add(d, e);
+            continue;
+        }
+        /* Otherwise the reference is leaked, which qemu-img check repairs */
+        g_free(e);
+    }
+}
+
+/*
+ * Hashes the cluster-sized data in @buf into @hash, and maps the guest
+ * cluster at @offset to a cluster that already has this data, if the index
+ * knows one.  @buf must be a private copy of the guest data, which the
+ * caller writes if the cluster is not mapped, so that the index never
+ * describes a cluster by data it does not hold.
+ *
+ * Returns 1 if the cluster was mapped, 0 if the caller must write it, or
+ * -errno on failure.
+ */
+int coroutine_fn
+qcow2_dedup_co_pwritev_cluster(BlockDriverState *bs, uint64_t offset,
+                               const void *buf, uint8_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *e;
+    QCowL2Meta *m;
+    uint64_t host_offset;
+    bool candidate;
+    int ret;
+
+    ret = qcow2_co_hash_cluster(bs, buf, hash);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!s->dedup) {
+        return 0;
+    }
+
+    e = g_hash_table_lookup(s->dedup->by_hash, hash);
+    if (!e || e->owner == offset) {
+        return 0;
+    }
+
+    /* Leave guest clusters that are being allocated to their request */
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (offset >= m->offset &&
+            offset - m->offset < ((uint64_t)m->nb_clusters << s->cluster_bits))
+        {
+            return 0;
+        }
+    }
+
+    host_offset = e->host_offset;
+    candidate = e->owner != QCOW2_DEDUP_SHARED;
+
+    if (candidate) {
+        ret = qcow2_cluster_clear_copied(bs, e->owner, host_offset);
+        if (ret <= 0) {
+            /* The owner does not use the cluster alone anymore */
+            qcow2_dedup_remove(s->dedup, e);
+            return ret;
+        }
+    }
+
+    /* With a candidate, the index takes a reference as well */
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        candidate ? 2 : 1, false,
+                                        QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        if (candidate) {
+            qcow2_dedup_remove(s->dedup, e);
+        }
+        return ret;
+    }
+
+    if (candidate) {
+        s->dedup->nb_candidates--;
+        e->owner = QCOW2_DEDUP_SHARED;
+    }
+
+    ret = qcow2_cluster_link_shared(bs, offset, host_offset);
+    if (ret < 0) {
+        qcow2_free_clusters(bs, host_offset, s->cluster_size,
+                            QCOW2_DISCARD_NEVER);
+        return ret;
+    }
+
+    trace_qcow2_dedup_share(qemu_coroutine_self(), offset, host_offset);
+    qcow2_dedup_release_orphans(bs);
+
+    return 1;
+}
+
+int coroutine_fn
+qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                            void **refcount_table,
+                            int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    GHashTableIter iter;
+    gpointer value;
+    int ret;
+    guint i;
+
+    if (!d) {
+        return 0;
+    }
+
+    if (s->dedup_nb_entries) {
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       s->dedup_index_offset,
+                                       s->dedup_nb_entries *
+                                       sizeof(Qcow2DedupEntry));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    g_hash_table_iter_init(&iter, d->by_offset);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        Qcow2DedupEntry *e = value;
+
+        if (e->owner != QCOW2_DEDUP_SHARED) {
+            continue;
+        }
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       e->host_offset, s->cluster_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < d->orphans->len; i++) {
+        Qcow2DedupEntry *e = g_ptr_array_index(d->orphans, i);
+
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       e->host_offset, s->cluster_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
@@ -885,6 +885,10 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
         }
         s->set_refcount(refcount_block, block_index, refcount);
 
+        if (decrease) {
+            qcow2_dedup_refcount_dropped(bs, cluster_offset, refcount);
+        }
+
         if (refcount == 0) {
             void *table;
 
@@ -2310,6 +2314,12 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* deduplication index */
+    ret = qcow2_check_dedup_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
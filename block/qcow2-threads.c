@@ -1,5 +1,5 @@
 /*
- * Threaded data processing for Qcow2: compression, encryption
+ * Threaded data processing for Qcow2: compression, encryption, hashing
  *
  * Copyright (c) 2004-2006 Fabrice Bellard
  * Copyright (c) 2018 Virtuozzo International GmbH. All rights reserved.
@@ -37,6 +37,7 @@
 #include "block/block-io.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
+#include "crypto/hash.h"
 
 static int coroutine_fn
 qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
@@ -525,3 +526,46 @@ qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
                            qcrypto_block_decrypt);
 }
+
+
+/*
+ * Hashing
+ */
+
+typedef struct Qcow2HashData {
+    const void *buf;
+    size_t len;
+    uint8_t *hash;
+} Qcow2HashData;
+
+static int qcow2_hash_pool_func(void *opaque)
+{
+    Qcow2HashData *data = opaque;
+    size_t len = QCOW2_DEDUP_HASH_SIZE;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALGO_SHA256, data->buf, data->len,
+                           &data->hash, &len, NULL) < 0) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * qcow2_co_hash_cluster()
+ *
+ * Computes the SHA-256 hash of the cluster-sized data in @buf into @hash,
+ * which must hold QCOW2_DEDUP_HASH_SIZE bytes.
+ */
+int coroutine_fn
+qcow2_co_hash_cluster(BlockDriverState *bs, const void *buf, uint8_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2HashData arg = {
+        .buf = buf,
+        .len = s->cluster_size,
+        .hash = hash,
+    };
+
+    return qcow2_co_process(bs, qcow2_hash_pool_func, &arg);
+}
@@ -42,6 +42,7 @@
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/qapi-visit-block-core.h"
 #include "crypto.h"
+#include "crypto/hash.h"
 #include "block/aio_task.h"
 #include "block/dirty-bitmap.h"
 
@@ -73,6 +74,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_DEDUP 0x44454455
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -432,6 +434,28 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_DEDUP:
+        {
+            Qcow2DedupHeaderExt dedup_ext;
+
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "dedup_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &dedup_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            s->has_dedup_index = true;
+            s->dedup_nb_entries = be64_to_cpu(dedup_ext.nb_entries);
+            s->dedup_index_offset = be64_to_cpu(dedup_ext.index_offset);
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -614,6 +638,9 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved clusters would be reported as leaked */
+    qcow2_release_alloc_extents(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -701,6 +728,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_DEDUP,
     NULL
 };
 
@@ -817,6 +845,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share written clusters with identical existing ones",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -1050,6 +1083,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
+    bool dedup;
     uint64_t cache_clean_interval;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
@@ -1229,6 +1263,31 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->dedup = qemu_opt_get_bool(opts, QCOW2_OPT_DEDUP, false);
+    if (r->dedup) {
+        if (s->qcow_version < 3) {
+            error_setg(errp, "dedup is only supported since qcow2 version 3");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (s->crypt_method_header != QCOW_CRYPT_NONE) {
+            error_setg(errp, "dedup is not supported for encrypted images");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE) {
+            error_setg(errp, "dedup is not supported with an external data "
+                       "file");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (!qcrypto_hash_supports(QCRYPTO_HASH_ALGO_SHA256)) {
+            error_setg(errp, "dedup requires SHA-256 support");
+            ret = -ENOTSUP;
+            goto fail;
+        }
+    }
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1323,6 +1382,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->dedup_enabled = r->dedup;
 
     s->cache_clean_interval = r->cache_clean_interval;
     cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
@@ -1933,6 +1993,11 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
 
         update_header = update_header && !header_updated;
+
+        ret = qcow2_dedup_load(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     if (update_header) {
@@ -1943,6 +2008,13 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    if (bdrv_is_writable(bs)) {
+        ret = qcow2_dedup_activate(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     bs->supported_zero_flags = header.version >= 3 ?
                                BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK : 0;
     bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
@@ -1971,6 +2043,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->compressed_cache = qcow2_compressed_cache_create(bs);
 
     return ret;
 
@@ -1986,6 +2059,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    qcow2_dedup_free(bs);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
@@ -2092,11 +2166,18 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_release_alloc_extents(state->bs);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
         }
 
+        ret = qcow2_dedup_store(state->bs, false, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2160,6 +2241,16 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        if (qcow2_dedup_activate(state->bs, &local_err) < 0) {
+            /* Do not add to an index that may be taken as valid later */
+            BDRVQcow2State *s = state->bs->opaque;
+
+            error_reportf_err(local_err,
+                              "%s: Failed to enable deduplication: ",
+                              bdrv_get_node_name(state->bs));
+            s->dedup_enabled = false;
+        }
     }
 }
 
@@ -2226,39 +2317,19 @@ static void qcow2_join_options(QDict *options, QDict *old_options)
     }
 }
 
-static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_block_status(BlockDriverState *bs, unsigned int mode,
-                      int64_t offset, int64_t count, int64_t *pnum,
-                      int64_t *map, BlockDriverState **file)
+static int qcow2_block_status_from_type(BlockDriverState *bs,
+                                        QCow2SubclusterType type,
+                                        uint64_t host_offset,
+                                        BlockStatusExtent *extent)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t host_offset;
-    unsigned int bytes;
-    QCow2SubclusterType type;
-    int ret, status = 0;
-
-    qemu_co_mutex_lock(&s->lock);
-
-    if (!s->metadata_preallocation_checked) {
-        ret = qcow2_detect_metadata_preallocation(bs);
-        s->metadata_preallocation = (ret == 1);
-        s->metadata_preallocation_checked = true;
-    }
-
-    bytes = MIN(INT_MAX, count);
-    ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
-    qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        return ret;
-    }
-
-    *pnum = bytes;
+    int status = 0;
 
     if ((type == QCOW2_SUBCLUSTER_NORMAL ||
          type == QCOW2_SUBCLUSTER_ZERO_ALLOC ||
          type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) && !s->crypto) {
-        *map = host_offset;
-        *file = s->data_file->bs;
+        extent->map = host_offset;
+        extent->file = s->data_file->bs;
         status |= BDRV_BLOCK_OFFSET_VALID;
     }
     if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2279,6 +2350,70 @@ qcow2_co_block_status(BlockDriverState *bs, unsigned int mode,
     return status;
 }
 
+/*
+ * Look up as many consecutive extents as fit into @extents while holding
+ * s->lock once, so that walking a sparse image does not take the lock and
+ * look up the L2 slice again for every extent.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_block_status_batch(BlockDriverState *bs, unsigned int mode,
+                            int64_t offset, int64_t count,
+                            BlockStatusExtent *extents, int nb_extents)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t host_offset;
+    unsigned int bytes;
+    QCow2SubclusterType type;
+    int i, ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (!s->metadata_preallocation_checked) {
+        ret = qcow2_detect_metadata_preallocation(bs);
+        s->metadata_preallocation = (ret == 1);
+        s->metadata_preallocation_checked = true;
+    }
+
+    for (i = 0; i < nb_extents && count > 0; i++) {
+        bytes = MIN(INT_MAX, count);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+        if (ret < 0) {
+            break;
+        }
+
+        extents[i] = (BlockStatusExtent) { .bytes = bytes };
+        extents[i].ret = qcow2_block_status_from_type(bs, type, host_offset,
+                                                      &extents[i]);
+        offset += bytes;
+        count -= bytes;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* Only fail if nothing could be looked up */
+    return i ? i : ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_block_status(BlockDriverState *bs, unsigned int mode,
+                      int64_t offset, int64_t count, int64_t *pnum,
+                      int64_t *map, BlockDriverState **file)
+{
+    BlockStatusExtent extent;
+    int ret;
+
+    ret = qcow2_co_block_status_batch(bs, mode, offset, count, &extent, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *pnum = extent.bytes;
+    if (extent.ret & BDRV_BLOCK_OFFSET_VALID) {
+        *map = extent.map;
+        *file = extent.file;
+    }
+    return extent.ret;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_handle_l2meta(BlockDriverState *bs, QCowL2Meta **pl2meta, bool link_l2)
 {
@@ -2303,6 +2438,7 @@ qcow2_handle_l2meta(BlockDriverState *bs, QCowL2Meta **pl2meta, bool link_l2)
         qemu_co_queue_restart_all(&l2meta->dependent_requests);
 
         next = l2meta->next;
+        qemu_vfree(l2meta->dedup_buf);
         g_free(l2meta);
         l2meta = next;
     }
@@ -2684,6 +2820,7 @@ int qcow2_co_pwritev_task(BlockDriverState *bs, uint64_t host_offset,
     BDRVQcow2State *s = bs->opaque;
     void *crypt_buf = NULL;
     QEMUIOVector encrypted_qiov;
+    QEMUIOVector dedup_qiov;
 
     if (bs->encrypted) {
         assert(s->crypto);
@@ -2703,6 +2840,12 @@ int qcow2_co_pwritev_task(BlockDriverState *bs, uint64_t host_offset,
         qemu_iovec_init_buf(&encrypted_qiov, crypt_buf, bytes);
         qiov = &encrypted_qiov;
         qiov_offset = 0;
+    } else if (l2meta && l2meta->dedup_buf) {
+        /* Write the data that was hashed */
+        assert(bytes == s->cluster_size);
+        qemu_iovec_init_buf(&dedup_qiov, l2meta->dedup_buf, bytes);
+        qiov = &dedup_qiov;
+        qiov_offset = 0;
     }
 
     /* Try to efficiently initialize the physical space with zeroes */
@@ -2771,10 +2914,13 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    void *dedup_buf = NULL;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
+        uint8_t dedup_hash[QCOW2_DEDUP_HASH_SIZE];
+        bool dedup = false;
 
         l2meta = NULL;
 
@@ -2787,6 +2933,38 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             - offset_in_cluster);
         }
 
+        if (s->dedup_enabled && offset_in_cluster == 0 &&
+            cur_bytes >= s->cluster_size) {
+            /*
+             * The guest may modify its buffer while the request is in
+             * flight.  Hash and write the same copy, so that the index
+             * matches the cluster contents.
+             */
+            dedup_buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+            if (dedup_buf == NULL) {
+                ret = -ENOMEM;
+                goto fail_nometa;
+            }
+            qemu_iovec_to_buf(qiov, qiov_offset, dedup_buf, s->cluster_size);
+
+            ret = qcow2_dedup_co_pwritev_cluster(bs, offset, dedup_buf,
+                                                 dedup_hash);
+            if (ret < 0) {
+                goto fail_nometa;
+            }
+            if (ret > 0) {
+                qemu_vfree(dedup_buf);
+                dedup_buf = NULL;
+                bytes -= s->cluster_size;
+                offset += s->cluster_size;
+                qiov_offset += s->cluster_size;
+                continue;
+            }
+            /* Write one cluster at a time, so that it can be indexed */
+            cur_bytes = s->cluster_size;
+            dedup = true;
+        }
+
         qemu_co_mutex_lock(&s->lock);
 
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
@@ -2795,6 +2973,14 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto out_locked;
         }
 
+        qcow2_dedup_forget_range(bs, host_offset, cur_bytes);
+        if (dedup && l2meta) {
+            l2meta->dedup = true;
+            memcpy(l2meta->dedup_hash, dedup_hash, QCOW2_DEDUP_HASH_SIZE);
+            l2meta->dedup_buf = dedup_buf;
+            dedup_buf = NULL;
+        }
+
         ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
                                             cur_bytes, true);
         if (ret < 0) {
@@ -2810,6 +2996,9 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                              host_offset, offset,
                              cur_bytes, qiov, qiov_offset, l2meta);
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
+        /* Written in place and not indexed, the guest data is used */
+        qemu_vfree(dedup_buf);
+        dedup_buf = NULL;
         if (ret < 0) {
             goto fail_nometa;
         }
@@ -2829,6 +3018,7 @@ out_locked:
     qemu_co_mutex_unlock(&s->lock);
 
 fail_nometa:
+    qemu_vfree(dedup_buf);
     if (aio) {
         aio_task_pool_wait_all(aio);
         if (ret == 0) {
@@ -2848,6 +3038,8 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_alloc_extents(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2856,6 +3048,13 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    if (qcow2_dedup_store(bs, true, &local_err) < 0) {
+        result = -EINVAL;
+        error_reportf_err(local_err, "Lost the deduplication index during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2892,6 +3091,9 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del_and_wait(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
+    qcow2_dedup_free(bs);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -3185,6 +3387,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
                 .name = "raw external data",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DEDUP_BITNR,
+                .name = "deduplication index",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -3215,6 +3422,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Deduplication index extension */
+    if (s->has_dedup_index) {
+        Qcow2DedupHeaderExt dedup_header = {
+            .nb_entries = cpu_to_be64(s->dedup_nb_entries),
+            .index_offset = cpu_to_be64(s->dedup_index_offset),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP,
+                             &dedup_header, sizeof(dedup_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -4347,6 +4570,7 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
         if (ret < 0) {
             goto fail;
         }
+        qcow2_dedup_forget_range(bs, host_offset, cur_bytes);
 
         ret = qcow2_pre_write_overlap_check(bs, 0, host_offset, cur_bytes,
                                             true);
@@ -4410,6 +4634,8 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
 
     qemu_co_mutex_lock(&s->lock);
 
+    qcow2_release_alloc_extents(bs);
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4804,6 +5030,7 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
     }
+    qcow2_compressed_cache_invalidate(s->compressed_cache);
 
     ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
     qemu_co_mutex_unlock(&s->lock);
@@ -4907,6 +5134,37 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/* Read the compressed cluster at @coffset and decompress it into @dest */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_read_compressed_cluster(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, void *dest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, dest, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+fail:
+    g_free(buf);
+
+    return ret;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t l2_entry,
@@ -4918,34 +5176,26 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     int ret = 0, csize;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
+    uint8_t *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
+    ret = qcow2_compressed_cache_co_preadv(bs, coffset, csize, offset, bytes,
+                                           qiov, qiov_offset);
+    if (ret != 0) {
+        return MIN(ret, 0);
     }
 
     out_buf = qemu_blockalign(bs, s->cluster_size);
 
-    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
-    if (ret < 0) {
-        goto fail;
+    ret = qcow2_co_read_compressed_cluster(bs, coffset, csize, out_buf);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
-    }
-
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
-fail:
     qemu_vfree(out_buf);
-    g_free(buf);
 
     return ret;
 }
@@ -5110,19 +5360,22 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    qcow2_release_alloc_extents(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
+        !s->has_dedup_index &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
-         * empties the image.  Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one
-         * refcount block) have to fit inside one refcount block. It
-         * only resets the image file, i.e. does not work with an
-         * external data file. */
+         * LUKS header, persistent bitmaps, or a deduplication index),
+         * because it completely empties the image.  Furthermore, the
+         * L1 table and three additional clusters (image header,
+         * refcount table, one refcount block) have to fit inside one
+         * refcount block. It only resets the image file, i.e. does not
+         * work with an external data file. */
         return make_completely_empty(bs);
     }
 
@@ -5141,6 +5394,7 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
             break;
         }
     }
+    qcow2_dedup_release_orphans(bs);
 
     return ret;
 }
@@ -5151,6 +5405,7 @@ static coroutine_fn GRAPH_RDLOCK int qcow2_co_flush_to_os(BlockDriverState *bs)
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
+    qcow2_dedup_release_orphans(bs);
     ret = qcow2_write_caches(bs);
     qemu_co_mutex_unlock(&s->lock);
 
@@ -5557,6 +5812,12 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->has_dedup_index) {
+        error_setg(errp, "Cannot downgrade an image with a deduplication "
+                   "index");
+        return -ENOTSUP;
+    }
+
     /*
      * If any internal snapshot has a different size than the current
      * image size, or VM state size that exceeds 32 bits, downgrading
@@ -6244,6 +6505,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_create                     = qcow2_co_create,
     .bdrv_has_zero_init                 = qcow2_has_zero_init,
     .bdrv_co_block_status               = qcow2_co_block_status,
+    .bdrv_co_block_status_batch         = qcow2_co_block_status_batch,
 
     .bdrv_co_preadv_part                = qcow2_co_preadv_part,
     .bdrv_co_pwritev_part               = qcow2_co_pwritev_part,
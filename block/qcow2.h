@@ -151,6 +151,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_DEDUP "dedup"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -282,11 +283,14 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_DEDUP_BITNR         = 2,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_DEDUP               = 1 << QCOW2_AUTOCLEAR_DEDUP_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_DEDUP,
 };
 
 enum qcow2_discard_type {
@@ -323,8 +327,41 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2DedupHeaderExt {
+    uint64_t nb_entries;
+    uint64_t index_offset;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+/* Size of the SHA-256 hashes used for deduplication */
+#define QCOW2_DEDUP_HASH_SIZE 32
+
+typedef struct Qcow2Dedup Qcow2Dedup;
+
 #define QCOW2_MAX_THREADS 4
 
+/*
+ * Data clusters reserved in one go for the allocating writes of an
+ * AioContext, so that writers on different queues do not interleave their
+ * clusters and do not update the refcounts for every single allocation.
+ *
+ * The reserved clusters are allocated in the refcount structures, but not
+ * referenced by any L2 table until they are used, so they leak if QEMU
+ * does not release them, e.g. because it crashes.  'qemu-img check -r
+ * leaks' repairs this.
+ */
+typedef struct Qcow2AllocExtent {
+    AioContext *ctx;
+    /* Host offset of the first reserved cluster */
+    uint64_t offset;
+    uint64_t nb_clusters;
+    QLIST_ENTRY(Qcow2AllocExtent) next;
+} Qcow2AllocExtent;
+
+/* Size of a new Qcow2AllocExtent */
+#define QCOW2_ALLOC_EXTENT_SIZE (1 * MiB)
+
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -361,6 +398,14 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Only used once allocating writes have been seen from more than one
+     * AioContext; until then alloc_last_ctx is the only one seen.
+     */
+    QLIST_HEAD(, Qcow2AllocExtent) alloc_extents;
+    AioContext *alloc_last_ctx;
+    bool alloc_extents_enabled;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -378,6 +423,15 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /* Deduplication index extension, see qcow2-dedup.c */
+    bool has_dedup_index;
+    uint64_t dedup_nb_entries;
+    uint64_t dedup_index_offset;
+    /* Loaded index; NULL while the image is inactive or has no index */
+    Qcow2Dedup *dedup;
+    /* Look up whole clusters in the index when they are written */
+    bool dedup_enabled;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -415,6 +469,8 @@ typedef struct BDRVQcow2State {
     CoQueue thread_task_queue;
     int nb_threads;
 
+    Qcow2CompressedCache *compressed_cache;
+
     BdrvChild *data_file;
 
     bool metadata_preallocation_checked;
@@ -500,6 +556,20 @@ typedef struct QCowL2Meta
     QEMUIOVector *data_qiov;
     size_t data_qiov_offset;
 
+    /**
+     * The allocation is for a single cluster whose contents hash to
+     * @dedup_hash, and it is added to the deduplication index once linked.
+     */
+    bool dedup;
+    uint8_t dedup_hash[QCOW2_DEDUP_HASH_SIZE];
+
+    /**
+     * Copy of the guest data that @dedup_hash was computed from.  The
+     * cluster is written from it, so that its contents match the hash even
+     * if the guest modifies its buffer meanwhile.  Freed with the L2Meta.
+     */
+    void *dedup_buf;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -944,6 +1014,7 @@ int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                         unsigned int *bytes, uint64_t *host_offset,
                         QCowL2Meta **m);
+void GRAPH_RDLOCK qcow2_release_alloc_extents(BlockDriverState *bs);
 
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
@@ -966,6 +1037,13 @@ int coroutine_fn GRAPH_RDLOCK
 qcow2_subcluster_zeroize(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                          int flags);
 
+int GRAPH_RDLOCK
+qcow2_cluster_clear_copied(BlockDriverState *bs, uint64_t offset,
+                           uint64_t host_offset);
+int GRAPH_RDLOCK
+qcow2_cluster_link_shared(BlockDriverState *bs, uint64_t offset,
+                          uint64_t host_offset);
+
 int GRAPH_RDLOCK
 qcow2_expand_zero_clusters(BlockDriverState *bs,
                            BlockDriverAmendStatusCB *status_cb,
@@ -1066,6 +1144,43 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_compressed_cache_co_preadv(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, uint64_t offset, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_read_compressed_cluster(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, void *dest);
+
+/* qcow2-dedup.c functions */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_load(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK qcow2_dedup_activate(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK
+qcow2_dedup_store(BlockDriverState *bs, bool release, Error **errp);
+void qcow2_dedup_free(BlockDriverState *bs);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_co_pwritev_cluster(BlockDriverState *bs, uint64_t offset,
+                               const void *buf, uint8_t *hash);
+void qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                        uint64_t host_offset, uint64_t owner);
+void qcow2_dedup_forget_range(BlockDriverState *bs, uint64_t host_offset,
+                              uint64_t bytes);
+void qcow2_dedup_refcount_dropped(BlockDriverState *bs, uint64_t host_offset,
+                                  uint64_t refcount);
+void GRAPH_RDLOCK qcow2_dedup_release_orphans(BlockDriverState *bs);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                            void **refcount_table,
+                            int64_t *refcount_table_size);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
@@ -1078,5 +1193,7 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+int coroutine_fn
+qcow2_co_hash_cluster(BlockDriverState *bs, const void *buf, uint8_t *hash);
 
 #endif
@@ -294,6 +294,29 @@ raw_co_block_status(BlockDriverState *bs, unsigned int mode,
     return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
 }
 
+/*
+ * The whole range maps to the file child, so return it as a single extent;
+ * the block layer then queries the extents of the child in a batch.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+raw_co_block_status_batch(BlockDriverState *bs, unsigned int mode,
+                          int64_t offset, int64_t bytes,
+                          BlockStatusExtent *extents, int nb_extents)
+{
+    int64_t pnum, map;
+    BlockDriverState *file;
+    int ret;
+
+    ret = raw_co_block_status(bs, mode, offset, bytes, &pnum, &map, &file);
+    extents[0] = (BlockStatusExtent) {
+        .bytes  = pnum,
+        .ret    = ret,
+        .map    = map,
+        .file   = file,
+    };
+    return 1;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 raw_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
                      BdrvRequestFlags flags)
@@ -654,6 +677,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_zone_mgmt  = &raw_co_zone_mgmt,
     .bdrv_co_zone_append = &raw_co_zone_append,
     .bdrv_co_block_status = &raw_co_block_status,
+    .bdrv_co_block_status_batch = &raw_co_block_status_batch,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
     .bdrv_co_truncate     = &raw_co_truncate,
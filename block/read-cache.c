@@ -0,0 +1,958 @@
+/*
+ * read-cache filter driver
+ *
+ * The driver keeps a copy of recently read blocks of its file child in a
+ * local cache image, and serves further reads of these blocks from there.
+ * It is meant to be inserted above slow (e.g. networked) images, with the
+ * cache image on fast local storage.
+ *
+ * The cache image starts with a header and an index that maps each cache
+ * slot to the offset of the block it holds, followed by the slots
+ * themselves.  Slots are recycled in LRU order.  Writes, discards and
+ * truncation pass through to the file child and drop the affected blocks
+ * from the cache.
+ *
+ * The index is only written to the cache image when the node is closed or
+ * inactivated, and the header is marked as dirty while the node is in use.
+ * A cache image that was not closed cleanly is therefore discarded on the
+ * next open rather than trusted.  Nothing can detect changes to the file
+ * child made without this filter, so the file child must not be modified
+ * by other means between two uses of the same cache image.  For the same
+ * reason, the cache is discarded when the node is activated after an
+ * incoming migration.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "trace.h"
+
+#define READ_CACHE_MAGIC 0x5152434143484500ULL /* "QRCACHE\0" */
+#define READ_CACHE_VERSION 1
+
+/* The header was written by a clean close, and the index can be trusted */
+#define READ_CACHE_FLAG_CLEAN (1 << 0)
+
+/* The index starts right after the header area */
+#define READ_CACHE_INDEX_OFFSET (4 * KiB)
+
+#define READ_CACHE_DEFAULT_BLOCK_SIZE (64 * KiB)
+#define READ_CACHE_MIN_BLOCK_SIZE (4 * KiB)
+#define READ_CACHE_MAX_BLOCK_SIZE (16 * MiB)
+
+#define READ_CACHE_MAX_WORKERS 16
+
+/* All fields are big-endian */
+typedef struct QEMU_PACKED ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    /* Length of the file child when the index was written */
+    uint64_t source_size;
+    uint64_t index_offset;
+    uint64_t data_offset;
+} ReadCacheHeader;
+
+typedef struct QEMU_PACKED ReadCacheIndexEntry {
+    /* Offset in the file child of the block held in the slot */
+    uint64_t offset;
+    /* Position in LRU order, starting at 1; 0 if the slot is empty */
+    uint64_t lru;
+} ReadCacheIndexEntry;
+
+typedef struct ReadCacheSlot {
+    /* Offset in the file child; key of BDRVReadCacheState.map */
+    uint64_t offset;
+    /* In BDRVReadCacheState.map */
+    bool mapped;
+    /* Holds the data at @offset; mapped but not valid means being filled */
+    bool valid;
+    /* Requests reading from or filling the slot, which can't be recycled */
+    int in_use;
+    QTAILQ_ENTRY(ReadCacheSlot) lru_entry;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache;
+
+    uint32_t block_size;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+    int64_t source_size;
+
+    /* Cleared while the node is inactive; the cache is bypassed then */
+    bool active;
+
+    /* Protects everything below */
+    QemuMutex lock;
+    ReadCacheSlot *slots;
+    /* Maps file child offsets to mapped slots */
+    GHashTable *map;
+    /* Least recently used first; free slots are kept at the head */
+    QTAILQ_HEAD(, ReadCacheSlot) lru;
+} BDRVReadCacheState;
+
+#define READ_CACHE_OPT_BLOCK_SIZE "block-size"
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the cache, default 64K",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool read_cache_absorb_opts(uint32_t *block_size, QDict *options,
+                                   Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    uint64_t size;
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    size = qemu_opt_get_size(opts, READ_CACHE_OPT_BLOCK_SIZE,
+                             READ_CACHE_DEFAULT_BLOCK_SIZE);
+    qemu_opts_del(opts);
+
+    if (!is_power_of_2(size) || size < READ_CACHE_MIN_BLOCK_SIZE ||
+        size > READ_CACHE_MAX_BLOCK_SIZE) {
+        error_setg(errp, "block-size of read-cache filter must be a power "
+                   "of two between 4K and 16M");
+        return false;
+    }
+
+    *block_size = size;
+    return true;
+}
+
+static uint64_t read_cache_data_offset(uint64_t nb_slots, uint32_t block_size)
+{
+    return ROUND_UP(READ_CACHE_INDEX_OFFSET +
+                    nb_slots * sizeof(ReadCacheIndexEntry), block_size);
+}
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                       ReadCacheSlot *slot)
+{
+    return s->data_offset + (uint64_t)(slot - s->slots) * s->block_size;
+}
+
+/* Called with s->lock held */
+static void read_cache_map_slot(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                                uint64_t offset)
+{
+    assert(!slot->mapped && !slot->in_use);
+
+    slot->offset = offset;
+    slot->mapped = true;
+    slot->valid = false;
+    g_hash_table_insert(s->map, &slot->offset, slot);
+}
+
+/* Called with s->lock held */
+static void read_cache_unmap_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (!slot->mapped) {
+        return;
+    }
+
+    g_hash_table_remove(s->map, &slot->offset);
+    slot->mapped = false;
+    slot->valid = false;
+
+    /* Reuse it first */
+    QTAILQ_REMOVE(&s->lru, slot, lru_entry);
+    QTAILQ_INSERT_HEAD(&s->lru, slot, lru_entry);
+}
+
+/*
+ * Drop all blocks that overlap [@offset, @offset + @bytes) from the cache.
+ * Slots that are being filled are unmapped too, so that the data read for
+ * them is not marked valid.
+ */
+static void read_cache_invalidate(BDRVReadCacheState *s, int64_t offset,
+                                  int64_t bytes)
+{
+    uint64_t start = QEMU_ALIGN_DOWN(offset, s->block_size);
+    uint64_t end = QEMU_ALIGN_UP(offset + bytes, s->block_size);
+    uint64_t i;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if ((end - start) / s->block_size > s->nb_slots) {
+        for (i = 0; i < s->nb_slots; i++) {
+            ReadCacheSlot *slot = &s->slots[i];
+
+            if (slot->mapped && slot->offset >= start && slot->offset < end) {
+                read_cache_unmap_slot(s, slot);
+            }
+        }
+        return;
+    }
+
+    for (; start < end; start += s->block_size) {
+        ReadCacheSlot *slot = g_hash_table_lookup(s->map, &start);
+
+        if (slot) {
+            read_cache_unmap_slot(s, slot);
+        }
+    }
+}
+
+static void read_cache_reset(BDRVReadCacheState *s)
+{
+    uint64_t i;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    g_hash_table_remove_all(s->map);
+    QTAILQ_INIT(&s->lru);
+    for (i = 0; i < s->nb_slots; i++) {
+        assert(!s->slots[i].in_use);
+        s->slots[i].mapped = s->slots[i].valid = false;
+        QTAILQ_INSERT_TAIL(&s->lru, &s->slots[i], lru_entry);
+    }
+}
+
+static int GRAPH_RDLOCK read_cache_write_header(BlockDriverState *bs,
+                                                bool clean)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header = {
+        .magic = cpu_to_be64(READ_CACHE_MAGIC),
+        .version = cpu_to_be32(READ_CACHE_VERSION),
+        .flags = cpu_to_be32(clean ? READ_CACHE_FLAG_CLEAN : 0),
+        .block_size = cpu_to_be32(s->block_size),
+        .nb_slots = cpu_to_be64(s->nb_slots),
+        .source_size = cpu_to_be64(s->source_size),
+        .index_offset = cpu_to_be64(READ_CACHE_INDEX_OFFSET),
+        .data_offset = cpu_to_be64(s->data_offset),
+    };
+
+    return bdrv_pwrite_sync(s->cache, 0, sizeof(header), &header, 0);
+}
+
+static int compare_index_entries(const void *a, const void *b)
+{
+    const ReadCacheIndexEntry *ea = *(ReadCacheIndexEntry * const *)a;
+    const ReadCacheIndexEntry *eb = *(ReadCacheIndexEntry * const *)b;
+
+    return ea->lru < eb->lru ? -1 : ea->lru > eb->lru;
+}
+
+/*
+ * Load the index from the cache image if it was closed cleanly with the
+ * same geometry and file child length.  Otherwise, start with an empty
+ * cache.
+ */
+static int GRAPH_RDLOCK read_cache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    g_autofree ReadCacheIndexEntry *index = NULL;
+    g_autofree ReadCacheIndexEntry **used = NULL;
+    size_t index_size = s->nb_slots * sizeof(ReadCacheIndexEntry);
+    uint64_t i, nb_used = 0;
+    int ret;
+
+    ret = bdrv_pread(s->cache, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read read-cache header");
+        return ret;
+    }
+
+    if (be64_to_cpu(header.magic) != READ_CACHE_MAGIC ||
+        be32_to_cpu(header.version) != READ_CACHE_VERSION) {
+        trace_read_cache_discard(bs, "no valid header");
+        return 0;
+    }
+    if (!(be32_to_cpu(header.flags) & READ_CACHE_FLAG_CLEAN)) {
+        trace_read_cache_discard(bs, "not closed cleanly");
+        return 0;
+    }
+    if (be32_to_cpu(header.block_size) != s->block_size ||
+        be64_to_cpu(header.nb_slots) != s->nb_slots ||
+        be64_to_cpu(header.index_offset) != READ_CACHE_INDEX_OFFSET ||
+        be64_to_cpu(header.data_offset) != s->data_offset) {
+        trace_read_cache_discard(bs, "geometry changed");
+        return 0;
+    }
+    if (be64_to_cpu(header.source_size) != s->source_size) {
+        trace_read_cache_discard(bs, "file length changed");
+        return 0;
+    }
+
+    index = g_try_malloc(index_size);
+    used = g_try_new(ReadCacheIndexEntry *, s->nb_slots);
+    if (!index || !used) {
+        error_setg(errp, "Could not allocate read-cache index");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, READ_CACHE_INDEX_OFFSET, index_size, index, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read read-cache index");
+        return ret;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        index[i].offset = be64_to_cpu(index[i].offset);
+        index[i].lru = be64_to_cpu(index[i].lru);
+
+        if (!index[i].lru ||
+            !QEMU_IS_ALIGNED(index[i].offset, s->block_size) ||
+            index[i].offset + s->block_size > s->source_size ||
+            g_hash_table_contains(s->map, &index[i].offset)) {
+            continue;
+        }
+
+        read_cache_map_slot(s, &s->slots[i], index[i].offset);
+        s->slots[i].valid = true;
+        used[nb_used++] = &index[i];
+    }
+
+    /* Move used slots to the tail, least recently used first */
+    qsort(used, nb_used, sizeof(used[0]), compare_index_entries);
+    for (i = 0; i < nb_used; i++) {
+        ReadCacheSlot *slot = &s->slots[used[i] - index];
+
+        QTAILQ_REMOVE(&s->lru, slot, lru_entry);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, lru_entry);
+    }
+
+    trace_read_cache_load(bs, nb_used);
+    return 0;
+}
+
+static int GRAPH_RDLOCK read_cache_save(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree ReadCacheIndexEntry *index = NULL;
+    size_t index_size = s->nb_slots * sizeof(ReadCacheIndexEntry);
+    ReadCacheSlot *slot;
+    uint64_t lru = 0;
+    int ret;
+
+    index = g_try_malloc0(index_size);
+    if (!index) {
+        return -ENOMEM;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        QTAILQ_FOREACH(slot, &s->lru, lru_entry) {
+            if (slot->valid) {
+                index[slot - s->slots] = (ReadCacheIndexEntry) {
+                    .offset = cpu_to_be64(slot->offset),
+                    .lru = cpu_to_be64(++lru),
+                };
+            }
+        }
+    }
+
+    ret = bdrv_pwrite(s->cache, READ_CACHE_INDEX_OFFSET, index_size, index, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The cached data and the index must be stable before the header */
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return read_cache_write_header(bs, true);
+}
+
+/*
+ * Load the cache, and mark it as in use in the cache image before
+ * changing anything in it.
+ */
+static int GRAPH_RDLOCK read_cache_activate(BlockDriverState *bs,
+                                            bool load, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_reset(s);
+    if (load) {
+        ret = read_cache_load(bs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = read_cache_write_header(bs, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write read-cache header");
+        read_cache_reset(s);
+        return ret;
+    }
+
+    s->active = true;
+    return 0;
+}
+
+static void read_cache_free(BDRVReadCacheState *s)
+{
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    qemu_mutex_destroy(&s->lock);
+}
+
+/* Lay out the cache image, and set up the cache */
+static int GRAPH_RDLOCK
+read_cache_init(BlockDriverState *bs, int flags, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t cache_size;
+
+    s->source_size = bdrv_getlength(bs->file->bs);
+    if (s->source_size < 0) {
+        error_setg_errno(errp, -s->source_size, "Could not get file length");
+        return s->source_size;
+    }
+
+    cache_size = bdrv_getlength(s->cache->bs);
+    if (cache_size < 0) {
+        error_setg_errno(errp, -cache_size,
+                         "Could not get cache image length");
+        return cache_size;
+    }
+
+    if (cache_size > READ_CACHE_INDEX_OFFSET) {
+        s->nb_slots = (cache_size - READ_CACHE_INDEX_OFFSET) /
+                      (s->block_size + sizeof(ReadCacheIndexEntry));
+    }
+    while (s->nb_slots &&
+           read_cache_data_offset(s->nb_slots, s->block_size) +
+           s->nb_slots * s->block_size > cache_size) {
+        s->nb_slots--;
+    }
+    if (!s->nb_slots) {
+        error_setg(errp, "Cache image is too small for block-size %" PRIu32,
+                   s->block_size);
+        return -EINVAL;
+    }
+    s->data_offset = read_cache_data_offset(s->nb_slots, s->block_size);
+
+    s->slots = g_try_new0(ReadCacheSlot, s->nb_slots);
+    if (!s->slots) {
+        error_setg(errp, "Could not allocate read-cache slots");
+        return -ENOMEM;
+    }
+    read_cache_reset(s);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    if (flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+    return read_cache_activate(bs, true, errp);
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    qemu_mutex_init(&s->lock);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+
+    if (!read_cache_absorb_opts(&s->block_size, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /*
+     * The cache image is written even if the filter is read-only, which is
+     * the typical case for the base image of a chain.  Don't let an inline
+     * definition inherit read-only from us.
+     */
+    if (!qdict_haskey(options, "cache-image")) {
+        qdict_set_default_str(options, "cache-image." BDRV_OPT_READ_ONLY,
+                              "off");
+    }
+    s->cache = bdrv_open_child(NULL, options, "cache-image", bs, &child_of_bds,
+                               BDRV_CHILD_DATA, false, errp);
+    if (!s->cache) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bdrv_graph_rdlock_main_loop();
+    ret = read_cache_init(bs, flags, errp);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    read_cache_free(s);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (s->active) {
+        ret = read_cache_save(bs);
+        if (ret < 0) {
+            warn_report("Failed to save read-cache index of node '%s': %s",
+                        bdrv_get_device_or_node_name(bs), strerror(-ret));
+        }
+    }
+
+    read_cache_free(s);
+}
+
+static int GRAPH_RDLOCK read_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = read_cache_save(bs);
+    if (ret < 0) {
+        error_report("Failed to save read-cache index of node '%s': %s",
+                     bdrv_get_device_or_node_name(bs), strerror(-ret));
+        return ret;
+    }
+
+    s->active = false;
+    return 0;
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+read_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    s->source_size = bdrv_co_getlength(bs->file->bs);
+    if (s->source_size < 0) {
+        error_setg_errno(errp, -s->source_size, "Could not get file length");
+        return;
+    }
+
+    /* The file child may have been modified while we were inactive */
+    read_cache_activate(bs, false, errp);
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    BDRVReadCacheState *s = reopen_state->bs->opaque;
+    uint32_t block_size;
+
+    if (!read_cache_absorb_opts(&block_size, reopen_state->options, errp)) {
+        return -EINVAL;
+    }
+
+    if (block_size != s->block_size) {
+        error_setg(errp, "Cannot change block-size of read-cache filter");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+typedef struct ReadCacheTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    int64_t offset;
+    int64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    BdrvRequestFlags flags;
+} ReadCacheTask;
+
+/*
+ * Fill @slot with the block at @block_offset, copying the requested part of
+ * it to @qiov.  Only errors reading from the file child are returned;
+ * failing to write to the cache image just leaves the slot empty.
+ *
+ * The block is always read into a bounce buffer, like copy-on-read does:
+ * the guest could modify its own buffer before it is written to the cache.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_fill(BlockDriverState *bs, ReadCacheSlot *slot,
+                   int64_t block_offset, int64_t offset, int64_t bytes,
+                   QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QEMUIOVector local_qiov;
+    void *bounce;
+    int ret, cache_ret = 0;
+
+    bounce = qemu_try_blockalign(s->cache->bs, s->block_size);
+    if (!bounce) {
+        cache_ret = -ENOMEM;
+        ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov,
+                                  qiov_offset, 0);
+        goto out;
+    }
+    qemu_iovec_init_buf(&local_qiov, bounce, s->block_size);
+
+    ret = bdrv_co_preadv(bs->file, block_offset, s->block_size,
+                         &local_qiov, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, bounce + offset - block_offset,
+                        bytes);
+
+    cache_ret = bdrv_co_pwritev(s->cache, read_cache_slot_offset(s, slot),
+                                s->block_size, &local_qiov, 0);
+    if (cache_ret < 0) {
+        trace_read_cache_fill_fail(bs, block_offset, cache_ret);
+    }
+
+out:
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        slot->in_use--;
+        /* The slot was unmapped meanwhile if the block was written to */
+        if (slot->mapped) {
+            if (ret < 0 || cache_ret < 0) {
+                read_cache_unmap_slot(s, slot);
+            } else {
+                slot->valid = true;
+            }
+        }
+    }
+
+    qemu_vfree(bounce);
+    return ret;
+}
+
+/* Read a part of a single block, through the cache if possible */
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_read_block(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset,
+                         BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t block_offset = QEMU_ALIGN_DOWN(offset, s->block_size);
+    ReadCacheSlot *slot;
+    int ret;
+
+    /* A partial block at the end of the file child is never cached */
+    if (!s->active || block_offset + s->block_size > s->source_size) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    qemu_mutex_lock(&s->lock);
+    slot = g_hash_table_lookup(s->map, &block_offset);
+    if (slot && slot->valid) {
+        slot->in_use++;
+        QTAILQ_REMOVE(&s->lru, slot, lru_entry);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, lru_entry);
+        qemu_mutex_unlock(&s->lock);
+
+        trace_read_cache_hit(bs, block_offset);
+        ret = bdrv_co_preadv_part(s->cache, read_cache_slot_offset(s, slot) +
+                                  offset - block_offset, bytes,
+                                  qiov, qiov_offset, 0);
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            slot->in_use--;
+            if (ret < 0) {
+                read_cache_unmap_slot(s, slot);
+            }
+        }
+        if (ret == 0) {
+            return 0;
+        }
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    if (!slot) {
+        /* Take the least recently used slot that isn't busy */
+        QTAILQ_FOREACH(slot, &s->lru, lru_entry) {
+            if (!slot->in_use) {
+                break;
+            }
+        }
+    } else {
+        /* Being filled by another request */
+        slot = NULL;
+    }
+    if (!slot) {
+        qemu_mutex_unlock(&s->lock);
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    trace_read_cache_miss(bs, block_offset);
+    read_cache_unmap_slot(s, slot);
+    read_cache_map_slot(s, slot, block_offset);
+    slot->in_use++;
+    QTAILQ_REMOVE(&s->lru, slot, lru_entry);
+    QTAILQ_INSERT_TAIL(&s->lru, slot, lru_entry);
+    qemu_mutex_unlock(&s->lock);
+
+    return read_cache_co_fill(bs, slot, block_offset, offset, bytes,
+                              qiov, qiov_offset);
+}
+
+/*
+ * This function can count as GRAPH_RDLOCK because read_cache_co_preadv_part()
+ * holds the graph lock and keeps it until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK read_cache_co_task_entry(AioTask *task)
+{
+    ReadCacheTask *t = container_of(task, ReadCacheTask, task);
+
+    return read_cache_co_read_block(t->bs, t->offset, t->bytes, t->qiov,
+                                    t->qiov_offset, t->flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov, size_t qiov_offset,
+                          BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    AioTaskPool *aio = NULL;
+    int ret = 0;
+
+    if (!s->active) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    while (bytes && aio_task_pool_status(aio) == 0) {
+        int64_t cur_bytes = MIN(bytes, QEMU_ALIGN_DOWN(offset, s->block_size) +
+                                       s->block_size - offset);
+
+        if (!aio && cur_bytes != bytes) {
+            aio = aio_task_pool_new(READ_CACHE_MAX_WORKERS);
+        }
+
+        if (aio) {
+            ReadCacheTask *t = g_new(ReadCacheTask, 1);
+
+            *t = (ReadCacheTask) {
+                .task.func = read_cache_co_task_entry,
+                .bs = bs,
+                .offset = offset,
+                .bytes = cur_bytes,
+                .qiov = qiov,
+                .qiov_offset = qiov_offset,
+                .flags = flags,
+            };
+            aio_task_pool_start_task(aio, &t->task);
+        } else {
+            ret = read_cache_co_read_block(bs, offset, cur_bytes, qiov,
+                                           qiov_offset, flags);
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        bytes -= cur_bytes;
+        offset += cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        ret = aio_task_pool_status(aio);
+        g_free(aio);
+    }
+
+    return ret;
+}
+
+/*
+ * Blocks are dropped from the cache only once the request has completed, so
+ * that a concurrent read can't fill them with the old data afterwards.  A
+ * read that started earlier has mapped its slot already, and the slot is
+ * then unmapped here.
+ */
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, QEMUIOVector *qiov,
+                           size_t qiov_offset, BdrvRequestFlags flags)
+{
+    int ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+
+    read_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    int ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+
+    read_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+
+    read_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                       PreallocMode prealloc, BdrvRequestFlags flags,
+                       Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t old_size = s->source_size;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+
+    s->source_size = bdrv_co_getlength(bs->file->bs);
+    if (s->source_size < 0) {
+        /* Nothing can be cached until the length is known again */
+        s->source_size = 0;
+    }
+    if (s->source_size < old_size) {
+        read_cache_invalidate(s, s->source_size, old_size - s->source_size);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK read_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+read_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void GRAPH_RDLOCK read_cache_refresh_filename(BlockDriverState *bs)
+{
+    pstrcpy(bs->exact_filename, sizeof(bs->exact_filename),
+            bs->file->bs->filename);
+}
+
+static void GRAPH_RDLOCK
+read_cache_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
+                      BlockReopenQueue *reopen_queue,
+                      uint64_t perm, uint64_t shared,
+                      uint64_t *nperm, uint64_t *nshared)
+{
+    if (!(role & BDRV_CHILD_FILTERED)) {
+        /* Cache image; nobody else may write to it while we use it */
+        if (bs->open_flags & BDRV_O_INACTIVE) {
+            *nperm = 0;
+            *nshared = BLK_PERM_ALL;
+        } else {
+            *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE;
+            *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+        }
+        return;
+    }
+
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        /* Writes that bypass the filter would leave stale data in the cache */
+        *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+    }
+}
+
+static BlockDriver bdrv_read_cache_filter = {
+    .format_name = "read-cache",
+    .instance_size = sizeof(BDRVReadCacheState),
+
+    .bdrv_co_getlength    = read_cache_co_getlength,
+    .bdrv_open            = read_cache_open,
+    .bdrv_close           = read_cache_close,
+
+    .bdrv_reopen_prepare  = read_cache_reopen_prepare,
+
+    .bdrv_co_preadv_part = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = read_cache_co_pdiscard,
+    .bdrv_co_flush = read_cache_co_flush,
+    .bdrv_co_truncate = read_cache_co_truncate,
+
+    .bdrv_inactivate = read_cache_inactivate,
+    .bdrv_co_invalidate_cache = read_cache_co_invalidate_cache,
+
+    .bdrv_refresh_filename = read_cache_refresh_filename,
+
+    .bdrv_child_perm = read_cache_child_perm,
+
+    .is_filter = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache_filter);
+}
+
+block_init(bdrv_read_cache_init);
@@ -41,6 +41,11 @@ typedef struct StreamBlockJob {
     char *backing_file_str;
     bool backing_mask_protocol;
     bool bs_read_only;
+
+    /* Allocation status of the chain, queried in batches */
+    BlockStatusExtent extents[BDRV_BLOCK_STATUS_BATCH];
+    int nb_extents;
+    int ext_idx;
 } StreamBlockJob;
 
 static int coroutine_fn stream_populate(BlockBackend *blk,
@@ -149,11 +154,62 @@ static void stream_clean(Job *job)
     g_free(s->backing_file_str);
 }
 
+/*
+ * Return 1 if [offset, offset + *n) is allocated in the intermediate images
+ * and must be copied, 0 if it must not, or negative errno on failure.
+ * @backing_len is the length of the backing file of @unfiltered_bs.
+ *
+ * The allocation status is looked up in a batch of extents that covers
+ * more than one iteration.  Extents that were allocated in the top image
+ * stay so, and copying a range that the guest has written to in the
+ * meantime is harmless, so the batch does not need to be refreshed.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+stream_is_allocated(StreamBlockJob *s, BlockDriverState *unfiltered_bs,
+                    int64_t backing_len, int64_t offset, int64_t len,
+                    int64_t *n)
+{
+    BlockStatusExtent *e;
+    int ret;
+
+    while (s->ext_idx < s->nb_extents &&
+           offset >= s->extents[s->ext_idx].offset +
+                     s->extents[s->ext_idx].bytes) {
+        s->ext_idx++;
+    }
+    if (s->ext_idx == s->nb_extents) {
+        ret = bdrv_co_is_allocated_above_batch(unfiltered_bs, s->base_overlay,
+                                               true, offset, len - offset,
+                                               s->extents,
+                                               BDRV_BLOCK_STATUS_BATCH);
+        s->nb_extents = s->ext_idx = 0;
+        if (ret < 0) {
+            return ret;
+        }
+        assert(ret > 0);
+        s->nb_extents = ret;
+    }
+
+    e = &s->extents[s->ext_idx];
+    assert(offset >= e->offset);
+    *n = MIN(e->offset + e->bytes - offset, STREAM_CHUNK);
+
+    if (e->depth > 1 && offset >= backing_len) {
+        /* Finish early if end of backing file has been reached */
+        *n = len - offset;
+        return 0;
+    }
+
+    /* Copy if allocated in the intermediate images */
+    return e->depth > 1;
+}
+
 static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
     BlockDriverState *unfiltered_bs = NULL;
     int64_t len = -1;
+    int64_t backing_len = -1;
     int64_t offset = 0;
     int error = 0;
     int64_t n = 0; /* bytes */
@@ -169,6 +225,11 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
         if (len < 0) {
             return len;
         }
+
+        backing_len = bdrv_co_getlength(bdrv_cow_bs(unfiltered_bs));
+        if (backing_len < 0) {
+            return backing_len;
+        }
     }
     job_progress_set_remaining(&s->common.job, len);
 
@@ -187,24 +248,9 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
         copy = false;
 
         WITH_GRAPH_RDLOCK_GUARD() {
-            ret = bdrv_co_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
-            if (ret == 1) {
-                /* Allocated in the top, no need to copy.  */
-            } else if (ret >= 0) {
-                /*
-                 * Copy if allocated in the intermediate images.  Limit to the
-                 * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).
-                 */
-                ret = bdrv_co_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
-                                                 s->base_overlay, true,
-                                                 offset, n, &n);
-                /* Finish early if end of backing file has been reached */
-                if (ret == 0 && n == 0) {
-                    n = len - offset;
-                }
-
-                copy = (ret > 0);
-            }
+            ret = stream_is_allocated(s, unfiltered_bs, backing_len, offset,
+                                      len, &n);
+            copy = (ret > 0);
         }
         trace_stream_one_iteration(s, offset, n, ret);
         if (copy) {
@@ -0,0 +1,1112 @@
+/*
+ * write-back filter driver
+ *
+ * The driver completes guest writes as soon as their data is copied to a
+ * bounded memory buffer, and writes the buffered data to its file child in
+ * the background.  It is meant for high-latency file children (e.g. network
+ * storage), where every small write would otherwise cost a round trip.
+ *
+ * Data is buffered in chunks, with a dirty bit per sector.  Writes to the
+ * same chunk are merged in place, and dirty sectors that are contiguous,
+ * even across chunks, are written back as one request of up to
+ * batch-size bytes, with up to max-workers requests in flight.  While a
+ * request is in flight, its sectors are not written back again, so that
+ * requests for overlapping data never race; a guest write to them copies
+ * the chunk first if needed.
+ *
+ * Like a volatile disk write cache, the buffer is only guaranteed to reach
+ * the file child on flush: flushing writes back all data written before the
+ * flush started, then flushes the file child.  FUA is not advertised, so
+ * that the generic block layer turns FUA writes into a write and a flush.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/reqlist.h"
+#include "trace.h"
+
+#define WRITE_BACK_CHUNK_SIZE (64 * KiB)
+#define WRITE_BACK_CHUNK_SECTORS (WRITE_BACK_CHUNK_SIZE / BDRV_SECTOR_SIZE)
+
+typedef struct WriteBackOpts {
+    uint64_t max_size;
+    uint64_t batch_size;
+    int max_workers;
+} WriteBackOpts;
+
+/* Chunk data; shared with the requests writing it back */
+typedef struct WriteBackBuffer {
+    int refcnt;
+    uint8_t *data;
+} WriteBackBuffer;
+
+typedef struct WriteBackChunk {
+    /* Offset in the file child divided by the chunk size */
+    uint64_t index;
+    WriteBackBuffer *buf;
+
+    /* Sectors that are not written back yet */
+    DECLARE_BITMAP(dirty, WRITE_BACK_CHUNK_SECTORS);
+    /* Sectors that are being written back */
+    DECLARE_BITMAP(inflight, WRITE_BACK_CHUNK_SECTORS);
+    /* BDRVWriteBackState.write_seq of the last write to each sector */
+    uint64_t seq[WRITE_BACK_CHUNK_SECTORS];
+    /* Smallest seq of the dirty sectors */
+    uint64_t dirty_seq;
+
+    /* In BDRVWriteBackState.dirty_chunks if any sector is dirty */
+    QTAILQ_ENTRY(WriteBackChunk) dirty_entry;
+} WriteBackChunk;
+
+typedef struct WriteBackPart {
+    WriteBackChunk *chunk;
+    WriteBackBuffer *buf;
+    int start;
+    int end;
+} WriteBackPart;
+
+typedef struct WriteBackTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    /* In BDRVWriteBackState.destage_reqs */
+    BlockReq req;
+    /* Smallest seq of the sectors written */
+    uint64_t seq;
+    QEMUIOVector qiov;
+    WriteBackPart *parts;
+    int nb_parts;
+    QLIST_ENTRY(WriteBackTask) next;
+} WriteBackTask;
+
+typedef struct BDRVWriteBackState {
+    WriteBackOpts opts;
+
+    CoMutex lock;
+    /* Maps chunk indexes to chunks with dirty or in-flight sectors */
+    GHashTable *chunks;
+    /* Roughly oldest first */
+    QTAILQ_HEAD(, WriteBackChunk) dirty_chunks;
+    QLIST_HEAD(, WriteBackTask) tasks;
+    /* Requests writing back buffered data */
+    BlockReqList destage_reqs;
+    /* Write zeroes and discard requests, which bypass the buffer */
+    BlockReqList passthrough_reqs;
+    /* Incremented for each guest write */
+    uint64_t write_seq;
+    /* Bytes allocated for buffers, including those of in-flight requests */
+    uint64_t mem_used;
+    bool destage_running;
+    /*
+     * Error of a failed write back.  Writing back is paused until the next
+     * flush, which reports the error if retrying fails again.
+     */
+    int destage_error;
+    /* Woken up whenever a write back request completes */
+    CoQueue progress;
+} BDRVWriteBackState;
+
+#define WRITE_BACK_OPT_MAX_SIZE "max-size"
+#define WRITE_BACK_OPT_BATCH_SIZE "batch-size"
+#define WRITE_BACK_OPT_MAX_WORKERS "max-workers"
+static QemuOptsList runtime_opts = {
+    .name = "write-back",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = WRITE_BACK_OPT_MAX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "memory used to buffer writes, default 64M",
+        },
+        {
+            .name = WRITE_BACK_OPT_BATCH_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum size of write back requests, default 1M",
+        },
+        {
+            .name = WRITE_BACK_OPT_MAX_WORKERS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum number of write back requests in flight, "
+                "default 8",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool write_back_absorb_opts(WriteBackOpts *dest, QDict *options,
+                                   Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    dest->max_size =
+        qemu_opt_get_size(opts, WRITE_BACK_OPT_MAX_SIZE, 64 * MiB);
+    dest->batch_size =
+        qemu_opt_get_size(opts, WRITE_BACK_OPT_BATCH_SIZE, 1 * MiB);
+    dest->max_workers =
+        qemu_opt_get_number(opts, WRITE_BACK_OPT_MAX_WORKERS, 8);
+
+    qemu_opts_del(opts);
+
+    if (dest->max_size < WRITE_BACK_CHUNK_SIZE) {
+        error_setg(errp, "max-size of write-back filter must be at least "
+                   "64K");
+        return false;
+    }
+
+    if (dest->batch_size < WRITE_BACK_CHUNK_SIZE ||
+        dest->batch_size > 64 * MiB ||
+        !QEMU_IS_ALIGNED(dest->batch_size, BDRV_SECTOR_SIZE)) {
+        error_setg(errp, "batch-size of write-back filter must be a multiple "
+                   "of 512 between 64K and 64M");
+        return false;
+    }
+
+    if (dest->max_workers < 1 || dest->max_workers > 256) {
+        error_setg(errp, "max-workers of write-back filter must be between "
+                   "1 and 256");
+        return false;
+    }
+
+    return true;
+}
+
+/* Called with s->lock held */
+static WriteBackBuffer * GRAPH_RDLOCK
+write_back_buffer_new(BlockDriverState *bs)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    WriteBackBuffer *buf;
+    uint8_t *data;
+
+    data = qemu_try_blockalign(bs->file->bs, WRITE_BACK_CHUNK_SIZE);
+    if (!data) {
+        return NULL;
+    }
+
+    buf = g_new(WriteBackBuffer, 1);
+    *buf = (WriteBackBuffer) {
+        .refcnt = 1,
+        .data = data,
+    };
+    s->mem_used += WRITE_BACK_CHUNK_SIZE;
+    return buf;
+}
+
+/* Called with s->lock held */
+static void write_back_buffer_unref(BDRVWriteBackState *s,
+                                    WriteBackBuffer *buf)
+{
+    if (--buf->refcnt) {
+        return;
+    }
+
+    qemu_vfree(buf->data);
+    g_free(buf);
+    s->mem_used -= WRITE_BACK_CHUNK_SIZE;
+}
+
+static int64_t write_back_chunk_offset(WriteBackChunk *c, int sector)
+{
+    return c->index * WRITE_BACK_CHUNK_SIZE + sector * BDRV_SECTOR_SIZE;
+}
+
+/*
+ * Update the dirty list and dirty_seq of @c after sectors stopped being
+ * dirty, and free it if nothing is left.  Called with s->lock held.
+ */
+static void write_back_chunk_update(BDRVWriteBackState *s, WriteBackChunk *c)
+{
+    int i;
+
+    if (bitmap_empty(c->dirty, WRITE_BACK_CHUNK_SECTORS)) {
+        if (QTAILQ_IN_USE(c, dirty_entry)) {
+            QTAILQ_REMOVE(&s->dirty_chunks, c, dirty_entry);
+        }
+        if (bitmap_empty(c->inflight, WRITE_BACK_CHUNK_SECTORS)) {
+            g_hash_table_remove(s->chunks, &c->index);
+            write_back_buffer_unref(s, c->buf);
+            g_free(c);
+        }
+        return;
+    }
+
+    c->dirty_seq = UINT64_MAX;
+    for (i = find_first_bit(c->dirty, WRITE_BACK_CHUNK_SECTORS);
+         i < WRITE_BACK_CHUNK_SECTORS;
+         i = find_next_bit(c->dirty, WRITE_BACK_CHUNK_SECTORS, i + 1))
+    {
+        c->dirty_seq = MIN(c->dirty_seq, c->seq[i]);
+    }
+}
+
+/* First sector at or after @start that is dirty and not in flight */
+static int write_back_next_candidate(WriteBackChunk *c, int start)
+{
+    int i;
+
+    for (i = find_next_bit(c->dirty, WRITE_BACK_CHUNK_SECTORS, start);
+         i < WRITE_BACK_CHUNK_SECTORS;
+         i = find_next_bit(c->dirty, WRITE_BACK_CHUNK_SECTORS, i + 1))
+    {
+        if (!test_bit(i, c->inflight)) {
+            return i;
+        }
+    }
+    return WRITE_BACK_CHUNK_SECTORS;
+}
+
+/* End of the run of candidate sectors starting at @start */
+static int write_back_run_end(WriteBackChunk *c, int start)
+{
+    return MIN(find_next_zero_bit(c->dirty, WRITE_BACK_CHUNK_SECTORS, start),
+               find_next_bit(c->inflight, WRITE_BACK_CHUNK_SECTORS, start));
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_back_destage_task_entry(AioTask *task);
+
+/*
+ * Build a request writing back the run of dirty sectors starting at sector
+ * @start of @c, continuing into the following chunks up to batch-size.
+ * Returns NULL if the run conflicts with a request bypassing the buffer.
+ * Called with s->lock held.
+ */
+static WriteBackTask *write_back_task_new(BlockDriverState *bs,
+                                          WriteBackChunk *c, int start)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    uint64_t max_sectors = s->opts.batch_size / BDRV_SECTOR_SIZE;
+    uint64_t sectors = 0;
+    WriteBackChunk *cur = c;
+    WriteBackTask *t;
+    int nb_alloc = DIV_ROUND_UP(max_sectors, WRITE_BACK_CHUNK_SECTORS) + 1;
+    int pos = start;
+
+    /* Find the length of the run first */
+    for (;;) {
+        int end = write_back_run_end(cur, pos);
+        uint64_t next_index = cur->index + 1;
+
+        sectors += end - pos;
+        if (end < WRITE_BACK_CHUNK_SECTORS || sectors >= max_sectors) {
+            break;
+        }
+        cur = g_hash_table_lookup(s->chunks, &next_index);
+        if (!cur || write_back_next_candidate(cur, 0) != 0) {
+            break;
+        }
+        pos = 0;
+    }
+    sectors = MIN(sectors, max_sectors);
+
+    if (reqlist_find_conflict(&s->passthrough_reqs,
+                              write_back_chunk_offset(c, start),
+                              sectors * BDRV_SECTOR_SIZE)) {
+        return NULL;
+    }
+
+    t = g_new(WriteBackTask, 1);
+    *t = (WriteBackTask) {
+        .task.func = write_back_destage_task_entry,
+        .bs = bs,
+        .seq = UINT64_MAX,
+        .parts = g_new(WriteBackPart, nb_alloc),
+    };
+    qemu_iovec_init(&t->qiov, nb_alloc);
+    reqlist_init_req(&s->destage_reqs, &t->req,
+                     write_back_chunk_offset(c, start),
+                     sectors * BDRV_SECTOR_SIZE);
+
+    /* Then take the sectors */
+    cur = c;
+    pos = start;
+    while (sectors) {
+        int end = MIN(write_back_run_end(cur, pos), pos + sectors);
+        uint64_t next_index = cur->index + 1;
+        int i;
+
+        t->parts[t->nb_parts++] = (WriteBackPart) {
+            .chunk = cur,
+            .buf = cur->buf,
+            .start = pos,
+            .end = end,
+        };
+        cur->buf->refcnt++;
+        qemu_iovec_add(&t->qiov, cur->buf->data + pos * BDRV_SECTOR_SIZE,
+                       (end - pos) * BDRV_SECTOR_SIZE);
+
+        for (i = pos; i < end; i++) {
+            t->seq = MIN(t->seq, cur->seq[i]);
+        }
+        bitmap_clear(cur->dirty, pos, end - pos);
+        bitmap_set(cur->inflight, pos, end - pos);
+        write_back_chunk_update(s, cur);
+
+        sectors -= end - pos;
+        if (sectors) {
+            cur = g_hash_table_lookup(s->chunks, &next_index);
+            pos = 0;
+        }
+    }
+
+    QLIST_INSERT_HEAD(&s->tasks, t, next);
+    return t;
+}
+
+/* Pick the next run to write back, oldest chunks first */
+static WriteBackTask *write_back_pick_task(BlockDriverState *bs)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    WriteBackChunk *c;
+
+    if (s->destage_error) {
+        return NULL;
+    }
+
+    QTAILQ_FOREACH(c, &s->dirty_chunks, dirty_entry) {
+        int i = write_back_next_candidate(c, 0);
+
+        while (i < WRITE_BACK_CHUNK_SECTORS) {
+            WriteBackTask *t = write_back_task_new(bs, c, i);
+
+            if (t) {
+                return t;
+            }
+            i = write_back_next_candidate(c, write_back_run_end(c, i));
+        }
+    }
+
+    return NULL;
+}
+
+/* Called with s->lock held */
+static void coroutine_fn write_back_task_done(WriteBackTask *t, int ret)
+{
+    BDRVWriteBackState *s = t->bs->opaque;
+    int i, j;
+
+    for (i = 0; i < t->nb_parts; i++) {
+        WriteBackPart *p = &t->parts[i];
+        WriteBackChunk *c = p->chunk;
+
+        bitmap_clear(c->inflight, p->start, p->end - p->start);
+        if (ret < 0) {
+            /*
+             * The chunk buffer still has the data of the sectors that were
+             * not written again meanwhile, mark them dirty again.
+             */
+            for (j = p->start; j < p->end; j++) {
+                set_bit(j, c->dirty);
+            }
+            if (!QTAILQ_IN_USE(c, dirty_entry)) {
+                QTAILQ_INSERT_HEAD(&s->dirty_chunks, c, dirty_entry);
+            }
+        }
+        write_back_chunk_update(s, c);
+        write_back_buffer_unref(s, p->buf);
+    }
+
+    if (ret < 0 && !s->destage_error) {
+        s->destage_error = ret;
+    }
+
+    reqlist_remove_req(&t->req);
+    QLIST_REMOVE(t, next);
+    qemu_iovec_destroy(&t->qiov);
+    g_free(t->parts);
+
+    qemu_co_queue_restart_all(&s->progress);
+}
+
+/*
+ * This function can count as GRAPH_RDLOCK because write_back_destage_entry()
+ * holds the graph lock and keeps it until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+write_back_destage_task_entry(AioTask *task)
+{
+    WriteBackTask *t = container_of(task, WriteBackTask, task);
+    BlockDriverState *bs = t->bs;
+    BDRVWriteBackState *s = bs->opaque;
+    int ret;
+
+    trace_write_back_destage(bs, t->req.offset, t->req.bytes);
+    ret = bdrv_co_pwritev(bs->file, t->req.offset, t->req.bytes, &t->qiov, 0);
+    if (ret < 0) {
+        trace_write_back_destage_fail(bs, t->req.offset, ret);
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        write_back_task_done(t, ret);
+    }
+
+    return ret;
+}
+
+static void coroutine_fn write_back_destage_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVWriteBackState *s = bs->opaque;
+    AioTaskPool *pool = aio_task_pool_new(s->opts.max_workers);
+    WriteBackTask *t;
+
+    bdrv_graph_co_rdlock();
+    qemu_co_mutex_lock(&s->lock);
+
+    for (;;) {
+        t = write_back_pick_task(bs);
+        if (t) {
+            qemu_co_mutex_unlock(&s->lock);
+            aio_task_pool_start_task(pool, &t->task);
+        } else if (aio_task_pool_busy_tasks(pool)) {
+            qemu_co_mutex_unlock(&s->lock);
+            aio_task_pool_wait_one(pool);
+        } else {
+            break;
+        }
+        qemu_co_mutex_lock(&s->lock);
+    }
+
+    s->destage_running = false;
+    qemu_co_mutex_unlock(&s->lock);
+    bdrv_graph_co_rdunlock();
+
+    aio_task_pool_free(pool);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start writing back in the background if needed.  The in-flight counter
+ * makes draining wait until all data has been written back.  Called with
+ * s->lock held.
+ */
+static void write_back_kick(BlockDriverState *bs)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->destage_running || s->destage_error ||
+        QTAILQ_EMPTY(&s->dirty_chunks)) {
+        return;
+    }
+
+    s->destage_running = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(write_back_destage_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+/* Whether data written up to @seq is still buffered; s->lock held */
+static bool write_back_pending(BDRVWriteBackState *s, uint64_t seq)
+{
+    WriteBackChunk *c;
+    WriteBackTask *t;
+
+    QTAILQ_FOREACH(c, &s->dirty_chunks, dirty_entry) {
+        if (c->dirty_seq <= seq) {
+            return true;
+        }
+    }
+    QLIST_FOREACH(t, &s->tasks, next) {
+        if (t->seq <= seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Write back all data written so far */
+static int coroutine_fn GRAPH_RDLOCK write_back_co_destage(BlockDriverState *bs)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    uint64_t seq;
+    int ret = 0;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    seq = s->write_seq;
+    /* Retry after errors */
+    s->destage_error = 0;
+    write_back_kick(bs);
+
+    while (write_back_pending(s, seq)) {
+        if (s->destage_error) {
+            ret = s->destage_error;
+            break;
+        }
+        qemu_co_queue_wait(&s->progress, &s->lock);
+    }
+
+    return ret;
+}
+
+static int write_back_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    if (!write_back_absorb_opts(&s->opts, options, errp)) {
+        return -EINVAL;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    qemu_co_mutex_init(&s->lock);
+    s->chunks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->dirty_chunks);
+    QLIST_INIT(&s->tasks);
+    QLIST_INIT(&s->destage_reqs);
+    QLIST_INIT(&s->passthrough_reqs);
+    qemu_co_queue_init(&s->progress);
+
+    /* FUA is emulated with a flush by the generic block layer */
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED;
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void write_back_close(BlockDriverState *bs)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    GHashTableIter iter;
+    WriteBackChunk *c;
+    uint64_t lost = 0;
+
+    GLOBAL_STATE_CODE();
+
+    /* Everything was flushed and drained already, unless writing failed */
+    assert(!s->destage_running && QLIST_EMPTY(&s->tasks));
+
+    g_hash_table_iter_init(&iter, s->chunks);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&c)) {
+        lost += bitmap_count_one(c->dirty, WRITE_BACK_CHUNK_SECTORS) *
+                BDRV_SECTOR_SIZE;
+        write_back_buffer_unref(s, c->buf);
+        g_free(c);
+    }
+    g_hash_table_destroy(s->chunks);
+
+    if (lost) {
+        warn_report("write-back node '%s': %" PRIu64 " bytes of data could "
+                    "not be written", bdrv_get_device_or_node_name(bs), lost);
+    }
+}
+
+static int GRAPH_RDLOCK write_back_inactivate(BlockDriverState *bs)
+{
+    BDRVWriteBackState *s = bs->opaque;
+
+    /* Buffered data is gone after a migration, it must be written back */
+    if (g_hash_table_size(s->chunks)) {
+        error_report("write-back node '%s' has data that could not be "
+                     "written", bdrv_get_device_or_node_name(bs));
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int write_back_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    WriteBackOpts *opts = g_new0(WriteBackOpts, 1);
+
+    if (!write_back_absorb_opts(opts, reopen_state->options, errp)) {
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    reopen_state->opaque = opts;
+
+    return 0;
+}
+
+static void write_back_reopen_commit(BDRVReopenState *state)
+{
+    BDRVWriteBackState *s = state->bs->opaque;
+
+    s->opts = *(WriteBackOpts *)state->opaque;
+
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void write_back_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void GRAPH_RDLOCK
+write_back_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    /* The buffer tracks whole sectors */
+    bs->bl.request_alignment = MAX(bs->bl.request_alignment,
+                                   BDRV_SECTOR_SIZE);
+}
+
+typedef struct WriteBackGap {
+    int64_t offset;
+    int64_t bytes;
+} WriteBackGap;
+
+static void write_back_add_gap(GArray *gaps, int64_t offset, int64_t bytes)
+{
+    WriteBackGap *last = gaps->len ?
+        &g_array_index(gaps, WriteBackGap, gaps->len - 1) : NULL;
+
+    if (last && last->offset + last->bytes == offset) {
+        last->bytes += bytes;
+    } else {
+        WriteBackGap gap = { .offset = offset, .bytes = bytes };
+
+        g_array_append_val(gaps, gap);
+    }
+}
+
+/*
+ * Copy buffered data to @qiov, and read the rest from the file child.  The
+ * sectors that are not buffered when the buffer is looked at have been
+ * written back completely, so reading them later from the file child is
+ * safe.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+write_back_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov, size_t qiov_offset,
+                          BdrvRequestFlags flags)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    g_autoptr(GArray) gaps = NULL;
+    int64_t pos, end = offset + bytes;
+    guint i;
+    int ret;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, BDRV_SECTOR_SIZE));
+
+    qemu_co_mutex_lock(&s->lock);
+    reqlist_wait_all(&s->passthrough_reqs, offset, bytes, &s->lock);
+
+    if (!g_hash_table_size(s->chunks)) {
+        qemu_co_mutex_unlock(&s->lock);
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    gaps = g_array_new(false, false, sizeof(WriteBackGap));
+    for (pos = offset; pos < end; ) {
+        uint64_t index = pos / WRITE_BACK_CHUNK_SIZE;
+        int64_t chunk_start = index * WRITE_BACK_CHUNK_SIZE;
+        int64_t chunk_end = MIN(end, chunk_start + WRITE_BACK_CHUNK_SIZE);
+        WriteBackChunk *c = g_hash_table_lookup(s->chunks, &index);
+        int j, k;
+
+        if (!c) {
+            write_back_add_gap(gaps, pos, chunk_end - pos);
+            pos = chunk_end;
+            continue;
+        }
+
+        j = (pos - chunk_start) / BDRV_SECTOR_SIZE;
+        while (pos < chunk_end) {
+            int last = (chunk_end - chunk_start) / BDRV_SECTOR_SIZE;
+            bool buffered = test_bit(j, c->dirty) || test_bit(j, c->inflight);
+            int64_t len;
+
+            for (k = j + 1; k < last; k++) {
+                if ((test_bit(k, c->dirty) || test_bit(k, c->inflight)) !=
+                    buffered) {
+                    break;
+                }
+            }
+            len = (k - j) * BDRV_SECTOR_SIZE;
+
+            if (buffered) {
+                qemu_iovec_from_buf(qiov, qiov_offset + pos - offset,
+                                    c->buf->data + j * BDRV_SECTOR_SIZE, len);
+            } else {
+                write_back_add_gap(gaps, pos, len);
+            }
+            pos += len;
+            j = k;
+        }
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    for (i = 0; i < gaps->len; i++) {
+        WriteBackGap *gap = &g_array_index(gaps, WriteBackGap, i);
+
+        ret = bdrv_co_preadv_part(bs->file, gap->offset, gap->bytes, qiov,
+                                  qiov_offset + gap->offset - offset, flags);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Whether writing to sectors [@start, @start + @nb) of @c, which may be
+ * NULL, needs a new chunk buffer
+ */
+static bool write_back_needs_buffer(WriteBackChunk *c, int start, int nb)
+{
+    return !c || (c->buf->refcnt > 1 &&
+                  find_next_bit(c->inflight, start + nb, start) < start + nb);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_back_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset,
+                           BdrvRequestFlags flags)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    int64_t pos, end = offset + bytes;
+    uint64_t seq;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, BDRV_SECTOR_SIZE));
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    seq = ++s->write_seq;
+    for (pos = offset; pos < end; ) {
+        uint64_t index = pos / WRITE_BACK_CHUNK_SIZE;
+        int64_t chunk_start = index * WRITE_BACK_CHUNK_SIZE;
+        int64_t chunk_end = MIN(end, chunk_start + WRITE_BACK_CHUNK_SIZE);
+        int start = (pos - chunk_start) / BDRV_SECTOR_SIZE;
+        int nb = (chunk_end - pos) / BDRV_SECTOR_SIZE;
+        WriteBackChunk *c = g_hash_table_lookup(s->chunks, &index);
+        int i;
+
+        /*
+         * Wait for buffers to be freed if a new one would exceed max-size.
+         * Large writes wait in the middle, as their first chunks can be
+         * written back meanwhile.  The chunk must be looked up again then.
+         */
+        if (write_back_needs_buffer(c, start, nb) &&
+            s->mem_used + WRITE_BACK_CHUNK_SIZE > s->opts.max_size) {
+            if (s->destage_error) {
+                return s->destage_error;
+            }
+            write_back_kick(bs);
+            qemu_co_queue_wait(&s->progress, &s->lock);
+            continue;
+        }
+
+        if (!c) {
+            c = g_new0(WriteBackChunk, 1);
+            c->index = index;
+            c->buf = write_back_buffer_new(bs);
+            if (!c->buf) {
+                g_free(c);
+                return -ENOMEM;
+            }
+            g_hash_table_insert(s->chunks, &c->index, c);
+        } else if (write_back_needs_buffer(c, start, nb)) {
+            /* Don't change data that is being written back */
+            WriteBackBuffer *buf = write_back_buffer_new(bs);
+
+            if (!buf) {
+                return -ENOMEM;
+            }
+            memcpy(buf->data, c->buf->data, WRITE_BACK_CHUNK_SIZE);
+            write_back_buffer_unref(s, c->buf);
+            c->buf = buf;
+        }
+
+        qemu_iovec_to_buf(qiov, qiov_offset + pos - offset,
+                          c->buf->data + start * BDRV_SECTOR_SIZE,
+                          chunk_end - pos);
+        bitmap_set(c->dirty, start, nb);
+        for (i = start; i < start + nb; i++) {
+            c->seq[i] = seq;
+        }
+        if (!QTAILQ_IN_USE(c, dirty_entry)) {
+            c->dirty_seq = seq;
+            QTAILQ_INSERT_TAIL(&s->dirty_chunks, c, dirty_entry);
+        }
+
+        pos = chunk_end;
+    }
+
+    write_back_kick(bs);
+    return 0;
+}
+
+/* Drop the dirty sectors of @c in [@start, @end); s->lock held */
+static void write_back_chunk_drop(BDRVWriteBackState *s, WriteBackChunk *c,
+                                  int64_t start, int64_t end)
+{
+    int64_t chunk_start = c->index * WRITE_BACK_CHUNK_SIZE;
+    int64_t from = MAX(start, chunk_start);
+    int64_t to = MIN(end, chunk_start + WRITE_BACK_CHUNK_SIZE);
+
+    if (from < to) {
+        bitmap_clear(c->dirty, (from - chunk_start) / BDRV_SECTOR_SIZE,
+                     (to - from) / BDRV_SECTOR_SIZE);
+        write_back_chunk_update(s, c);
+    }
+}
+
+/*
+ * Wait for write back requests that overlap a request that bypasses the
+ * buffer, then drop buffered data in its range.  Write back requests that
+ * start meanwhile wait for @req to be removed.  Dropping the data only
+ * once nothing in the range is in flight makes sure that a failed write
+ * back can't mark it dirty again.
+ */
+static void coroutine_fn
+write_back_co_passthrough_begin(BlockDriverState *bs, BlockReq *req,
+                                int64_t offset, int64_t bytes)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    uint64_t first = offset / WRITE_BACK_CHUNK_SIZE;
+    uint64_t last = (offset + bytes - 1) / WRITE_BACK_CHUNK_SIZE;
+    int64_t start = QEMU_ALIGN_UP(offset, BDRV_SECTOR_SIZE);
+    int64_t end = QEMU_ALIGN_DOWN(offset + bytes, BDRV_SECTOR_SIZE);
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    reqlist_init_req(&s->passthrough_reqs, req, offset, bytes);
+    reqlist_wait_all(&s->destage_reqs, offset, bytes, &s->lock);
+
+    if (last - first < g_hash_table_size(s->chunks)) {
+        uint64_t index;
+
+        for (index = first; index <= last; index++) {
+            WriteBackChunk *c = g_hash_table_lookup(s->chunks, &index);
+
+            if (c) {
+                write_back_chunk_drop(s, c, start, end);
+            }
+        }
+    } else {
+        /* Large request, look at all chunks instead */
+        GList *chunks = g_hash_table_get_values(s->chunks);
+        GList *l;
+
+        for (l = chunks; l; l = l->next) {
+            write_back_chunk_drop(s, l->data, start, end);
+        }
+        g_list_free(chunks);
+    }
+}
+
+static void coroutine_fn
+write_back_co_passthrough_end(BlockDriverState *bs, BlockReq *req)
+{
+    BDRVWriteBackState *s = bs->opaque;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    reqlist_remove_req(req);
+    write_back_kick(bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_back_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    BlockReq req;
+    int ret;
+
+    write_back_co_passthrough_begin(bs, &req, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    write_back_co_passthrough_end(bs, &req);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_back_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BlockReq req;
+    int ret;
+
+    write_back_co_passthrough_begin(bs, &req, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    write_back_co_passthrough_end(bs, &req);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_back_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                       PreallocMode prealloc, BdrvRequestFlags flags,
+                       Error **errp)
+{
+    int ret;
+
+    ret = write_back_co_destage(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write back buffered data");
+        return ret;
+    }
+
+    return bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+}
+
+/* The generic block layer flushes the file child afterwards */
+static int coroutine_fn GRAPH_RDLOCK
+write_back_co_flush_to_os(BlockDriverState *bs)
+{
+    return write_back_co_destage(bs);
+}
+
+/*
+ * Buffered data may not be in the file child yet, so report it as data
+ * that can't be found in the file child.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+write_back_co_block_status(BlockDriverState *bs, unsigned int mode,
+                           int64_t offset, int64_t bytes, int64_t *pnum,
+                           int64_t *map, BlockDriverState **file)
+{
+    BDRVWriteBackState *s = bs->opaque;
+    int64_t pos, end;
+    bool buffered = false;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!g_hash_table_size(s->chunks)) {
+        *pnum = bytes;
+        *map = offset;
+        *file = bs->file->bs;
+        return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+    }
+
+    /* Don't look up too many chunks at once */
+    end = offset + MIN(bytes, 1024 * WRITE_BACK_CHUNK_SIZE);
+
+    for (pos = offset; pos < end; ) {
+        uint64_t index = pos / WRITE_BACK_CHUNK_SIZE;
+        int64_t chunk_start = index * WRITE_BACK_CHUNK_SIZE;
+        int64_t chunk_end = MIN(end, chunk_start + WRITE_BACK_CHUNK_SIZE);
+        WriteBackChunk *c = g_hash_table_lookup(s->chunks, &index);
+        int j = (pos - chunk_start) / BDRV_SECTOR_SIZE;
+        bool b = c && (test_bit(j, c->dirty) || test_bit(j, c->inflight));
+
+        if (pos == offset) {
+            buffered = b;
+        } else if (b != buffered) {
+            break;
+        }
+        if (!c) {
+            pos = chunk_end;
+            continue;
+        }
+        pos += BDRV_SECTOR_SIZE;
+    }
+
+    *pnum = MIN(pos, end) - offset;
+    if (buffered) {
+        return BDRV_BLOCK_DATA;
+    }
+
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+write_back_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void GRAPH_RDLOCK write_back_refresh_filename(BlockDriverState *bs)
+{
+    pstrcpy(bs->exact_filename, sizeof(bs->exact_filename),
+            bs->file->bs->filename);
+}
+
+static void GRAPH_RDLOCK
+write_back_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
+                      BlockReopenQueue *reopen_queue,
+                      uint64_t perm, uint64_t shared,
+                      uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    if (perm & BLK_PERM_WRITE) {
+        /* Others would not see buffered data, nor could we see theirs */
+        *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+    }
+}
+
+static BlockDriver bdrv_write_back_filter = {
+    .format_name = "write-back",
+    .instance_size = sizeof(BDRVWriteBackState),
+
+    .bdrv_co_getlength    = write_back_co_getlength,
+    .bdrv_open            = write_back_open,
+    .bdrv_close           = write_back_close,
+
+    .bdrv_reopen_prepare  = write_back_reopen_prepare,
+    .bdrv_reopen_commit   = write_back_reopen_commit,
+    .bdrv_reopen_abort    = write_back_reopen_abort,
+
+    .bdrv_refresh_limits  = write_back_refresh_limits,
+
+    .bdrv_co_preadv_part = write_back_co_preadv_part,
+    .bdrv_co_pwritev_part = write_back_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = write_back_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = write_back_co_pdiscard,
+    .bdrv_co_flush_to_os = write_back_co_flush_to_os,
+    .bdrv_co_truncate = write_back_co_truncate,
+    .bdrv_co_block_status = write_back_co_block_status,
+
+    .bdrv_inactivate = write_back_inactivate,
+
+    .bdrv_refresh_filename = write_back_refresh_filename,
+
+    .bdrv_child_perm = write_back_child_perm,
+
+    .is_filter = true,
+};
+
+static void bdrv_write_back_init(void)
+{
+    bdrv_register(&bdrv_write_back_filter);
+}
+
+block_init(bdrv_write_back_init);
@@ -2720,6 +2720,7 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 
     if (backup->x_perf) {
         if (backup->x_perf->has_use_copy_range) {
+            perf.has_use_copy_range = true;
             perf.use_copy_range = backup->x_perf->use_copy_range;
         }
         if (backup->x_perf->has_max_workers) {
@@ -227,6 +227,24 @@ GEN_INPUT_FLUSH3(float64_input_flush3, float64)
 # define QEMU_SOFTFLOAT_ATTR QEMU_FLATTEN __attribute__((noinline))
 #endif
 
+/*
+ * For targets that clear the flags before every operation, the inexact
+ * flag can instead be computed after the fact, by checking whether the
+ * host result is exact.  The checks rely on each operation being rounded
+ * exactly once in the format of its operands, and for float64 mul, div
+ * and sqrt on a fused multiply-add for the residual.
+ */
+#if FLT_EVAL_METHOD == 0 && !QEMU_NO_HARDFLOAT
+# define QEMU_HARDFLOAT_LAZY_INEXACT 1
+#else
+# define QEMU_HARDFLOAT_LAZY_INEXACT 0
+#endif
+#if QEMU_HARDFLOAT_LAZY_INEXACT && defined(__FP_FAST_FMA)
+# define QEMU_HARDFLOAT_LAZY_INEXACT_FMA 1
+#else
+# define QEMU_HARDFLOAT_LAZY_INEXACT_FMA 0
+#endif
+
 static inline bool can_use_fpu(const float_status *s)
 {
     if (QEMU_NO_HARDFLOAT) {
@@ -236,6 +254,18 @@ static inline bool can_use_fpu(const float_status *s)
                   s->float_rounding_mode == float_round_nearest_even);
 }
 
+/*
+ * Like can_use_fpu, but for callers that are able to detect an inexact
+ * result themselves, and so do not need the inexact flag already set.
+ */
+static inline bool can_use_fpu_lazy(const float_status *s)
+{
+    if (!QEMU_HARDFLOAT_LAZY_INEXACT) {
+        return false;
+    }
+    return likely(s->float_rounding_mode == float_round_nearest_even);
+}
+
 /*
  * Hardfloat generation functions. Each operation can have two flavors:
  * either using softfloat primitives (e.g. float32_is_zero_or_normal) for
@@ -260,6 +290,10 @@ typedef union {
 
 typedef bool (*f32_check_fn)(union_float32 a, union_float32 b);
 typedef bool (*f64_check_fn)(union_float64 a, union_float64 b);
+typedef bool (*f32_exact_fn)(union_float32 a, union_float32 b,
+                             union_float32 r);
+typedef bool (*f64_exact_fn)(union_float64 a, union_float64 b,
+                             union_float64 r);
 
 typedef float32 (*soft_f32_op2_fn)(float32 a, float32 b, float_status *s);
 typedef float64 (*soft_f64_op2_fn)(float64 a, float64 b, float_status *s);
@@ -318,6 +352,16 @@ bool f64_is_zon3(union_float64 a, union_float64 b, union_float64 c)
            float64_is_zero_or_normal(c.s);
 }
 
+/*
+ * The residual computed by the lazy inexact checks is only exact if it
+ * does not underflow, which is guaranteed as long as the operands and
+ * result of the operation are zero or at least 2**53 * DBL_MIN.
+ */
+static inline bool f64_is_lazy_tiny(union_float64 a)
+{
+    return a.h != 0 && fabs(a.h) < 0x1p-969;
+}
+
 static inline bool f32_is_inf(union_float32 a)
 {
     if (QEMU_HARDFLOAT_USE_ISINF) {
@@ -337,7 +381,7 @@ static inline bool f64_is_inf(union_float64 a)
 static inline float32
 float32_gen2(float32 xa, float32 xb, float_status *s,
              hard_f32_op2_fn hard, soft_f32_op2_fn soft,
-             f32_check_fn pre, f32_check_fn post)
+             f32_check_fn pre, f32_check_fn post, f32_exact_fn exact)
 {
     union_float32 ua, ub, ur;
 
@@ -345,7 +389,9 @@ float32_gen2(float32 xa, float32 xb, float_status *s,
     ub.s = xb;
 
     if (unlikely(!can_use_fpu(s))) {
-        goto soft;
+        if (!exact || !can_use_fpu_lazy(s)) {
+            goto soft;
+        }
     }
 
     float32_input_flush2(&ua.s, &ub.s, s);
@@ -355,9 +401,12 @@ float32_gen2(float32 xa, float32 xb, float_status *s,
 
     ur.h = hard(ua.h, ub.h);
     if (unlikely(f32_is_inf(ur))) {
-        float_raise(float_flag_overflow, s);
+        float_raise(float_flag_overflow | float_flag_inexact, s);
     } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && post(ua, ub)) {
         goto soft;
+    } else if (!(s->float_exception_flags & float_flag_inexact) &&
+               !exact(ua, ub, ur)) {
+        float_raise(float_flag_inexact, s);
     }
     return ur.s;
 
@@ -368,7 +417,7 @@ float32_gen2(float32 xa, float32 xb, float_status *s,
 static inline float64
 float64_gen2(float64 xa, float64 xb, float_status *s,
              hard_f64_op2_fn hard, soft_f64_op2_fn soft,
-             f64_check_fn pre, f64_check_fn post)
+             f64_check_fn pre, f64_check_fn post, f64_exact_fn exact)
 {
     union_float64 ua, ub, ur;
 
@@ -376,7 +425,9 @@ float64_gen2(float64 xa, float64 xb, float_status *s,
     ub.s = xb;
 
     if (unlikely(!can_use_fpu(s))) {
-        goto soft;
+        if (!exact || !can_use_fpu_lazy(s)) {
+            goto soft;
+        }
     }
 
     float64_input_flush2(&ua.s, &ub.s, s);
@@ -386,9 +437,16 @@ float64_gen2(float64 xa, float64 xb, float_status *s,
 
     ur.h = hard(ua.h, ub.h);
     if (unlikely(f64_is_inf(ur))) {
-        float_raise(float_flag_overflow, s);
+        float_raise(float_flag_overflow | float_flag_inexact, s);
     } else if (unlikely(fabs(ur.h) <= DBL_MIN) && post(ua, ub)) {
         goto soft;
+    } else if (!(s->float_exception_flags & float_flag_inexact)) {
+        if (unlikely(f64_is_lazy_tiny(ua) || f64_is_lazy_tiny(ur))) {
+            goto soft;
+        }
+        if (!exact(ua, ub, ur)) {
+            float_raise(float_flag_inexact, s);
+        }
     }
     return ur.s;
 
@@ -1972,6 +2030,35 @@ static double hard_f64_sub(double a, double b)
     return a - b;
 }
 
+/*
+ * The rounding error of a sum is exactly representable, and is computed
+ * without branches by Knuth's TwoSum.  The sum is exact iff that error
+ * is zero.
+ */
+static bool f32_add_exact(union_float32 a, union_float32 b, union_float32 r)
+{
+    float bb = r.h - a.h;
+    return (a.h - (r.h - bb)) + (b.h - bb) == 0;
+}
+
+static bool f32_sub_exact(union_float32 a, union_float32 b, union_float32 r)
+{
+    b.h = -b.h;
+    return f32_add_exact(a, b, r);
+}
+
+static bool f64_add_exact(union_float64 a, union_float64 b, union_float64 r)
+{
+    double bb = r.h - a.h;
+    return (a.h - (r.h - bb)) + (b.h - bb) == 0;
+}
+
+static bool f64_sub_exact(union_float64 a, union_float64 b, union_float64 r)
+{
+    b.h = -b.h;
+    return f64_add_exact(a, b, r);
+}
+
 static bool f32_addsubmul_post(union_float32 a, union_float32 b)
 {
     if (QEMU_HARDFLOAT_2F32_USE_FP) {
@@ -1990,41 +2077,47 @@ static bool f64_addsubmul_post(union_float64 a, union_float64 b)
 }
 
 static float32 float32_addsub(float32 a, float32 b, float_status *s,
-                              hard_f32_op2_fn hard, soft_f32_op2_fn soft)
+                              hard_f32_op2_fn hard, soft_f32_op2_fn soft,
+                              f32_exact_fn exact)
 {
     return float32_gen2(a, b, s, hard, soft,
-                        f32_is_zon2, f32_addsubmul_post);
+                        f32_is_zon2, f32_addsubmul_post, exact);
 }
 
 static float64 float64_addsub(float64 a, float64 b, float_status *s,
-                              hard_f64_op2_fn hard, soft_f64_op2_fn soft)
+                              hard_f64_op2_fn hard, soft_f64_op2_fn soft,
+                              f64_exact_fn exact)
 {
     return float64_gen2(a, b, s, hard, soft,
-                        f64_is_zon2, f64_addsubmul_post);
+                        f64_is_zon2, f64_addsubmul_post, exact);
 }
 
 float32 QEMU_FLATTEN
 float32_add(float32 a, float32 b, float_status *s)
 {
-    return float32_addsub(a, b, s, hard_f32_add, soft_f32_add);
+    return float32_addsub(a, b, s, hard_f32_add, soft_f32_add,
+                          f32_add_exact);
 }
 
 float32 QEMU_FLATTEN
 float32_sub(float32 a, float32 b, float_status *s)
 {
-    return float32_addsub(a, b, s, hard_f32_sub, soft_f32_sub);
+    return float32_addsub(a, b, s, hard_f32_sub, soft_f32_sub,
+                          f32_sub_exact);
 }
 
 float64 QEMU_FLATTEN
 float64_add(float64 a, float64 b, float_status *s)
 {
-    return float64_addsub(a, b, s, hard_f64_add, soft_f64_add);
+    return float64_addsub(a, b, s, hard_f64_add, soft_f64_add,
+                          f64_add_exact);
 }
 
 float64 QEMU_FLATTEN
 float64_sub(float64 a, float64 b, float_status *s)
 {
-    return float64_addsub(a, b, s, hard_f64_sub, soft_f64_sub);
+    return float64_addsub(a, b, s, hard_f64_sub, soft_f64_sub,
+                          f64_sub_exact);
 }
 
 static float64 float64r32_addsub(float64 a, float64 b, float_status *status,
@@ -2166,18 +2259,30 @@ static double hard_f64_mul(double a, double b)
     return a * b;
 }
 
+/* The product of two float32 is exact in float64. */
+static bool f32_mul_exact(union_float32 a, union_float32 b, union_float32 r)
+{
+    return (double)a.h * b.h == r.h;
+}
+
+static bool f64_mul_exact(union_float64 a, union_float64 b, union_float64 r)
+{
+    return fma(a.h, b.h, -r.h) == 0;
+}
+
 float32 QEMU_FLATTEN
 float32_mul(float32 a, float32 b, float_status *s)
 {
     return float32_gen2(a, b, s, hard_f32_mul, soft_f32_mul,
-                        f32_is_zon2, f32_addsubmul_post);
+                        f32_is_zon2, f32_addsubmul_post, f32_mul_exact);
 }
 
 float64 QEMU_FLATTEN
 float64_mul(float64 a, float64 b, float_status *s)
 {
     return float64_gen2(a, b, s, hard_f64_mul, soft_f64_mul,
-                        f64_is_zon2, f64_addsubmul_post);
+                        f64_is_zon2, f64_addsubmul_post,
+                        QEMU_HARDFLOAT_LAZY_INEXACT_FMA ? f64_mul_exact : NULL);
 }
 
 float64 float64r32_mul(float64 a, float64 b, float_status *status)
@@ -2574,18 +2679,30 @@ static bool f64_div_post(union_float64 a, union_float64 b)
     return !float64_is_zero(a.s);
 }
 
+/* The quotient is exact iff multiplying back yields the dividend. */
+static bool f32_div_exact(union_float32 a, union_float32 b, union_float32 r)
+{
+    return (double)r.h * b.h == a.h;
+}
+
+static bool f64_div_exact(union_float64 a, union_float64 b, union_float64 r)
+{
+    return fma(-r.h, b.h, a.h) == 0;
+}
+
 float32 QEMU_FLATTEN
 float32_div(float32 a, float32 b, float_status *s)
 {
     return float32_gen2(a, b, s, hard_f32_div, soft_f32_div,
-                        f32_div_pre, f32_div_post);
+                        f32_div_pre, f32_div_post, f32_div_exact);
 }
 
 float64 QEMU_FLATTEN
 float64_div(float64 a, float64 b, float_status *s)
 {
     return float64_gen2(a, b, s, hard_f64_div, soft_f64_div,
-                        f64_div_pre, f64_div_post);
+                        f64_div_pre, f64_div_post,
+                        QEMU_HARDFLOAT_LAZY_INEXACT_FMA ? f64_div_exact : NULL);
 }
 
 float64 float64r32_div(float64 a, float64 b, float_status *status)
@@ -4706,7 +4823,7 @@ float32 QEMU_FLATTEN float32_sqrt(float32 xa, float_status *s)
     union_float32 ua, ur;
 
     ua.s = xa;
-    if (unlikely(!can_use_fpu(s))) {
+    if (unlikely(!can_use_fpu(s)) && !can_use_fpu_lazy(s)) {
         goto soft;
     }
 
@@ -4722,6 +4839,10 @@ float32 QEMU_FLATTEN float32_sqrt(float32 xa, float_status *s)
         goto soft;
     }
     ur.h = sqrtf(ua.h);
+    if (!(s->float_exception_flags & float_flag_inexact) &&
+        (double)ur.h * ur.h != ua.h) {
+        float_raise(float_flag_inexact, s);
+    }
     return ur.s;
 
  soft:
@@ -4733,7 +4854,8 @@ float64 QEMU_FLATTEN float64_sqrt(float64 xa, float_status *s)
     union_float64 ua, ur;
 
     ua.s = xa;
-    if (unlikely(!can_use_fpu(s))) {
+    if (unlikely(!can_use_fpu(s)) &&
+        !(QEMU_HARDFLOAT_LAZY_INEXACT_FMA && can_use_fpu_lazy(s))) {
         goto soft;
     }
 
@@ -4749,6 +4871,14 @@ float64 QEMU_FLATTEN float64_sqrt(float64 xa, float_status *s)
         goto soft;
     }
     ur.h = sqrt(ua.h);
+    if (!(s->float_exception_flags & float_flag_inexact)) {
+        if (unlikely(f64_is_lazy_tiny(ua))) {
+            goto soft;
+        }
+        if (fma(-ur.h, ur.h, ua.h) != 0) {
+            float_raise(float_flag_inexact, s);
+        }
+    }
     return ur.s;
 
  soft:
@@ -53,6 +53,8 @@ static uint64_t port92_read(void *opaque, hwaddr addr,
 
 static const VMStateDescription vmstate_port92_isa = {
     .name = "port92",
+    /* No hooks, the A20 line is not raised on load */
+    .parallel_load = true,
     .version_id = 1,
     .minimum_version_id = 1,
     .fields = (const VMStateField[]) {
@@ -206,6 +206,7 @@
 #include "system/hostmem.h"
 #include "hw/pci/msix.h"
 #include "hw/pci/pcie_sriov.h"
+#include "hw/virtio/iothread-vq-mapping.h"
 #include "system/spdm-socket.h"
 #include "migration/vmstate.h"
 
@@ -628,11 +629,15 @@ static int nvme_check_cqid(NvmeCtrl *n, uint16_t cqid)
 
 static void nvme_inc_cq_tail(NvmeCQueue *cq)
 {
-    cq->tail++;
-    if (cq->tail >= cq->size) {
-        cq->tail = 0;
+    uint32_t tail = cq->tail + 1;
+
+    if (tail >= cq->size) {
+        tail = 0;
         cq->phase = !cq->phase;
     }
+
+    /* read by nvme_cq_update_irq() if the queue runs in an IOThread */
+    qatomic_set(&cq->tail, tail);
 }
 
 static void nvme_inc_sq_head(NvmeSQueue *sq)
@@ -642,12 +647,17 @@ static void nvme_inc_sq_head(NvmeSQueue *sq)
 
 static uint8_t nvme_cq_full(NvmeCQueue *cq)
 {
-    return (cq->tail + 1) % cq->size == cq->head;
+    return (cq->tail + 1) % cq->size == qatomic_read(&cq->head);
 }
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == qatomic_read(&sq->tail);
+}
+
+static bool nvme_cq_in_iothread(NvmeCQueue *cq)
+{
+    return cq->ctx != qemu_get_aio_context();
 }
 
 static void nvme_irq_check(NvmeCtrl *n)
@@ -705,6 +715,36 @@ static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/*
+ * Interrupts for completion queues that run in an IOThread are raised
+ * here, with the BQL held, after the IOThread schedules cq->irq_bh.  The
+ * doorbell write handler calls this too, with @notify false, so that the
+ * interrupt is deasserted once the host has consumed all entries.
+ */
+static void nvme_cq_update_irq(NvmeCQueue *cq, bool notify)
+{
+    NvmeCtrl *n = cq->ctrl;
+    bool pending = qatomic_read(&cq->tail) != qatomic_read(&cq->head);
+
+    if (pending != cq->irq_pending) {
+        cq->irq_pending = pending;
+        if (cq->irq_enabled) {
+            n->cq_pending += pending ? 1 : -1;
+        }
+    }
+
+    if (!pending) {
+        nvme_irq_deassert(n, cq);
+    } else if (notify) {
+        nvme_irq_assert(n, cq);
+    }
+}
+
+static void nvme_cq_irq_bh(void *opaque)
+{
+    nvme_cq_update_irq(opaque, true);
+}
+
 static void nvme_req_clear(NvmeRequest *req)
 {
     req->ns = NULL;
@@ -1507,7 +1547,7 @@ static void nvme_post_cqes(void *opaque)
         NvmeSQueue *sq;
         hwaddr addr;
 
-        if (n->dbbuf_enabled) {
+        if (qatomic_read(&n->dbbuf_enabled)) {
             nvme_update_cq_eventidx(cq);
             nvme_update_cq_head(cq);
         }
@@ -1535,13 +1575,19 @@ static void nvme_post_cqes(void *opaque)
         nvme_inc_cq_tail(cq);
         nvme_sg_unmap(&req->sg);
 
-        if (QTAILQ_EMPTY(&sq->req_list) && !nvme_sq_empty(sq)) {
+        if (QTAILQ_EMPTY(&sq->req_list) && !nvme_sq_empty(sq) &&
+            !sq->stopped) {
             qemu_bh_schedule(sq->bh);
         }
 
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     if (cq->tail != cq->head) {
+        if (nvme_cq_in_iothread(cq)) {
+            qemu_bh_schedule(cq->irq_bh);
+            return;
+        }
+
         if (cq->irq_enabled && !pending) {
             n->cq_pending++;
         }
@@ -4734,16 +4780,44 @@ static void nvme_cq_notifier(EventNotifier *e)
     nvme_update_cq_head(cq);
 
     if (cq->tail == cq->head) {
-        if (cq->irq_enabled) {
-            n->cq_pending--;
-        }
+        if (nvme_cq_in_iothread(cq)) {
+            qemu_bh_schedule(cq->irq_bh);
+        } else {
+            if (cq->irq_enabled) {
+                n->cq_pending--;
+            }
 
-        nvme_irq_deassert(n, cq);
+            nvme_irq_deassert(n, cq);
+        }
     }
 
     qemu_bh_schedule(cq->bh);
 }
 
+static void nvme_set_notifier_handler(AioContext *ctx, EventNotifier *e,
+                                      EventNotifierHandler *handler)
+{
+    if (ctx == qemu_get_aio_context()) {
+        event_notifier_set_handler(e, handler);
+    } else {
+        aio_set_event_notifier(ctx, e, handler, NULL, NULL);
+    }
+}
+
+/*
+ * Run @fn in @ctx and wait for it to complete.  Queues that run in an
+ * IOThread are stopped and torn down from there, so that this cannot race
+ * with their bottom halves and notifiers.  Called with the BQL held.
+ */
+static void nvme_run_in_ctx(AioContext *ctx, QEMUBHFunc *fn, void *opaque)
+{
+    if (ctx == qemu_get_aio_context()) {
+        fn(opaque);
+    } else {
+        aio_wait_bh_oneshot(ctx, fn, opaque);
+    }
+}
+
 static int nvme_init_cq_ioeventfd(NvmeCQueue *cq)
 {
     NvmeCtrl *n = cq->ctrl;
@@ -4755,7 +4829,7 @@ static int nvme_init_cq_ioeventfd(NvmeCQueue *cq)
         return ret;
     }
 
-    event_notifier_set_handler(&cq->notifier, nvme_cq_notifier);
+    nvme_set_notifier_handler(cq->ctx, &cq->notifier, nvme_cq_notifier);
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &cq->notifier);
 
@@ -4784,23 +4858,43 @@ static int nvme_init_sq_ioeventfd(NvmeSQueue *sq)
         return ret;
     }
 
-    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    nvme_set_notifier_handler(sq->ctx, &sq->notifier, nvme_sq_notifier);
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &sq->notifier);
 
     return 0;
 }
 
+/* Stop fetching commands; runs in sq->ctx */
+static void nvme_stop_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    sq->stopped = true;
+    qemu_bh_cancel(sq->bh);
+}
+
+/* Runs in sq->ctx */
+static void nvme_detach_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    qemu_bh_delete(sq->bh);
+    sq->bh = NULL;
+    if (sq->ioeventfd_enabled) {
+        nvme_set_notifier_handler(sq->ctx, &sq->notifier, NULL);
+    }
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     uint16_t offset = sq->sqid << 3;
 
     n->sq[sq->sqid] = NULL;
-    qemu_bh_delete(sq->bh);
+    nvme_run_in_ctx(sq->ctx, nvme_detach_sq, sq);
     if (sq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &sq->notifier);
-        event_notifier_set_handler(&sq->notifier, NULL);
         event_notifier_cleanup(&sq->notifier);
     }
     g_free(sq->io_req);
@@ -4809,22 +4903,16 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
     }
 }
 
-static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
+/* Abort outstanding commands; runs in sq->ctx */
+static void nvme_abort_sq(void *opaque)
 {
-    NvmeDeleteQ *c = (NvmeDeleteQ *)&req->cmd;
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
     NvmeRequest *r, *next;
-    NvmeSQueue *sq;
     NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
 
-    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
-        trace_pci_nvme_err_invalid_del_sq(qid);
-        return NVME_INVALID_QID | NVME_DNR;
-    }
+    nvme_stop_sq(sq);
 
-    trace_pci_nvme_del_sq(qid);
-
-    sq = n->sq[qid];
     while (!QTAILQ_EMPTY(&sq->out_req_list)) {
         r = QTAILQ_FIRST(&sq->out_req_list);
         assert(r->aiocb);
@@ -4836,7 +4924,6 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
 
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
-        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
 
         nvme_post_cqes(cq);
         QTAILQ_FOREACH_SAFE(r, &cq->req_list, entry, next) {
@@ -4846,7 +4933,27 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
             }
         }
     }
+}
+
+static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)&req->cmd;
+    NvmeSQueue *sq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
+        trace_pci_nvme_err_invalid_del_sq(qid);
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+
+    trace_pci_nvme_del_sq(qid);
+
+    sq = n->sq[qid];
+    if (!nvme_check_cqid(n, sq->cqid)) {
+        QTAILQ_REMOVE(&n->cq[sq->cqid]->sq_list, sq, entry);
+    }
 
+    nvme_run_in_ctx(sq->ctx, nvme_abort_sq, sq);
     nvme_free_sq(sq, n);
     return NVME_SUCCESS;
 }
@@ -4863,6 +4970,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->stopped = false;
     sq->io_req = g_new0(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -4872,8 +4980,21 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
 
-    sq->bh = qemu_bh_new_guarded(nvme_process_sq, sq,
-                                 &DEVICE(sq->ctrl)->mem_reentrancy_guard);
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+
+    /*
+     * Commands are completed into the completion queue from the same
+     * AioContext.  The reentrancy guard of the device cannot be shared
+     * with an IOThread, see nvme_mmio_write() instead.
+     */
+    sq->ctx = cq->ctx;
+    if (nvme_cq_in_iothread(cq)) {
+        sq->bh = aio_bh_new(sq->ctx, nvme_process_sq, sq);
+    } else {
+        sq->bh = qemu_bh_new_guarded(nvme_process_sq, sq,
+                                     &DEVICE(sq->ctrl)->mem_reentrancy_guard);
+    }
 
     if (n->dbbuf_enabled) {
         sq->db_addr = n->dbbuf_dbs + (sqid << 3);
@@ -4886,8 +5007,6 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
 
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
 }
@@ -5504,17 +5623,45 @@ static uint16_t nvme_get_log(NvmeCtrl *n, NvmeRequest *req)
     }
 }
 
+/* Runs in cq->ctx */
+static void nvme_detach_cq(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    qemu_bh_delete(cq->bh);
+    cq->bh = NULL;
+    if (cq->ioeventfd_enabled) {
+        nvme_set_notifier_handler(cq->ctx, &cq->notifier, NULL);
+    }
+}
+
+/*
+ * Stop posting completions.  Afterwards, the state of the queue, including
+ * irq_pending, does not change anymore.
+ */
+static void nvme_stop_cq(NvmeCQueue *cq)
+{
+    if (!cq->bh) {
+        return;
+    }
+
+    nvme_run_in_ctx(cq->ctx, nvme_detach_cq, cq);
+    if (cq->irq_bh) {
+        qemu_bh_delete(cq->irq_bh);
+        cq->irq_bh = NULL;
+    }
+}
+
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     PCIDevice *pci = PCI_DEVICE(n);
     uint16_t offset = (cq->cqid << 3) + (1 << 2);
 
     n->cq[cq->cqid] = NULL;
-    qemu_bh_delete(cq->bh);
+    nvme_stop_cq(cq);
     if (cq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &cq->notifier);
-        event_notifier_set_handler(&cq->notifier, NULL);
         event_notifier_cleanup(&cq->notifier);
     }
     if (msix_enabled(pci) && cq->irq_enabled) {
@@ -5542,7 +5689,9 @@ static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeRequest *req)
         return NVME_INVALID_QUEUE_DEL;
     }
 
-    if (cq->irq_enabled && cq->tail != cq->head) {
+    nvme_stop_cq(cq);
+    if (cq->irq_enabled && (nvme_cq_in_iothread(cq) ? cq->irq_pending :
+                            cq->tail != cq->head)) {
         n->cq_pending--;
     }
 
@@ -5570,8 +5719,21 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->irq_pending = false;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
+
+    cq->ctx = cqid ? n->ioq_aio_context[cqid - 1] : qemu_get_aio_context();
+    if (nvme_cq_in_iothread(cq)) {
+        cq->bh = aio_bh_new(cq->ctx, nvme_post_cqes, cq);
+        cq->irq_bh = qemu_bh_new_guarded(nvme_cq_irq_bh, cq,
+                                         &DEVICE(n)->mem_reentrancy_guard);
+    } else {
+        cq->bh = qemu_bh_new_guarded(nvme_post_cqes, cq,
+                                     &DEVICE(cq->ctrl)->mem_reentrancy_guard);
+        cq->irq_bh = NULL;
+    }
+
     if (n->dbbuf_enabled) {
         cq->db_addr = n->dbbuf_dbs + (cqid << 3) + (1 << 2);
         cq->ei_addr = n->dbbuf_eis + (cqid << 3) + (1 << 2);
@@ -5583,8 +5745,6 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
     n->cq[cqid] = cq;
-    cq->bh = qemu_bh_new_guarded(nvme_post_cqes, cq,
-                                 &DEVICE(cq->ctrl)->mem_reentrancy_guard);
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -6791,6 +6951,14 @@ static bool nvme_csi_supported(NvmeCtrl *n, uint8_t csi)
         return true;
 
     case NVME_CSI_ZONED:
+        /*
+         * Zone state is shared by all queues and updated by I/O commands
+         * without a lock, so it can't be used from several AioContexts.
+         */
+        if (nvme_ioq_in_iothread(n)) {
+            return false;
+        }
+
         cc = ldl_le_p(&n->bar.cc);
 
         return NVME_CC_CSS(cc) == NVME_CC_CSS_ALL;
@@ -7258,9 +7426,38 @@ static uint16_t nvme_virt_mngmt(NvmeCtrl *n, NvmeRequest *req)
     }
 }
 
+/* Set up the shadow doorbell of a submission queue; runs in sq->ctx */
+static void nvme_dbbuf_config_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    /*
+     * CAP.DSTRD is 0, so offset of ith sq db_addr is (i<<3)
+     * nvme_process_db() uses this hard-coded way to calculate
+     * doorbell offsets. Be consistent with that here.
+     */
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    stl_le_pci_dma(PCI_DEVICE(n), sq->db_addr, sq->tail,
+                   MEMTXATTRS_UNSPECIFIED);
+}
+
+/* Set up the shadow doorbell of a completion queue; runs in cq->ctx */
+static void nvme_dbbuf_config_cq(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    /* CAP.DSTRD is 0, so offset of ith cq db_addr is (i<<3)+(1<<2) */
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    stl_le_pci_dma(PCI_DEVICE(n), cq->db_addr, cq->head,
+                   MEMTXATTRS_UNSPECIFIED);
+}
+
 static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
 {
-    PCIDevice *pci = PCI_DEVICE(n);
     uint64_t dbs_addr = le64_to_cpu(req->cmd.dptr.prp1);
     uint64_t eis_addr = le64_to_cpu(req->cmd.dptr.prp2);
     int i;
@@ -7273,40 +7470,32 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
     /* Save shadow buffer base addr for use during queue creation */
     n->dbbuf_dbs = dbs_addr;
     n->dbbuf_eis = eis_addr;
-    n->dbbuf_enabled = true;
 
+    /*
+     * Queues in an IOThread read their shadow doorbells as soon as they
+     * see dbbuf_enabled, so update them from their own AioContext first.
+     */
     for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->sq[i]) {
+            nvme_run_in_ctx(n->sq[i]->ctx, nvme_dbbuf_config_sq, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_run_in_ctx(n->cq[i]->ctx, nvme_dbbuf_config_cq, n->cq[i]);
+        }
+    }
+
+    qatomic_set(&n->dbbuf_enabled, true);
+
+    for (i = 1; n->params.ioeventfd && i < n->params.max_ioqpairs + 1; i++) {
         NvmeSQueue *sq = n->sq[i];
         NvmeCQueue *cq = n->cq[i];
 
-        if (sq) {
-            /*
-             * CAP.DSTRD is 0, so offset of ith sq db_addr is (i<<3)
-             * nvme_process_db() uses this hard-coded way to calculate
-             * doorbell offsets. Be consistent with that here.
-             */
-            sq->db_addr = dbs_addr + (i << 3);
-            sq->ei_addr = eis_addr + (i << 3);
-            stl_le_pci_dma(pci, sq->db_addr, sq->tail, MEMTXATTRS_UNSPECIFIED);
-
-            if (n->params.ioeventfd && sq->sqid != 0) {
-                if (!nvme_init_sq_ioeventfd(sq)) {
-                    sq->ioeventfd_enabled = true;
-                }
-            }
+        if (sq && !nvme_init_sq_ioeventfd(sq)) {
+            sq->ioeventfd_enabled = true;
         }
 
-        if (cq) {
-            /* CAP.DSTRD is 0, so offset of ith cq db_addr is (i<<3)+(1<<2) */
-            cq->db_addr = dbs_addr + (i << 3) + (1 << 2);
-            cq->ei_addr = eis_addr + (i << 3) + (1 << 2);
-            stl_le_pci_dma(pci, cq->db_addr, cq->head, MEMTXATTRS_UNSPECIFIED);
-
-            if (n->params.ioeventfd && cq->cqid != 0) {
-                if (!nvme_init_cq_ioeventfd(cq)) {
-                    cq->ioeventfd_enabled = true;
-                }
-            }
+        if (cq && !nvme_init_cq_ioeventfd(cq)) {
+            cq->ioeventfd_enabled = true;
         }
     }
 
@@ -7785,7 +7974,11 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
-    if (n->dbbuf_enabled) {
+    if (sq->stopped) {
+        return;
+    }
+
+    if (qatomic_read(&n->dbbuf_enabled)) {
         nvme_update_sq_tail(sq);
     }
 
@@ -7840,7 +8033,7 @@ static void nvme_process_sq(void *opaque)
             nvme_enqueue_req_completion(cq, req);
         }
 
-        if (n->dbbuf_enabled) {
+        if (qatomic_read(&n->dbbuf_enabled)) {
             nvme_update_sq_eventidx(sq);
             nvme_update_sq_tail(sq);
         }
@@ -7892,6 +8085,13 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
     NvmeNamespace *ns;
     int i;
 
+    /* Queues in IOThreads would keep submitting requests while draining */
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_run_in_ctx(n->sq[i]->ctx, nvme_stop_sq, n->sq[i]);
+        }
+    }
+
     for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
         ns = nvme_ns(n, i);
         if (!ns) {
@@ -7901,6 +8101,13 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
         nvme_ns_drain(ns);
     }
 
+    /* Completions that are still queued must not be posted anymore */
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_stop_cq(n->cq[i]);
+        }
+    }
+
     for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -8432,6 +8639,17 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_cq(cq->cqid, new_head);
 
+        if (nvme_cq_in_iothread(cq)) {
+            /*
+             * The tail is owned by the IOThread, so let it check whether
+             * completions were deferred because the queue was full.
+             */
+            qatomic_set(&cq->head, new_head);
+            qemu_bh_schedule(cq->bh);
+            nvme_cq_update_irq(cq, false);
+            return;
+        }
+
         /* scheduled deferred cqe posting if queue was previously full */
         if (nvme_cq_full(cq)) {
             qemu_bh_schedule(cq->bh);
@@ -8490,7 +8708,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
 
-        sq->tail = new_tail;
+        qatomic_set(&sq->tail, new_tail);
         if (!qid && n->dbbuf_enabled) {
             /*
              * The spec states "the host shall also update the controller's
@@ -8519,6 +8737,18 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
 
     trace_pci_nvme_mmio_write(addr, data, size);
 
+    /*
+     * Queues that run in an IOThread do not take the reentrancy guard of
+     * the device, so DMA from them to the registers shows up here.  The
+     * controller state must not be changed from an IOThread.
+     */
+    if (qemu_get_current_aio_context() != qemu_get_aio_context()) {
+        qemu_log_mask(LOG_GUEST_ERROR, "nvme: DMA to controller registers"
+                      " from an I/O queue, offset=0x%"HWADDR_PRIx", ignoring\n",
+                      addr);
+        return;
+    }
+
     if (pci_is_vf(PCI_DEVICE(n)) && !nvme_sctrl(n)->scs &&
         addr != NVME_REG_CSTS) {
         trace_pci_nvme_err_ignored_mmio_vf_offline(addr, size);
@@ -8706,9 +8936,87 @@ static bool nvme_check_params(NvmeCtrl *n, Error **errp)
         }
     }
 
+    if (params->iothread && params->iothread_vq_mapping_list) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties cannot "
+                   "be set at the same time");
+        return false;
+    }
+
+    if (nvme_ioq_in_iothread(n)) {
+        /*
+         * I/O queues in an IOThread cannot access device memory, and
+         * checking atomic writes needs to look at all submission queues.
+         * Zoned namespaces are rejected in nvme_csi_supported() for the
+         * same reason.
+         */
+        if (params->cmb_size_mb || n->pmr.dev) {
+            error_setg(errp, "CMB and PMR are not supported with iothread");
+            return false;
+        }
+
+        if (params->atomic_awun || params->atomic_awupf) {
+            error_setg(errp, "atomic writes are not supported with iothread");
+            return false;
+        }
+    }
+
     return true;
 }
 
+/*
+ * Assign an AioContext to each I/O queue pair, by completion queue
+ * identifier.  The submission queues run in the AioContext of their
+ * completion queue, and the admin queue always runs in the main loop.
+ */
+static bool nvme_init_ioq_aio_context(NvmeCtrl *n, Error **errp)
+{
+    NvmeParams *params = &n->params;
+    AioContext *ctx = qemu_get_aio_context();
+    int i;
+
+    n->ioq_aio_context = g_new(AioContext *, params->max_ioqpairs);
+
+    if (params->iothread_vq_mapping_list) {
+        if (!iothread_vq_mapping_apply(params->iothread_vq_mapping_list,
+                                       n->ioq_aio_context,
+                                       params->max_ioqpairs, errp)) {
+            g_free(n->ioq_aio_context);
+            n->ioq_aio_context = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    if (params->iothread) {
+        ctx = iothread_get_aio_context(params->iothread);
+
+        /* Released in nvme_cleanup_ioq_aio_context() */
+        object_ref(OBJECT(params->iothread));
+    }
+
+    for (i = 0; i < params->max_ioqpairs; i++) {
+        n->ioq_aio_context[i] = ctx;
+    }
+
+    return true;
+}
+
+static void nvme_cleanup_ioq_aio_context(NvmeCtrl *n)
+{
+    NvmeParams *params = &n->params;
+
+    if (params->iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(params->iothread_vq_mapping_list);
+    }
+
+    if (params->iothread) {
+        object_unref(OBJECT(params->iothread));
+    }
+
+    g_free(n->ioq_aio_context);
+    n->ioq_aio_context = NULL;
+}
+
 static void nvme_init_state(NvmeCtrl *n)
 {
     NvmePriCtrlCap *cap = &n->pri_ctrl_cap;
@@ -9284,19 +9592,29 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
          * this out.
          */
         object_ref(OBJECT(pn->subsys));
+
+        /* The queues of VFs run in the main loop */
+        n->params.iothread = NULL;
+        n->params.iothread_vq_mapping_list = NULL;
     }
 
     if (!nvme_check_params(n, errp)) {
         return;
     }
 
+    if (!nvme_init_ioq_aio_context(n, errp)) {
+        return;
+    }
+
     qbus_init(&n->bus, sizeof(NvmeBus), TYPE_NVME_BUS, dev, dev->id);
 
     if (nvme_init_subsys(n, errp)) {
+        nvme_cleanup_ioq_aio_context(n);
         return;
     }
     nvme_init_state(n);
     if (!nvme_init_pci(n, pci_dev, errp)) {
+        nvme_cleanup_ioq_aio_context(n);
         return;
     }
     nvme_init_ctrl(n, pci_dev);
@@ -9308,6 +9626,7 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         ns->ctrl = n;
 
         if (nvme_ns_setup(ns, errp)) {
+            nvme_cleanup_ioq_aio_context(n);
             return;
         }
 
@@ -9331,6 +9650,7 @@ static void nvme_exit(PCIDevice *pci_dev)
     }
 
     nvme_subsys_unregister_ctrl(n->subsys, n);
+    nvme_cleanup_ioq_aio_context(n);
 
     g_free(n->cq);
     g_free(n->sq);
@@ -9385,6 +9705,10 @@ static const Property nvme_props[] = {
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
     DEFINE_PROP_BOOL("legacy-cmb", NvmeCtrl, params.legacy_cmb, false),
     DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
+    DEFINE_PROP_LINK("iothread", NvmeCtrl, params.iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", NvmeCtrl,
+                                         params.iothread_vq_mapping_list),
     DEFINE_PROP_BOOL("dbcs", NvmeCtrl, params.dbcs, true),
     DEFINE_PROP_UINT8("zoned.zasl", NvmeCtrl, params.zasl, 0),
     DEFINE_PROP_BOOL("zoned.auto_transition", NvmeCtrl,
@@ -845,6 +845,11 @@ static void nvme_ns_realize(DeviceState *dev, Error **errp)
     ns->subsys = subsys;
     ns->endgrp = &subsys->endgrp;
 
+    if (ns->params.zoned && nvme_ioq_in_iothread(n)) {
+        error_setg(errp, "zoned namespaces are not supported with iothread");
+        return;
+    }
+
     if (!nvme_ns_set_nsabp(n, ns, errp)) {
         return;
     }
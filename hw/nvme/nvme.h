@@ -21,6 +21,8 @@
 #include "qemu/uuid.h"
 #include "hw/pci/pci_device.h"
 #include "hw/block/block.h"
+#include "system/iothread.h"
+#include "qapi/qapi-types-virtio.h"
 
 #include "block/nvme.h"
 
@@ -511,6 +513,10 @@ typedef struct NvmeSQueue {
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    /* Same as the AioContext of the completion queue */
+    AioContext  *ctx;
+    /* Set while the queue is torn down, no new commands are fetched */
+    bool        stopped;
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
@@ -532,6 +538,15 @@ typedef struct NvmeCQueue {
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    /* AioContext in which the queue and its submission queues run */
+    AioContext  *ctx;
+    /*
+     * Only used when ctx is an IOThread: interrupts are raised from the
+     * main loop by irq_bh, and irq_pending says whether the queue is
+     * counted in NvmeCtrl.cq_pending.
+     */
+    QEMUBH      *irq_bh;
+    bool        irq_pending;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -572,6 +587,9 @@ typedef struct NvmeParams {
     uint16_t atomic_awun;
     uint16_t atomic_awupf;
     bool     atomic_dn;
+
+    IOThread *iothread;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
 } NvmeParams;
 
 typedef struct NvmeCtrl {
@@ -640,6 +658,8 @@ typedef struct NvmeCtrl {
     NvmeNamespace   *namespaces[NVME_MAX_NAMESPACES + 1];
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
+    /* AioContext of each I/O queue pair, indexed by cqid - 1 */
+    AioContext      **ioq_aio_context;
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
     NvmeIdCtrl      id_ctrl;
@@ -682,6 +702,12 @@ static inline NvmeNamespace *nvme_ns(NvmeCtrl *n, uint32_t nsid)
     return n->namespaces[nsid];
 }
 
+/* Whether I/O queues may run outside of the main loop */
+static inline bool nvme_ioq_in_iothread(NvmeCtrl *n)
+{
+    return n->params.iothread || n->params.iothread_vq_mapping_list;
+}
+
 static inline NvmeCQueue *nvme_cq(NvmeRequest *req)
 {
     NvmeSQueue *sq = req->sq;
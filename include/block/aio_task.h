@@ -43,6 +43,9 @@ int aio_task_pool_status(AioTaskPool *pool);
 /* User provides filled @task, however task->pool will be set automatically */
 void coroutine_fn aio_task_pool_start_task(AioTaskPool *pool, AioTask *task);
 
+/* number of tasks currently running in the pool */
+int aio_task_pool_busy_tasks(AioTaskPool *pool);
+
 void coroutine_fn aio_task_pool_wait_slot(AioTaskPool *pool);
 void coroutine_fn aio_task_pool_wait_one(AioTaskPool *pool);
 void coroutine_fn aio_task_pool_wait_all(AioTaskPool *pool);
@@ -344,6 +344,26 @@ typedef enum {
 #define BDRV_WANT_PRECISE       (BDRV_WANT_ZERO | BDRV_WANT_OFFSET_VALID | \
                                  BDRV_WANT_OFFSET_VALID)
 
+/*
+ * One extent returned by the batched block status functions, such as
+ * bdrv_co_block_status_above_batch().  @ret holds the BDRV_BLOCK_* flags
+ * that bdrv_block_status() would return for the extent, @map and @file are
+ * only valid with BDRV_BLOCK_OFFSET_VALID.  @depth is the layer that
+ * determines the status, 1 being the top, or 0 if the extent is not
+ * allocated in any layer that was asked about.
+ */
+typedef struct BlockStatusExtent {
+    int64_t offset;
+    int64_t bytes;
+    int ret;
+    int depth;
+    int64_t map;
+    BlockDriverState *file;
+} BlockStatusExtent;
+
+/* Good number of extents to ask for in a batched block status query */
+#define BDRV_BLOCK_STATUS_BATCH 64
+
 typedef QTAILQ_HEAD(BlockReopenQueue, BlockReopenQueueEntry) BlockReopenQueue;
 
 typedef struct BDRVReopenState {
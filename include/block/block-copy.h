@@ -32,6 +32,9 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      uint64_t min_cluster_size,
                                      Error **errp);
 
+/* Whether copy offloading is used by default between the nodes of @s */
+bool block_copy_default_copy_range(BlockCopyState *s);
+
 /* Function should be called prior any actual copy request */
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress);
@@ -145,6 +145,30 @@ bdrv_block_status_above(BlockDriverState *bs, BlockDriverState *base,
                         int64_t offset, int64_t bytes, int64_t *pnum,
                         int64_t *map, BlockDriverState **file);
 
+/*
+ * Batched versions of bdrv_co_block_status_above() and
+ * bdrv_co_is_allocated_above(): fill @extents with the status of up to
+ * @max_extents consecutive extents starting at @offset, merging adjacent
+ * extents with the same status.  The extents need not cover all of @bytes.
+ *
+ * Return the number of extents, which is 0 only at or beyond the end of
+ * the image, or negative errno on failure.
+ */
+int coroutine_fn GRAPH_RDLOCK
+bdrv_co_block_status_above_batch(BlockDriverState *bs, BlockDriverState *base,
+                                 int64_t offset, int64_t bytes,
+                                 BlockStatusExtent *extents, int max_extents);
+int co_wrapper_mixed_bdrv_rdlock
+bdrv_block_status_above_batch(BlockDriverState *bs, BlockDriverState *base,
+                              int64_t offset, int64_t bytes,
+                              BlockStatusExtent *extents, int max_extents);
+
+int coroutine_fn GRAPH_RDLOCK
+bdrv_co_is_allocated_above_batch(BlockDriverState *bs, BlockDriverState *base,
+                                 bool include_base, int64_t offset,
+                                 int64_t bytes, BlockStatusExtent *extents,
+                                 int max_extents);
+
 int coroutine_fn GRAPH_RDLOCK
 bdrv_co_is_allocated(BlockDriverState *bs, int64_t offset, int64_t bytes,
                      int64_t *pnum);
@@ -647,6 +647,22 @@ struct BlockDriver {
         int64_t offset, int64_t bytes, int64_t *pnum,
         int64_t *map, BlockDriverState **file);
 
+    /*
+     * Optional batched variant of .bdrv_co_block_status, used by the
+     * bdrv_*_batch() block status functions.  The driver fills in the
+     * bytes, ret, map and file fields of between 1 and @nb_extents
+     * consecutive extents, the first starting at @offset; each extent
+     * follows the rules for the results of .bdrv_co_block_status.  The
+     * extents need not cover all of @bytes.
+     *
+     * Returns the number of extents or negative errno.  Drivers that
+     * implement this must implement .bdrv_co_block_status as well.
+     */
+    int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_block_status_batch)(
+        BlockDriverState *bs, unsigned int mode,
+        int64_t offset, int64_t bytes,
+        BlockStatusExtent *extents, int nb_extents);
+
     /*
      * Snapshot-access API.
      *
@@ -80,6 +80,24 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type,
                                   BdrvRequestFlags flags);
 bool luring_has_fua(void);
+
+typedef struct LuringPollState LuringPollState;
+LuringPollState *luring_poll_init(bool sqpoll, Error **errp);
+void luring_poll_cleanup(LuringPollState *s);
+void luring_poll_detach_aio_context(LuringPollState *s,
+                                    AioContext *old_context);
+void luring_poll_attach_aio_context(LuringPollState *s,
+                                    AioContext *new_context);
+
+/*
+ * luring_poll_co_submit: submit a read or write request to the polled
+ * io_uring of the thread's current AioContext.  The file must be opened with
+ * O_DIRECT.  Returns -EOPNOTSUPP if the file does not support polled I/O.
+ */
+int coroutine_fn luring_poll_co_submit(BlockDriverState *bs, bool sqpoll,
+                                       int fd, uint64_t offset,
+                                       QEMUIOVector *qiov, int type,
+                                       BdrvRequestFlags flags);
 #else
 static inline bool luring_has_fua(void)
 {
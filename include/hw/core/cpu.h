@@ -209,8 +209,14 @@ struct CPUClass {
 #define NB_MMU_MODES 22
 typedef uint32_t MMUIdxMap;
 
-/* Use a fully associative victim tlb of 8 entries. */
-#define CPU_VTLB_SIZE 8
+/*
+ * The victim tlb is set associative, with CPU_VTLB_WAYS entries per set.
+ * The total number of entries is a power of 2, by default a single fully
+ * associative set, and may be raised with -accel tcg,victim-tlb-size=N.
+ */
+#define CPU_VTLB_WAYS           8
+#define CPU_VTLB_DEFAULT_SIZE   CPU_VTLB_WAYS
+#define CPU_VTLB_MAX_SIZE       (64 * 1024)
 
 /*
  * The full TLB entry, which is not accessed by generated TCG code,
@@ -289,16 +295,26 @@ typedef struct CPUTLBDesc {
      */
     vaddr large_page_addr;
     vaddr large_page_mask;
+    /*
+     * The most recent translation installed for a page within a large
+     * page, for the TARGET_PAGE_SIZE page at lp_fill_page.  Other pages
+     * of the same large page may be installed from it without another
+     * tlb_fill.  Unused when lp_fill.lg_page_size is 0.
+     */
+    vaddr lp_fill_page;
+    CPUTLBEntryFull lp_fill;
     /* host time (in ns) at the beginning of the time window */
     int64_t window_begin_ns;
     /* maximum number of entries observed in the window */
     size_t window_max_entries;
     size_t n_used_entries;
-    /* The next index to use in the tlb victim table.  */
+    /* The next way to replace within a set of the tlb victim table.  */
     size_t vindex;
+    /* The number of sets in the tlb victim table, minus one.  */
+    size_t vmask;
     /* The tlb victim table, in two parts.  */
-    CPUTLBEntry vtable[CPU_VTLB_SIZE];
-    CPUTLBEntryFull vfulltlb[CPU_VTLB_SIZE];
+    CPUTLBEntry *vtable;
+    CPUTLBEntryFull *vfulltlb;
     CPUTLBEntryFull *fulltlb;
 } CPUTLBDesc;
 
@@ -322,6 +338,9 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    size_t vtlb_hit_count;
+    size_t vtlb_miss_count;
+    size_t lp_fill_count;
 } CPUTLBCommon;
 
 /*
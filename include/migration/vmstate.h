@@ -214,6 +214,21 @@ struct VMStateDescription {
      */
 
     bool early_setup;
+    /*
+     * With the parallel-device-load migration capability enabled, the
+     * section of this VMSD is sent length-prefixed so that the destination
+     * can load it on a worker thread, concurrently with other sections.
+     *
+     * Setting this promises that loading the state, including the
+     * pre_load()/post_load() hooks, neither needs the BQL nor touches the
+     * state of any other device.  A section whose load does rely on other
+     * sections having been loaded first lists their VMSDs in the
+     * NULL-terminated load_after array.  These sections must come first in
+     * the migration stream, i.e. be registered before this one or with a
+     * higher priority, otherwise saving the state fails.
+     */
+    bool parallel_load;
+    const VMStateDescription * const *load_after;
     int version_id;
     int minimum_version_id;
     MigrationPriority priority;
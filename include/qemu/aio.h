@@ -35,6 +35,7 @@ typedef void IOHandler(void *opaque);
 struct ThreadPoolAio;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
+struct LuringPollState;
 
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
@@ -295,6 +296,12 @@ struct AioContext {
 
     /* Pending callback state for cqe handlers */
     CqeHandlerSimpleQ cqe_handler_ready_list;
+
+    /* Fixed buffers and files registered with fdmon_io_uring */
+    struct FdmonFixed *fdmon_fixed;
+
+    /* Polled io_urings for block I/O, indexed by whether SQPOLL is used */
+    struct LuringPollState *linux_io_uring_poll[2];
 #endif /* CONFIG_LINUX_IO_URING */
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -591,6 +598,15 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the polled io_uring with or without SQPOLL bound to this AioContext */
+struct LuringPollState *aio_setup_linux_io_uring_poll(AioContext *ctx,
+                                                      bool sqpoll,
+                                                      Error **errp);
+
+/* Return the polled io_uring with or without SQPOLL bound to this AioContext */
+struct LuringPollState *aio_get_linux_io_uring_poll(AioContext *ctx,
+                                                    bool sqpoll);
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -847,6 +863,79 @@ static inline bool aio_has_io_uring(void)
  */
 void aio_add_sqe(void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
                  void *opaque, CqeHandler *cqe_handler);
+
+/**
+ * aio_register_fixed_buf: Register memory as io_uring fixed buffers.
+ * @host: start of the memory
+ * @size: length of the memory in bytes
+ *
+ * The memory is registered with the io_uring of every AioContext the next
+ * time that AioContext looks up a fixed buffer.  This pins the memory, so
+ * the caller must make sure it is not discarded while registered.
+ *
+ * Registration is best effort, aio_get_fixed_buf() simply does not find
+ * memory that could not be registered.  Registering the same memory twice
+ * takes a reference.
+ *
+ * Returns: %false if there are no free fixed buffer slots left.
+ */
+bool aio_register_fixed_buf(void *host, size_t size);
+
+/**
+ * aio_unregister_fixed_buf: Undo aio_register_fixed_buf().
+ * @host: start of the memory
+ * @size: length of the memory in bytes
+ *
+ * When the last reference is dropped, the memory is unregistered from all
+ * AioContexts before this function returns.  Must be called from the main
+ * loop with the BQL held.
+ */
+void aio_unregister_fixed_buf(void *host, size_t size);
+
+/**
+ * aio_register_fixed_file: Register a file descriptor as an io_uring fixed
+ * file.
+ * @fd: the file descriptor
+ *
+ * Like aio_register_fixed_buf(), this is best effort.
+ *
+ * Returns: %false if there are no free fixed file slots left.
+ */
+bool aio_register_fixed_file(int fd);
+
+/**
+ * aio_unregister_fixed_file: Undo aio_register_fixed_file().
+ * @fd: the file descriptor
+ *
+ * The file descriptor is unregistered from all AioContexts before this
+ * function returns, so that io_uring does not keep the file open after
+ * @fd is closed.  Must be called from the main loop with the BQL held.
+ */
+void aio_unregister_fixed_file(int fd);
+
+/**
+ * aio_get_fixed_buf: Look up a fixed buffer in the current AioContext.
+ * @base: start of the I/O buffer
+ * @len: length of the I/O buffer
+ *
+ * Only call this from a prep_sqe() function passed to aio_add_sqe().
+ *
+ * Returns: the index of a registered fixed buffer that contains the whole
+ * I/O buffer, for use with IORING_OP_READ_FIXED or IORING_OP_WRITE_FIXED,
+ * or -1 if there is none.
+ */
+int aio_get_fixed_buf(const void *base, size_t len);
+
+/**
+ * aio_get_fixed_file: Look up a fixed file in the current AioContext.
+ * @fd: the file descriptor
+ *
+ * Only call this from a prep_sqe() function passed to aio_add_sqe().
+ *
+ * Returns: the index of @fd for use with IOSQE_FIXED_FILE, or -1 if @fd is
+ * not registered.
+ */
+int aio_get_fixed_file(int fd);
 #endif /* CONFIG_LINUX_IO_URING */
 
 #endif
@@ -80,6 +80,16 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * Dirty page history for the working-set migration capability, only
+     * used on the source side and protected like clear_bmap.  The bits of
+     * last_dirty_bmap are set for the pages dirtied by the guest during
+     * the period before the last global sync, and those of hot_bmap for
+     * the pages dirtied during each of the last two periods.
+     */
+    unsigned long *last_dirty_bmap;
+    unsigned long *hot_bmap;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
@@ -133,9 +133,10 @@ typedef enum TCGType {
     TCG_TYPE_V64,
     TCG_TYPE_V128,
     TCG_TYPE_V256,
+    TCG_TYPE_V512,
 
     /* Number of different types (integer not enum) */
-#define TCG_TYPE_COUNT  (TCG_TYPE_V256 + 1)
+#define TCG_TYPE_COUNT  (TCG_TYPE_V512 + 1)
 
     /* An alias for the size of the host register.  */
     TCG_TYPE_REG = TCG_TYPE_I64,
@@ -622,6 +623,7 @@ void tcg_pool_reset(TCGContext *s);
 TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_reset_all(void);
+size_t tcg_region_reclaim(void (*func)(TranslationBlock *tb));
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
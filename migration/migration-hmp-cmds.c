@@ -98,6 +98,16 @@ static void migration_dump_blocktime(Monitor *mon, MigrationInfo *info)
                        info->postcopy_non_vcpu_latency);
     }
 
+    if (info->has_postcopy_faults) {
+        monitor_printf(mon, "Postcopy Faults: %" PRIu64 "\n",
+                       info->postcopy_faults);
+    }
+
+    if (info->has_postcopy_prefetch_pages) {
+        monitor_printf(mon, "Postcopy Prefetched Pages: %" PRIu64 "\n",
+                       info->postcopy_prefetch_pages);
+    }
+
     if (info->has_postcopy_vcpu_latency) {
         uint64List *item = info->postcopy_vcpu_latency;
         const char *sep = "";
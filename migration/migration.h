@@ -193,6 +193,14 @@ struct MigrationIncomingState {
     ThreadPool *load_threads;
     bool load_threads_abort;
 
+    /*
+     * Device state load pool used with the parallel-device-load capability,
+     * and the sections submitted to it since the last wait (only accessed
+     * from the thread running qemu_loadvm_state_main()).
+     */
+    ThreadPool *device_load_threads;
+    GSList *device_load_jobs;
+
     /*
      * PostcopyBlocktimeContext to keep information for postcopy
      * live migration, to calculate vCPU block time
@@ -559,7 +567,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr, uint32_t tid);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -0,0 +1,343 @@
+/*
+ * Multifd delta compression implementation
+ *
+ * Pages that were already sent on a channel are kept in a per-channel
+ * history, and are sent again as the XBZRLE encoded difference to that
+ * version when this is smaller than the page.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "system/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+#include "page_cache.h"
+#include "ram.h"
+#include "xbzrle.h"
+
+/*
+ * The delta to the version of a page in a channel's history can only be
+ * used if the destination holds that same version, i.e. if the page was
+ * not sent by any other channel since.  owner[] records, for each target
+ * page of the guest RAM, the channel whose history holds the version last
+ * sent, as channel id + 1, or 0 if there is no such channel.
+ *
+ * A page is sent at most once between two multifd syncs, and syncs order
+ * the send threads, so the entry of a page is never accessed by two
+ * channels concurrently.
+ */
+static struct {
+    uint8_t *owner;
+    uint64_t num_pages;
+    unsigned int users;
+} delta_state;
+
+struct delta_data {
+    /* history of the pages sent on this channel */
+    PageCache *cache;
+    /* copy of the page being sent */
+    uint8_t *buf;
+    /* encoded pages */
+    uint8_t *zbuf;
+    /* big-endian size of each encoded page */
+    uint32_t *zlen;
+};
+
+/* Multifd delta compression */
+
+static void multifd_delta_state_init(void)
+{
+    RAMBlock *block;
+    uint64_t end = 0;
+
+    if (delta_state.users++) {
+        return;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            end = MAX(end, block->offset + block->max_length);
+        }
+    }
+
+    delta_state.num_pages = end >> qemu_target_page_bits();
+    delta_state.owner = g_new0(uint8_t, delta_state.num_pages);
+}
+
+static void multifd_delta_state_fini(void)
+{
+    assert(delta_state.users);
+    if (--delta_state.users) {
+        return;
+    }
+
+    g_free(delta_state.owner);
+    delta_state.owner = NULL;
+    delta_state.num_pages = 0;
+}
+
+static int multifd_delta_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t page_count = multifd_ram_page_count();
+    uint64_t cache_pages;
+    struct delta_data *d;
+
+    /* The history of all channels is bounded by xbzrle-cache-size */
+    cache_pages = migrate_xbzrle_cache_size() / migrate_multifd_channels() /
+                  page_size;
+    cache_pages = cache_pages ? pow2floor(cache_pages) : 1;
+
+    d = g_new0(struct delta_data, 1);
+    d->cache = cache_init(cache_pages * page_size, page_size, errp);
+    if (!d->cache) {
+        error_prepend(errp, "multifd %u: ", p->id);
+        g_free(d);
+        return -1;
+    }
+    d->buf = g_malloc(page_size);
+    d->zbuf = g_malloc(page_size * page_count);
+    d->zlen = g_new0(uint32_t, page_count);
+    p->compress_data = d;
+
+    multifd_delta_state_init();
+
+    /*
+     * Needs 3 IOVs, one for packet header, one for the encoded page sizes
+     * and one for the encoded pages
+     */
+    p->iov = g_new0(struct iovec, 3);
+    return 0;
+}
+
+static void multifd_delta_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct delta_data *d = p->compress_data;
+
+    multifd_delta_state_fini();
+
+    cache_fini(d->cache);
+    g_free(d->buf);
+    g_free(d->zbuf);
+    g_free(d->zlen);
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+/*
+ * Encode the page at @offset into @out, and update the channel history.
+ *
+ * Returns the size of the encoded page, page_size if the page is sent
+ * as is.
+ */
+static uint32_t multifd_delta_encode_page(MultiFDSendParams *p,
+                                          ram_addr_t offset, uint8_t *out)
+{
+    struct delta_data *d = p->compress_data;
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t generation = qatomic_read(&mig_stats.dirty_sync_count);
+    ram_addr_t addr = pages->block->offset + offset;
+    uint8_t *owner = &delta_state.owner[addr >> qemu_target_page_bits()];
+    uint8_t *cached;
+    int len;
+
+    /*
+     * The VM might be running, so the page may be changing concurrently.
+     * Work on a copy, so the history matches what is actually sent.
+     */
+    memcpy(d->buf, pages->block->host + offset, page_size);
+
+    if (qatomic_read(owner) == p->id + 1 &&
+        cache_is_cached(d->cache, addr, generation)) {
+        cached = get_cached_data(d->cache, addr);
+        /* Only use the delta if it is smaller than the page */
+        len = xbzrle_encode_buffer(cached, d->buf, page_size, out,
+                                   page_size - 1);
+        if (len >= 0) {
+            memcpy(cached, d->buf, page_size);
+            return len;
+        }
+    }
+
+    memcpy(out, d->buf, page_size);
+    if (cache_insert(d->cache, addr, d->buf, generation) == 0) {
+        qatomic_set(owner, p->id + 1);
+    } else {
+        qatomic_set(owner, 0);
+    }
+    return page_size;
+}
+
+static int multifd_delta_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct delta_data *d = p->compress_data;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t out_size = 0, delta_num = 0;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out_zero;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        uint32_t len = multifd_delta_encode_page(p, pages->offset[i],
+                                                 d->zbuf + out_size);
+
+        if (len < page_size) {
+            delta_num++;
+        }
+        d->zlen[i] = cpu_to_be32(len);
+        out_size += len;
+    }
+
+    p->iov[p->iovs_num].iov_base = d->zlen;
+    p->iov[p->iovs_num].iov_len = pages->normal_num * sizeof(uint32_t);
+    p->iovs_num++;
+    p->iov[p->iovs_num].iov_base = d->zbuf;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = pages->normal_num * sizeof(uint32_t) + out_size;
+
+    trace_multifd_delta_send_prepare(p->id, pages->normal_num, delta_num,
+                                     out_size);
+
+out_zero:
+    /* Zero pages are cleared on the destination, forget their history */
+    for (i = pages->normal_num; i < pages->num; i++) {
+        ram_addr_t addr = pages->block->offset + pages->offset[i];
+
+        qatomic_set(&delta_state.owner[addr >> qemu_target_page_bits()], 0);
+    }
+
+    p->flags |= MULTIFD_FLAG_DELTA;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_delta_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t page_count = multifd_ram_page_count();
+    struct delta_data *d = g_new0(struct delta_data, 1);
+
+    d->zbuf = g_malloc(page_size * page_count);
+    d->zlen = g_new0(uint32_t, page_count);
+    p->compress_data = d;
+    return 0;
+}
+
+static void multifd_delta_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct delta_data *d = p->compress_data;
+
+    g_free(d->zbuf);
+    g_free(d->zlen);
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+static int multifd_delta_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct delta_data *d = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t len, zbuf_len = 0;
+    uint8_t *zbuf;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_DELTA) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_DELTA);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    /* read encoded page sizes */
+    len = p->normal_num * sizeof(uint32_t);
+    if (in_size < len) {
+        error_setg(errp, "multifd %u: packet size %u too small for %u pages",
+                   p->id, in_size, p->normal_num);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)d->zlen, len, errp);
+    if (ret != 0) {
+        return ret;
+    }
+    for (i = 0; i < p->normal_num; i++) {
+        d->zlen[i] = be32_to_cpu(d->zlen[i]);
+        if (d->zlen[i] > page_size) {
+            error_setg(errp, "multifd %u: encoded page size %u too big",
+                       p->id, d->zlen[i]);
+            return -1;
+        }
+        zbuf_len += d->zlen[i];
+    }
+    if (in_size != len + zbuf_len) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, in_size, len + zbuf_len);
+        return -1;
+    }
+
+    /* read encoded pages */
+    ret = qio_channel_read_all(p->c, (void *)d->zbuf, zbuf_len, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    zbuf = d->zbuf;
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *page = p->host + p->normal[i];
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (d->zlen[i] == page_size) {
+            memcpy(page, zbuf, page_size);
+        } else if (xbzrle_decode_buffer(zbuf, d->zlen[i], page,
+                                        page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode page at 0x%"
+                       PRIx64, p->id, (uint64_t)p->normal[i]);
+            return -1;
+        }
+        zbuf += d->zlen[i];
+    }
+
+    return 0;
+}
+
+static const MultiFDMethods multifd_delta_ops = {
+    .send_setup = multifd_delta_send_setup,
+    .send_cleanup = multifd_delta_send_cleanup,
+    .send_prepare = multifd_delta_send_prepare,
+    .recv_setup = multifd_delta_recv_setup,
+    .recv_cleanup = multifd_delta_recv_cleanup,
+    .recv = multifd_delta_recv
+};
+
+static void multifd_delta_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_DELTA, &multifd_delta_ops);
+}
+
+migration_init(multifd_delta_register);
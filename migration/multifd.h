@@ -66,6 +66,7 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 #define MULTIFD_FLAG_QATZIP (16 << 1)
+#define MULTIFD_FLAG_DELTA (3 << 1)
 
 /*
  * If set it means that this packet contains device state
@@ -194,6 +194,8 @@ const Property migration_properties[] = {
                         MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
     DEFINE_PROP_MIG_CAP("postcopy-blocktime",
                         MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME),
+    DEFINE_PROP_MIG_CAP("x-postcopy-prefetch",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREFETCH),
     DEFINE_PROP_MIG_CAP("x-colo", MIGRATION_CAPABILITY_X_COLO),
     DEFINE_PROP_MIG_CAP("x-release-ram", MIGRATION_CAPABILITY_RELEASE_RAM),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
@@ -208,6 +210,9 @@ const Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-working-set", MIGRATION_CAPABILITY_WORKING_SET),
+    DEFINE_PROP_MIG_CAP("x-parallel-device-load",
+                        MIGRATION_CAPABILITY_PARALLEL_DEVICE_LOAD),
     DEFINE_PROP_MIG_CAP("x-ignore-shared",
                         MIGRATION_CAPABILITY_X_IGNORE_SHARED),
 };
@@ -357,6 +362,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_parallel_device_load(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_PARALLEL_DEVICE_LOAD];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -378,6 +390,13 @@ bool migrate_postcopy_preempt(void)
     return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
 }
 
+bool migrate_postcopy_prefetch(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH];
+}
+
 bool migrate_postcopy_ram(void)
 {
     MigrationState *s = migrate_get_current();
@@ -420,6 +439,13 @@ bool migrate_validate_uuid(void)
     return s->capabilities[MIGRATION_CAPABILITY_VALIDATE_UUID];
 }
 
+bool migrate_working_set(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_WORKING_SET];
+}
+
 bool migrate_xbzrle(void)
 {
     MigrationState *s = migrate_get_current();
@@ -510,7 +536,8 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
     MIGRATION_CAPABILITY_VALIDATE_UUID,
-    MIGRATION_CAPABILITY_ZERO_COPY_SEND);
+    MIGRATION_CAPABILITY_ZERO_COPY_SEND,
+    MIGRATION_CAPABILITY_WORKING_SET);
 
 /* Snapshot compatibility check list */
 static const
@@ -666,6 +693,13 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH]) {
+        if (!new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy prefetch requires postcopy-ram");
+            return false;
+        }
+    }
+
     if (new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
         if (!migrate_multifd() && migrate_incoming_started()) {
             error_setg(errp, "Multifd must be set before incoming starts");
@@ -1233,6 +1267,14 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
     }
 #endif
 
+    /* Zero pages sent on the main channel would bypass the delta history */
+    if (params->multifd_compression == MULTIFD_COMPRESSION_DELTA &&
+        params->zero_page_detection == ZERO_PAGE_DETECTION_LEGACY) {
+        error_setg(errp, "Multifd delta compression is not compatible "
+                   "with legacy zero page detection");
+        return false;
+    }
+
     if (migrate_mapped_ram() &&
         (migrate_multifd_compression() || migrate_tls())) {
         error_setg(errp,
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -23,11 +23,18 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages an address can be cached in */
+#define CACHE_WAYS 8
+
+/* saturation value of the per-page hit counter */
+#define CACHE_MAX_HITS 15
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_hits;
     uint8_t *it_data;
 };
 
@@ -36,6 +43,8 @@ struct PageCache {
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_ways;
+    size_t num_sets;
 };
 
 PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
@@ -64,6 +73,8 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
     trace_migration_pagecache_init(cache->max_num_items);
 
@@ -79,6 +90,7 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -101,28 +113,81 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Return the first of the num_ways items an address can be cached in */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    size_t i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    return NULL;
+}
 
-    return &cache->page_cache[pos];
+/*
+ * Pick the item of the set that @addr gets cached in.
+ *
+ * Free items are used first.  Otherwise the coldest item that was not
+ * used during the last CACHED_PAGE_LIFETIME generations is replaced, so
+ * pages that keep getting dirtied and encoded stay in the cache.  The hit
+ * counters of the items passed over are halved, so that pages that stop
+ * being written eventually become candidates for replacement.
+ *
+ * Returns NULL if all the items of the set are still fresh.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    size_t i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim || it->it_hits < victim->it_hits ||
+            (it->it_hits == victim->it_hits && it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+
+    for (i = 0; victim && i < cache->num_ways; i++) {
+        if (&set[i] != victim) {
+            set[i].it_hits >>= 1;
+        }
+    }
+
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -132,9 +197,12 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
+    if (it) {
+        /* update the it_age and hotness when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < CACHE_MAX_HITS) {
+            it->it_hits++;
+        }
         return true;
     }
     return false;
@@ -148,11 +216,12 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (!it) {
+            return -1;
+        }
+        it->it_hits = 0;
     }
     /* allocate page */
     if (!it->it_data) {
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +18,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/madvise.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
@@ -208,6 +209,8 @@ typedef struct PostcopyBlocktimeContext {
     uint64_t non_vcpu_faults;
     /* total blocktime when a non-vCPU thread is stopped */
     uint64_t non_vcpu_blocktime_total;
+    /* Count of host pages requested ahead of a fault on them */
+    uint64_t prefetch_pages;
 
     /*
      * Handler for exit event, necessary for
@@ -388,6 +391,10 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     info->postcopy_vcpu_latency = list_latency;
     info->has_postcopy_latency_dist = true;
     info->postcopy_latency_dist = latency_buckets;
+    info->has_postcopy_faults = true;
+    info->postcopy_faults = faults;
+    info->has_postcopy_prefetch_pages = true;
+    info->postcopy_prefetch_pages = bc->prefetch_pages;
 }
 
 static uint64_t get_postcopy_total_blocktime(void)
@@ -1262,6 +1269,171 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
                                  iter.affected_non_cpus);
 }
 
+/*
+ * Postcopy prefetch: the fault thread tracks one stream of faults per
+ * faulting thread.  Once two consecutive faults of a stream are the same
+ * (small) distance apart, the pages that follow along that stride are
+ * requested from the source before the guest touches them.  The request
+ * window grows as long as the stream keeps following the prediction.
+ */
+#define POSTCOPY_PREFETCH_STREAMS     16
+/* Largest distance between two faults of a stream, in host pages */
+#define POSTCOPY_PREFETCH_MAX_STRIDE  16
+/* Largest amount of memory requested ahead of a single fault */
+#define POSTCOPY_PREFETCH_WINDOW      (256 * KiB)
+
+typedef struct PostcopyFaultStream {
+    /* Faulting thread, or 0 if the kernel does not report it */
+    uint32_t tid;
+    RAMBlock *rb;
+    /* Offset of the last fault within @rb */
+    ram_addr_t last;
+    /* Distance between the last two faults, in bytes */
+    int64_t stride;
+    /* Number of consecutive faults that followed @stride */
+    unsigned int hits;
+    /* Furthest page along @stride that was already requested */
+    ram_addr_t ahead;
+    /* Fault count at the last use, to recycle the oldest stream */
+    uint64_t used;
+} PostcopyFaultStream;
+
+typedef struct PostcopyPrefetchState {
+    PostcopyFaultStream streams[POSTCOPY_PREFETCH_STREAMS];
+    uint64_t faults;
+} PostcopyPrefetchState;
+
+static PostcopyFaultStream *
+postcopy_prefetch_stream(PostcopyPrefetchState *ps, RAMBlock *rb,
+                         ram_addr_t offset, uint32_t tid)
+{
+    uint64_t max_stride = POSTCOPY_PREFETCH_MAX_STRIDE * qemu_ram_pagesize(rb);
+    PostcopyFaultStream *s = NULL, *oldest = &ps->streams[0];
+    int i;
+
+    for (i = 0; i < POSTCOPY_PREFETCH_STREAMS; i++) {
+        PostcopyFaultStream *cur = &ps->streams[i];
+
+        /*
+         * Without thread IDs, tell the streams apart by where they are in
+         * guest memory.
+         */
+        if (cur->rb && cur->tid == tid &&
+            (tid || (cur->rb == rb &&
+                     MAX(cur->last, offset) - MIN(cur->last, offset) <=
+                     max_stride))) {
+            s = cur;
+            break;
+        }
+        if (cur->used < oldest->used) {
+            oldest = cur;
+        }
+    }
+
+    if (!s || s->rb != rb) {
+        s = s ?: oldest;
+        *s = (PostcopyFaultStream) {
+            .tid = tid,
+            .rb = rb,
+            .last = offset,
+            .ahead = offset,
+        };
+    }
+    s->used = ps->faults;
+    return s;
+}
+
+static void postcopy_prefetch_request(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
+{
+    PostcopyBlocktimeContext *dc = mis->blocktime_ctx;
+
+    trace_postcopy_prefetch_request(qemu_ram_get_idstr(rb), start, len);
+
+    /* Best effort: a failure will be noticed by the next fault request */
+    if (migrate_send_rp_message_req_pages(mis, rb, start, len)) {
+        return;
+    }
+
+    if (dc) {
+        WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+            dc->prefetch_pages += len / qemu_ram_pagesize(rb);
+        }
+    }
+}
+
+/*
+ * Update the stream of the faulting thread with a fault at @offset of
+ * @rb, and request the pages it is predicted to access next.  Only called
+ * from the fault thread.
+ */
+static void postcopy_prefetch(MigrationIncomingState *mis,
+                              PostcopyPrefetchState *ps, RAMBlock *rb,
+                              ram_addr_t offset, uint32_t tid)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    int64_t max_stride = POSTCOPY_PREFETCH_MAX_STRIDE * pagesize;
+    PostcopyFaultStream *s;
+    ram_addr_t run_start = 0;
+    size_t run_len = 0;
+    int64_t stride, k, depth;
+
+    ps->faults++;
+    s = postcopy_prefetch_stream(ps, rb, offset, tid);
+
+    stride = (int64_t)offset - (int64_t)s->last;
+    if (stride && stride == s->stride) {
+        s->hits++;
+    } else {
+        s->stride = stride;
+        s->hits = 0;
+        s->ahead = offset;
+    }
+    s->last = offset;
+
+    if (!s->hits || stride > max_stride || stride < -max_stride) {
+        return;
+    }
+
+    depth = MIN(2ULL << MIN(s->hits, 16),
+                MAX(POSTCOPY_PREFETCH_WINDOW / pagesize, 1));
+
+    /* Start after the pages already requested for this stream */
+    for (k = MAX(((int64_t)s->ahead - (int64_t)offset) / stride, 0) + 1;
+         k <= depth; k++) {
+        int64_t pos = (int64_t)offset + k * stride;
+
+        if (pos < 0 || (uint64_t)pos >= rb->postcopy_length) {
+            break;
+        }
+        s->ahead = pos;
+
+        if (ramblock_recv_bitmap_test_byte_offset(rb, pos) ||
+            ramblock_page_is_discarded(rb, pos)) {
+            continue;
+        }
+
+        /* Merge contiguous pages into one request */
+        if (run_len && pos == run_start + run_len) {
+            run_len += pagesize;
+        } else if (run_len && pos + pagesize == run_start) {
+            run_start = pos;
+            run_len += pagesize;
+        } else {
+            if (run_len) {
+                postcopy_prefetch_request(mis, rb, run_start, run_len);
+            }
+            run_start = pos;
+            run_len = pagesize;
+        }
+    }
+
+    if (run_len) {
+        postcopy_prefetch_request(mis, rb, run_start, run_len);
+    }
+}
+
 static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 {
     trace_postcopy_pause_fault_thread();
@@ -1275,6 +1447,7 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    g_autofree PostcopyPrefetchState *prefetch = NULL;
     struct uffd_msg msg;
     int ret;
     size_t index;
@@ -1283,6 +1456,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
     mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    if (migrate_postcopy_prefetch()) {
+        prefetch = g_new0(PostcopyPrefetchState, 1);
+    }
     qemu_event_set(&mis->thread_sync_event);
 
     struct pollfd *pfd;
@@ -1400,6 +1576,11 @@ retry:
                 postcopy_pause_fault_thread(mis);
                 goto retry;
             }
+
+            if (prefetch) {
+                postcopy_prefetch(mis, prefetch, rb, rb_offset,
+                                  msg.arg.pagefault.feat.ptid);
+            }
         }
 
         /* Now handle any requests from external processes on shared memory */
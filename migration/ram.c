@@ -434,6 +434,13 @@ struct RAMState {
      * Protected by @bitmap_mutex.
      */
     PageLocationHint page_hint;
+    /*
+     * Working set ordering: whether the search for dirty pages currently
+     * skips the hot pages, and the number of hot pages that were dirty at
+     * the last bitmap sync.  Protected by @bitmap_mutex.
+     */
+    bool skip_hot_pages;
+    uint64_t hot_dirty_pages;
 };
 typedef struct RAMState RAMState;
 
@@ -746,6 +753,40 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     pss->page = find_next_bit(bitmap, size, pss->page);
 }
 
+/**
+ * pss_find_next_cold_dirty: find the next dirty page that is not hot
+ *
+ * Like pss_find_next_dirty(), but skips the pages that the guest dirtied
+ * during each of the last two sync periods, see RAMBlock.hot_bmap.
+ *
+ * @pss: the current page search status
+ */
+static void pss_find_next_cold_dirty(PageSearchStatus *pss)
+{
+    RAMBlock *rb = pss->block;
+    unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long page = pss->page;
+
+    if (!rb->hot_bmap) {
+        pss_find_next_dirty(pss);
+        return;
+    }
+
+    while (page < size) {
+        unsigned long k = BIT_WORD(page);
+        unsigned long bits = rb->bmap[k] & ~rb->hot_bmap[k] &
+                             BITMAP_FIRST_WORD_MASK(page);
+
+        if (bits) {
+            page = k * BITS_PER_LONG + ctzl(bits);
+            break;
+        }
+        page = (k + 1) * BITS_PER_LONG;
+    }
+
+    pss->page = MIN(page, size);
+}
+
 static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
                                                        unsigned long page)
 {
@@ -961,15 +1002,23 @@ static uint64_t physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
         for (k = page; k < page + nr; k++) {
+            unsigned long bits = 0;
+
             if (src[idx][offset]) {
-                unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
+
+                bits = qatomic_xchg(&src[idx][offset], 0);
                 new_dirty = ~dest[k];
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
             }
 
+            if (rb->hot_bmap) {
+                rb->hot_bmap[k] = rb->last_dirty_bmap[k] & bits;
+                rb->last_dirty_bmap[k] = bits;
+            }
+
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
@@ -1012,6 +1061,23 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/* Returns the number of dirty pages of @rb that are hot */
+static uint64_t ramblock_count_hot_dirty_pages(RAMBlock *rb)
+{
+    unsigned long k, nr = BITS_TO_LONGS(rb->used_length >> TARGET_PAGE_BITS);
+    uint64_t count = 0;
+
+    if (!rb->hot_bmap) {
+        return 0;
+    }
+
+    for (k = 0; k < nr; k++) {
+        count += ctpopl(rb->bmap[k] & rb->hot_bmap[k]);
+    }
+
+    return count;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1147,15 +1213,22 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
+            rs->hot_dirty_pages = 0;
             RAMBLOCK_FOREACH_NOT_IGNORED(block) {
                 ramblock_sync_dirty_bitmap(rs, block);
+                rs->hot_dirty_pages += ramblock_count_hot_dirty_pages(block);
             }
             qatomic_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
+        /* Each pass after a sync sends the cold pages first */
+        rs->skip_hot_pages = rs->hot_dirty_pages && !last_stage;
     }
 
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    if (migrate_working_set()) {
+        trace_migration_bitmap_sync_hot(rs->hot_dirty_pages);
+    }
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1370,11 +1443,29 @@ static int ram_save_multifd_page(RAMBlock *block, ram_addr_t offset)
  */
 static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
 {
+    bool skip_hot = rs->skip_hot_pages && !migration_in_postcopy();
+
     /* Update pss->page for the next dirty bit in ramblock */
-    pss_find_next_dirty(pss);
+    if (skip_hot) {
+        pss_find_next_cold_dirty(pss);
+    } else {
+        pss_find_next_dirty(pss);
+    }
 
     if (pss->complete_round && pss->block == rs->last_seen_block &&
         pss->page >= rs->last_page) {
+        /*
+         * All cold pages have been sent.  The hot ones are left for the
+         * switchover as long as they fit in the downtime limit, because
+         * the guest is likely to dirty them again before that.  Otherwise
+         * go around once more to send them as well.
+         */
+        if (skip_hot && rs->hot_dirty_pages * TARGET_PAGE_SIZE >
+                        migrate_get_current()->threshold_size) {
+            rs->skip_hot_pages = false;
+            pss->complete_round = false;
+            return PAGE_TRY_AGAIN;
+        }
         /*
          * We've been once around the RAM and haven't found anything.
          * Give up.
@@ -2456,6 +2547,10 @@ static void ram_bitmaps_destroy(void)
         block->bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
+        g_free(block->last_dirty_bmap);
+        block->last_dirty_bmap = NULL;
+        g_free(block->hot_bmap);
+        block->hot_bmap = NULL;
     }
 }
 
@@ -2852,6 +2947,10 @@ static void ram_list_init_bitmaps(void)
             if (migrate_mapped_ram()) {
                 block->file_bmap = bitmap_new(pages);
             }
+            if (migrate_working_set()) {
+                block->last_dirty_bmap = bitmap_new(pages);
+                block->hot_bmap = bitmap_new(pages);
+            }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
         }
@@ -142,6 +142,13 @@ static void qemu_loadvm_thread_pool_create(MigrationIncomingState *mis)
     assert(!mis->load_threads);
     mis->load_threads = thread_pool_new();
     mis->load_threads_abort = false;
+
+    if (migrate_parallel_device_load()) {
+        assert(!mis->device_load_threads);
+        mis->device_load_threads = thread_pool_new();
+        thread_pool_set_max_threads(mis->device_load_threads,
+                                    g_get_num_processors());
+    }
 }
 
 static void qemu_loadvm_thread_pool_destroy(MigrationIncomingState *mis)
@@ -151,6 +158,10 @@ static void qemu_loadvm_thread_pool_destroy(MigrationIncomingState *mis)
     bql_unlock(); /* Load threads might be waiting for BQL */
     g_clear_pointer(&mis->load_threads, thread_pool_free);
     bql_lock();
+
+    /* Parallel device loads are always waited for in qemu_loadvm_state_main */
+    assert(!mis->device_load_jobs);
+    g_clear_pointer(&mis->device_load_threads, thread_pool_free);
 }
 
 static bool qemu_loadvm_thread_pool_wait(MigrationState *s,
@@ -994,7 +1005,8 @@ static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se,
 }
 
 /*
- * Write the header for device section (QEMU_VM_SECTION START/END/PART/FULL)
+ * Write the header for device section
+ * (QEMU_VM_SECTION START/END/PART/FULL/BUFFERED)
  */
 static void save_section_header(QEMUFile *f, SaveStateEntry *se,
                                 uint8_t section_type)
@@ -1003,6 +1015,7 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
+        section_type == QEMU_VM_SECTION_BUFFERED ||
         section_type == QEMU_VM_SECTION_START) {
         /* ID string */
         size_t len = strlen(se->idstr);
@@ -1026,9 +1039,39 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/*
+ * The destination can only wait for the sections that @se is loaded after
+ * if they come first in the stream, check that none of them is sent later.
+ */
+static bool vmstate_check_load_after(SaveStateEntry *se, Error **errp)
+{
+    const VMStateDescription * const *dep;
+    SaveStateEntry *later;
+
+    for (later = QTAILQ_NEXT(se, entry); later;
+         later = QTAILQ_NEXT(later, entry)) {
+        /* early_setup sections are sent before all others */
+        if (!later->vmsd || later->vmsd->early_setup) {
+            continue;
+        }
+        for (dep = se->vmsd->load_after; *dep; dep++) {
+            if (later->vmsd == *dep &&
+                vmstate_section_needed(later->vmsd, later->opaque)) {
+                error_setg(errp, "Section %s is loaded after section %s, "
+                           "but is sent before it", se->idstr, later->idstr);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 static int vmstate_save(QEMUFile *f, SaveStateEntry *se, JSONWriter *vmdesc,
                         Error **errp)
 {
+    QIOChannelBuffer *bioc = NULL;
+    QEMUFile *sf = f;
     int ret;
 
     if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
@@ -1038,9 +1081,25 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, JSONWriter *vmdesc,
         trace_savevm_section_skip(se->idstr, se->section_id);
         return 0;
     }
+    if (se->vmsd && se->vmsd->load_after && migrate_parallel_device_load() &&
+        !vmstate_check_load_after(se, errp)) {
+        return -EINVAL;
+    }
 
     trace_savevm_section_start(se->idstr, se->section_id);
-    save_section_header(f, se, QEMU_VM_SECTION_FULL);
+    if (se->vmsd && se->vmsd->parallel_load &&
+        migrate_parallel_device_load()) {
+        /*
+         * Collect the state first, so that it can be sent with its length
+         * and the destination can hand it over to a load thread.
+         */
+        bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(bioc), "migration-savevm-buffered");
+        sf = qemu_file_new_output(QIO_CHANNEL(bioc));
+        object_unref(OBJECT(bioc));
+    } else {
+        save_section_header(f, se, QEMU_VM_SECTION_FULL);
+    }
     if (vmdesc) {
         json_writer_start_object(vmdesc, NULL);
         json_writer_str(vmdesc, "name", se->idstr);
@@ -1049,15 +1108,26 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, JSONWriter *vmdesc,
 
     trace_vmstate_save(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {
-        vmstate_save_old_style(f, se, vmdesc);
+        vmstate_save_old_style(sf, se, vmdesc);
     } else {
-        ret = vmstate_save_state(f, se->vmsd, se->opaque, vmdesc,
+        ret = vmstate_save_state(sf, se->vmsd, se->opaque, vmdesc,
                                  errp);
         if (ret) {
+            if (sf != f) {
+                qemu_fclose(sf);
+            }
             return ret;
         }
     }
 
+    if (sf != f) {
+        qemu_fflush(sf);
+        save_section_header(f, se, QEMU_VM_SECTION_BUFFERED);
+        qemu_put_be32(f, bioc->usage);
+        qemu_put_buffer(f, bioc->data, bioc->usage);
+        qemu_fclose(sf);
+    }
+
     trace_savevm_section_end(se->idstr, se->section_id, 0);
     save_section_footer(f, se);
     if (vmdesc) {
@@ -2229,7 +2299,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -2613,6 +2684,184 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
+/***********************************************************/
+/* Parallel device state load support */
+
+typedef struct DeviceLoadJob {
+    SaveStateEntry *se;
+    QEMUFile *f;
+    bool parallel;
+    int ret;
+    Error *err;
+} DeviceLoadJob;
+
+static int qemu_loadvm_device_load_thread(void *opaque)
+{
+    DeviceLoadJob *job = opaque;
+    SaveStateEntry *se = job->se;
+    int64_t start_ts, end_ts;
+
+    start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    job->ret = vmstate_load(job->f, se, &job->err);
+    if (job->ret < 0) {
+        error_prepend(&job->err,
+                      "error while loading state for instance 0x%"PRIx32" of"
+                      " device '%s': ", se->instance_id, se->idstr);
+        return 0;
+    }
+
+    end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    trace_vmstate_downtime_load(job->parallel ? "non-iterable-parallel" :
+                                "non-iterable", se->idstr, se->instance_id,
+                                end_ts - start_ts);
+    return 0;
+}
+
+static int qemu_loadvm_device_load_finish(DeviceLoadJob *job, Error **errp)
+{
+    int ret = job->ret;
+
+    if (ret < 0) {
+        error_propagate(errp, job->err);
+    }
+    qemu_fclose(job->f);
+    g_free(job);
+
+    return ret;
+}
+
+/*
+ * Wait for all the sections submitted to the device load threads.
+ *
+ * Returns: 0 on success, or the error of the first failed section in
+ *          stream order
+ */
+static int qemu_loadvm_device_load_wait(MigrationIncomingState *mis,
+                                        Error **errp)
+{
+    int64_t start_ts, end_ts;
+    GSList *jobs, *l;
+    int ret = 0;
+
+    if (!mis->device_load_jobs) {
+        return 0;
+    }
+
+    start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    thread_pool_wait(mis->device_load_threads);
+    end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    jobs = g_slist_reverse(mis->device_load_jobs);
+    mis->device_load_jobs = NULL;
+    trace_loadvm_device_load_wait(g_slist_length(jobs), end_ts - start_ts);
+
+    for (l = jobs; l; l = l->next) {
+        int job_ret = qemu_loadvm_device_load_finish(l->data,
+                                                     ret ? NULL : errp);
+        if (!ret) {
+            ret = job_ret;
+        }
+    }
+    g_slist_free(jobs);
+
+    return ret;
+}
+
+/*
+ * Wait for the in-flight sections that @se declared to be loaded after.
+ * The source makes sure that these sections come first in the stream, see
+ * vmstate_check_load_after(), so the ones that are not in flight anymore
+ * are already loaded.
+ */
+static int qemu_loadvm_device_load_deps(MigrationIncomingState *mis,
+                                        SaveStateEntry *se, Error **errp)
+{
+    const VMStateDescription * const *dep;
+    GSList *l;
+
+    if (!se->vmsd || !se->vmsd->load_after) {
+        return 0;
+    }
+
+    for (l = mis->device_load_jobs; l; l = l->next) {
+        DeviceLoadJob *job = l->data;
+
+        for (dep = se->vmsd->load_after; *dep; dep++) {
+            if (job->se->vmsd == *dep) {
+                return qemu_loadvm_device_load_wait(mis, errp);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Read the payload of a QEMU_VM_SECTION_BUFFERED section and load it,
+ * on a device load thread if the device supports it.
+ */
+static int qemu_loadvm_section_buffered(QEMUFile *f, SaveStateEntry *se,
+                                        Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelBuffer *bioc;
+    DeviceLoadJob *job;
+    uint32_t length;
+    int ret;
+
+    length = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        error_setg(errp, "Failed to read length of section %s: %d",
+                   se->idstr, ret);
+        return ret;
+    }
+
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-loadvm-buffered");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_setg(errp, "Buffered section %s receive fail ret=%d length=%u",
+                   se->idstr, ret, length);
+        return (ret < 0) ? ret : -EAGAIN;
+    }
+    bioc->usage = length;
+
+    job = g_new0(DeviceLoadJob, 1);
+    job->se = se;
+    job->f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    job->parallel = mis->device_load_threads && se->vmsd &&
+                    se->vmsd->parallel_load;
+    object_unref(OBJECT(bioc));
+
+    if (!check_section_footer(f, se)) {
+        qemu_loadvm_device_load_finish(job, NULL);
+        error_setg(errp, "Section footer error, section_id: %d",
+                   se->load_section_id);
+        return -EINVAL;
+    }
+
+    ret = qemu_loadvm_device_load_deps(mis, se, errp);
+    if (ret < 0) {
+        qemu_loadvm_device_load_finish(job, NULL);
+        return ret;
+    }
+
+    if (!job->parallel) {
+        qemu_loadvm_device_load_thread(job);
+        return qemu_loadvm_device_load_finish(job, errp);
+    }
+
+    trace_loadvm_device_load_submit(se->idstr, se->instance_id, length);
+    mis->device_load_jobs = g_slist_prepend(mis->device_load_jobs, job);
+    thread_pool_submit(mis->device_load_threads,
+                       qemu_loadvm_device_load_thread, job, NULL);
+
+    return 0;
+}
+
 static int
 qemu_loadvm_section_start_full(QEMUFile *f, uint8_t type, Error **errp)
 {
@@ -2667,6 +2916,16 @@ qemu_loadvm_section_start_full(QEMUFile *f, uint8_t type, Error **errp)
         return -EINVAL;
     }
 
+    if (type == QEMU_VM_SECTION_BUFFERED) {
+        return qemu_loadvm_section_buffered(f, se, errp);
+    }
+
+    ret = qemu_loadvm_device_load_deps(migration_incoming_get_current(), se,
+                                       errp);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (trace_downtime) {
         start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     }
@@ -2984,9 +3243,19 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_FULL &&
+            section_type != QEMU_VM_SECTION_BUFFERED) {
+            /* Only device state sections may overlap with parallel loads */
+            ret = qemu_loadvm_device_load_wait(mis, errp);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
+        case QEMU_VM_SECTION_BUFFERED:
             ret = qemu_loadvm_section_start_full(f, section_type, errp);
             if (ret < 0) {
                 goto out;
@@ -3018,6 +3287,8 @@ retry:
 
 out:
     if (ret < 0) {
+        /* Don't leave any load thread running behind a failed stream */
+        qemu_loadvm_device_load_wait(mis, NULL);
         qemu_file_set_error(f, ret);
 
         /* Cancel bitmaps incoming regardless of recovery */
@@ -87,6 +87,7 @@ enum {
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
     OPTION_LIMITS = 278,
+    OPTION_NO_COPY_RANGE = 279,
 };
 
 typedef enum OutputFormat {
@@ -1675,6 +1676,10 @@ typedef struct ImgConvertState {
     int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
+    /* Cached block status of s->src[status_src], queried in batches */
+    BlockStatusExtent status_extents[BDRV_BLOCK_STATUS_BATCH];
+    int status_src;
+    int status_nb;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1709,6 +1714,49 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+/*
+ * Like bdrv_block_status_above(), but look the status up in extents that
+ * were queried in a batch for the rest of the source image, so that only
+ * one block status request is needed for many iterations.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+convert_block_status(ImgConvertState *s, int src_cur, BlockDriverState *base,
+                     int64_t offset, int64_t bytes, int64_t *pnum)
+{
+    BlockDriverState *src_bs = blk_bs(s->src[src_cur]);
+    int64_t src_size = s->src_sectors[src_cur] * BDRV_SECTOR_SIZE;
+    BlockStatusExtent *e;
+    int i, ret;
+
+    if (s->status_src != src_cur || !s->status_nb ||
+        offset < s->status_extents[0].offset ||
+        offset >= s->status_extents[s->status_nb - 1].offset +
+                  s->status_extents[s->status_nb - 1].bytes) {
+        s->status_src = src_cur;
+        ret = bdrv_block_status_above_batch(src_bs, base, offset,
+                                            src_size - offset,
+                                            s->status_extents,
+                                            BDRV_BLOCK_STATUS_BATCH);
+        s->status_nb = MAX(ret, 0);
+        if (ret <= 0) {
+            /* Let the caller deal with errors on the exact range */
+            return bdrv_block_status_above(src_bs, base, offset, bytes, pnum,
+                                           NULL, NULL);
+        }
+    }
+
+    for (i = 0; i < s->status_nb; i++) {
+        e = &s->status_extents[i];
+        if (offset < e->offset + e->bytes) {
+            break;
+        }
+    }
+    assert(i < s->status_nb && offset >= e->offset);
+
+    *pnum = MIN(e->offset + e->bytes - offset, bytes);
+    return e->ret;
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
 convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
@@ -1747,8 +1795,8 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         do {
             count = n * BDRV_SECTOR_SIZE;
 
-            ret = bdrv_block_status_above(src_bs, base, offset, count, &count,
-                                          NULL, NULL);
+            ret = convert_block_status(s, src_cur, base, offset, count,
+                                       &count);
 
             if (ret < 0) {
                 if (s->salvage) {
@@ -1987,7 +2035,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
-        bool copy_range;
+        bool copy_range, try_copy_range = true;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -2020,7 +2068,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && try_copy_range &&
+                     s->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -2047,7 +2096,11 @@ retry:
                 WITH_GRAPH_RDLOCK_GUARD() {
                     ret = convert_co_copy_range(s, sector_num, n);
                 }
-                if (ret) {
+                if (ret == -ENOSPC) {
+                    /* No progress for this extent only, copy it ourselves */
+                    try_copy_range = false;
+                    goto retry;
+                } else if (ret) {
                     s->copy_range = false;
                     goto retry;
                 }
@@ -2227,6 +2280,22 @@ static void set_rate_limit(BlockBackend *blk, int64_t rate_limit)
     blk_set_io_limits(blk, &cfg);
 }
 
+static bool convert_is_raw_to_raw(ImgConvertState *s,
+                                  BlockDriverState *out_bs)
+{
+    int i;
+
+    if (out_bs->drv != &bdrv_raw) {
+        return false;
+    }
+    for (i = 0; i < s->src_num; i++) {
+        if (blk_bs(s->src[i])->drv != &bdrv_raw) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
 {
     int c, bs_i, flags, src_flags = BDRV_O_NO_SHARE;
@@ -2247,6 +2316,7 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
     int64_t ret = -EINVAL;
     bool force_share = false;
     bool explict_min_sparse = false;
+    int copy_range = -1;
     bool bitmaps = false;
     bool skip_broken = false;
     int64_t rate_limit = 0;
@@ -2254,7 +2324,6 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
         .min_sparse         = 8,
-        .copy_range         = false,
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
@@ -2290,6 +2359,7 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
             {"parallel", required_argument, 0, 'm'},
             {"oob-writes", no_argument, 0, 'W'},
             {"copy-range-offloading", no_argument, 0, 'C'},
+            {"no-copy-range-offloading", no_argument, 0, OPTION_NO_COPY_RANGE},
             {"progress", no_argument, 0, 'p'},
             {"quiet", no_argument, 0, 'q'},
             {"object", required_argument, 0, OPTION_OBJECT},
@@ -2307,7 +2377,8 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
 "        [-O TGT_FMT | --target-image-opts] [-o TGT_FMT_OPTS] [-t TGT_CACHE]\n"
 "        [-b BACKING_FILE [-F BACKING_FMT]] [-S SPARSE_SIZE]\n"
 "        [-n] [--target-is-zero] [-c]\n"
-"        [-U] [-r RATE] [-m NUM_PARALLEL] [-W] [-C] [-p] [-q] [--object OBJDEF]\n"
+"        [-U] [-r RATE] [-m NUM_PARALLEL] [-W] [-C | --no-copy-range-offloading]\n"
+"        [-p] [-q] [--object OBJDEF]\n"
 "        SRC_FILE [SRC_FILE2...] TGT_FILE\n"
 ,
 "  -f, --source-format SRC_FMT\n"
@@ -2355,6 +2426,9 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
 "     specify parallelism (default: 8)\n"
 "  -C, --copy-range-offloading\n"
 "     try to use copy offloading\n"
+"     (default between raw images, unless -c, -S or --salvage is given)\n"
+"  --no-copy-range-offloading\n"
+"     always copy data through qemu-img buffers\n"
 "  -W, --oob-writes\n"
 "     enable out-of-order writes to improve performance\n"
 "  -p, --progress\n"
@@ -2477,7 +2551,10 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
             s.wr_in_order = false;
             break;
         case 'C':
-            s.copy_range = true;
+            copy_range = true;
+            break;
+        case OPTION_NO_COPY_RANGE:
+            copy_range = false;
             break;
         case 'p':
             progress = true;
@@ -2502,17 +2579,17 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
         goto fail_getopt;
     }
 
-    if (s.compressed && s.copy_range) {
+    if (s.compressed && copy_range > 0) {
         error_report("Cannot enable copy offloading when -c is used");
         goto fail_getopt;
     }
 
-    if (explict_min_sparse && s.copy_range) {
+    if (explict_min_sparse && copy_range > 0) {
         error_report("Cannot enable copy offloading when -S is used");
         goto fail_getopt;
     }
 
-    if (s.copy_range && s.salvage) {
+    if (copy_range > 0 && s.salvage) {
         error_report("Cannot use copy offloading in salvaging mode");
         goto fail_getopt;
     }
@@ -2860,6 +2937,20 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (copy_range < 0) {
+        /*
+         * Copy offloading skips the detection of zeroes inside data
+         * extents, so only try it by default when the data does not need
+         * to go through our own buffers and no format layer can turn
+         * zeroes into holes: between raw images, which keep the holes of
+         * the source.  Unsupported setups fall back to read/write after
+         * the first failed request.
+         */
+        copy_range = !s.compressed && !explict_min_sparse && !s.salvage &&
+                     convert_is_raw_to_raw(&s, out_bs);
+    }
+    s.copy_range = copy_range;
+
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
     }
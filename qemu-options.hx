@@ -235,6 +235,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                victim-tlb-size=n (TCG victim TLB entries per MMU mode)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -278,6 +279,13 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``victim-tlb-size=n``
+        Controls the number of entries in the victim TLB that backs each
+        softmmu TLB of a TCG vCPU. The victim TLB is 8-way set associative;
+        ``n`` must be a power of two between 8 (the default, a single fully
+        associative set) and 65536. Larger values can help guests whose
+        working set thrashes the main TLB, at the cost of memory.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
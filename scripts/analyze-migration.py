@@ -673,6 +673,7 @@ class MigrationDump(object):
     QEMU_VM_VMDESCRIPTION = 0x06
     QEMU_VM_CONFIGURATION = 0x07
     QEMU_VM_COMMAND       = 0x08
+    QEMU_VM_SECTION_BUFFERED = 0x09
     QEMU_VM_SECTION_FOOTER= 0x7e
     QEMU_MIG_CMD_SWITCHOVER_START = 0x0b
 
@@ -728,11 +729,14 @@ def read(self, desc_only = False, dump_memory = False,
                 section.read()
                 ramargs['ignore_shared'] = section.has_capability('x-ignore-shared')
                 ramargs['mapped_ram'] = section.has_capability('mapped-ram')
-            elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL:
+            elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL or section_type == self.QEMU_VM_SECTION_BUFFERED:
                 section_id = file.read32()
                 name = file.readstr()
                 instance_id = file.read32()
                 version_id = file.read32()
+                if section_type == self.QEMU_VM_SECTION_BUFFERED:
+                    # Length of the section data that follows
+                    file.read32()
                 section_key = (name, instance_id)
                 classdesc = self.section_classes[section_key]
                 section = classdesc[0](file, version_id, classdesc[1], section_key)
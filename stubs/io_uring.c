@@ -0,0 +1,31 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/aio.h"
+#include "block/raw-aio.h"
+
+void luring_poll_detach_aio_context(LuringPollState *s,
+                                    AioContext *old_context)
+{
+    abort();
+}
+
+void luring_poll_attach_aio_context(LuringPollState *s,
+                                    AioContext *new_context)
+{
+    abort();
+}
+
+LuringPollState *luring_poll_init(bool sqpoll, Error **errp)
+{
+    abort();
+}
+
+void luring_poll_cleanup(LuringPollState *s)
+{
+    abort();
+}
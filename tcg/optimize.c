@@ -38,6 +38,19 @@ typedef struct MemCopyInfo {
     TCGType type;
 } MemCopyInfo;
 
+/*
+ * A store to env which has not yet been observed by any load,
+ * helper call, or guest memory operation.  If a later store in
+ * the same basic block overwrites all of its bytes, it is dead.
+ */
+typedef struct EnvStoreInfo {
+    TCGOp *op;
+    intptr_t start;
+    intptr_t last;
+} EnvStoreInfo;
+
+#define MAX_ENV_STORES  16
+
 typedef struct TempOptInfo {
     TCGTemp *prev_copy;
     TCGTemp *next_copy;
@@ -55,6 +68,9 @@ typedef struct OptContext {
     IntervalTreeRoot mem_copy;
     QSIMPLEQ_HEAD(, MemCopyInfo) mem_free;
 
+    EnvStoreInfo env_st[MAX_ENV_STORES];
+    int nb_env_st;
+
     /* In flight values from optimization. */
     TCGType type;
     int carry_state;  /* -1 = non-constant, {0,1} = constant carry-in */
@@ -192,6 +208,51 @@ static void remove_mem_copy_all(OptContext *ctx)
     tcg_debug_assert(interval_tree_is_empty(&ctx->mem_copy));
 }
 
+static void forget_env_stores_in(OptContext *ctx, intptr_t s, intptr_t l)
+{
+    int i, j;
+
+    for (i = j = 0; i < ctx->nb_env_st; i++) {
+        EnvStoreInfo *es = &ctx->env_st[i];
+        if (es->last < s || es->start > l) {
+            ctx->env_st[j++] = *es;
+        }
+    }
+    ctx->nb_env_st = j;
+}
+
+static void forget_env_stores(OptContext *ctx)
+{
+    ctx->nb_env_st = 0;
+}
+
+/*
+ * OP stores to env bytes [S, L].  Remove any earlier store that it
+ * completely overwrites, then remember OP in turn.
+ */
+static void record_env_store(OptContext *ctx, TCGOp *op,
+                             intptr_t s, intptr_t l)
+{
+    int i, j;
+
+    for (i = j = 0; i < ctx->nb_env_st; i++) {
+        EnvStoreInfo *es = &ctx->env_st[i];
+        if (es->start >= s && es->last <= l) {
+            tcg_op_remove(ctx->tcg, es->op);
+        } else {
+            ctx->env_st[j++] = *es;
+        }
+    }
+    if (j == MAX_ENV_STORES) {
+        /* Drop the oldest entry; that store simply stays live. */
+        memmove(&ctx->env_st[0], &ctx->env_st[1],
+                (MAX_ENV_STORES - 1) * sizeof(EnvStoreInfo));
+        j--;
+    }
+    ctx->env_st[j] = (EnvStoreInfo){ .op = op, .start = s, .last = l };
+    ctx->nb_env_st = j + 1;
+}
+
 static TCGTemp *find_better_copy(TCGTemp *ts)
 {
     TCGTemp *i, *ret;
@@ -379,6 +440,7 @@ static bool tcg_opt_gen_mov(OptContext *ctx, TCGOp *op, TCGArg dst, TCGArg src)
     case TCG_TYPE_V64:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         /* TCGOP_TYPE and TCGOP_VECE remain unchanged.  */
         new_op = INDEX_op_mov_vec;
         break;
@@ -1037,6 +1099,7 @@ static bool fold_to_not(OptContext *ctx, TCGOp *op, int idx)
     case TCG_TYPE_V64:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         not_op = INDEX_op_not_vec;
         have_not = TCG_TARGET_HAS_not_vec;
         break;
@@ -1382,6 +1445,7 @@ static bool fold_andc(OptContext *ctx, TCGOp *op)
         case TCG_TYPE_V64:
         case TCG_TYPE_V128:
         case TCG_TYPE_V256:
+        case TCG_TYPE_V512:
             op->opc = INDEX_op_and_vec;
             break;
         default:
@@ -1539,6 +1603,9 @@ static bool fold_call(OptContext *ctx, TCGOp *op)
     init_arguments(ctx, op, nb_oargs + nb_iargs);
     copy_propagate(ctx, op, nb_oargs, nb_iargs);
 
+    /* Any helper may read env or raise an exception. */
+    forget_env_stores(ctx);
+
     /* If the function reads or writes globals, reset temp data. */
     flags = tcg_call_flags(op);
     if (!(flags & (TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_WRITE_GLOBALS))) {
@@ -1736,6 +1803,7 @@ static bool fold_eqv(OptContext *ctx, TCGOp *op)
         case TCG_TYPE_V64:
         case TCG_TYPE_V128:
         case TCG_TYPE_V256:
+        case TCG_TYPE_V512:
             op->opc = INDEX_op_xor_vec;
             break;
         default:
@@ -2112,6 +2180,7 @@ static bool fold_orc(OptContext *ctx, TCGOp *op)
         case TCG_TYPE_V64:
         case TCG_TYPE_V128:
         case TCG_TYPE_V256:
+        case TCG_TYPE_V512:
             op->opc = INDEX_op_or_vec;
             break;
         default:
@@ -2460,6 +2529,7 @@ static bool fold_sub_to_neg(OptContext *ctx, TCGOp *op)
     case TCG_TYPE_V64:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         neg_op = INDEX_op_neg_vec;
         have_neg = (TCG_TARGET_HAS_neg_vec &&
                     tcg_can_emit_vec_op(neg_op, ctx->type, TCGOP_VECE(op)) > 0);
@@ -2647,30 +2717,43 @@ static bool fold_subbo(OptContext *ctx, TCGOp *op)
 static bool fold_tcg_ld(OptContext *ctx, TCGOp *op)
 {
     uint64_t z_mask = -1, s_mask = 0;
+    intptr_t lm1;
 
     /* We can't do any folding with a load, but we can record bits. */
     switch (op->opc) {
     case INDEX_op_ld8s:
         s_mask = INT8_MIN;
+        lm1 = 0;
         break;
     case INDEX_op_ld8u:
         z_mask = MAKE_64BIT_MASK(0, 8);
+        lm1 = 0;
         break;
     case INDEX_op_ld16s:
         s_mask = INT16_MIN;
+        lm1 = 1;
         break;
     case INDEX_op_ld16u:
         z_mask = MAKE_64BIT_MASK(0, 16);
+        lm1 = 1;
         break;
     case INDEX_op_ld32s:
         s_mask = INT32_MIN;
+        lm1 = 3;
         break;
     case INDEX_op_ld32u:
         z_mask = MAKE_64BIT_MASK(0, 32);
+        lm1 = 3;
         break;
     default:
         g_assert_not_reached();
     }
+
+    if (op->args[1] == tcgv_ptr_arg(tcg_env)) {
+        forget_env_stores_in(ctx, op->args[2], op->args[2] + lm1);
+    } else {
+        forget_env_stores(ctx);
+    }
     return fold_masks_zs(ctx, op, z_mask, s_mask);
 }
 
@@ -2681,11 +2764,14 @@ static bool fold_tcg_ld_memcopy(OptContext *ctx, TCGOp *op)
     TCGType type;
 
     if (op->args[1] != tcgv_ptr_arg(tcg_env)) {
+        forget_env_stores(ctx);
         return finish_folding(ctx, op);
     }
 
     type = ctx->type;
     ofs = op->args[2];
+    forget_env_stores_in(ctx, ofs, ofs + tcg_type_size(type) - 1);
+
     dst = arg_temp(op->args[0]);
     src = find_mem_copy_for(ctx, type, ofs);
     if (src && src->base_type == type) {
@@ -2725,6 +2811,7 @@ static bool fold_tcg_st(OptContext *ctx, TCGOp *op)
         g_assert_not_reached();
     }
     remove_mem_copy_in(ctx, ofs, ofs + lm1);
+    record_env_store(ctx, op, ofs, ofs + lm1);
     return true;
 }
 
@@ -2757,6 +2844,7 @@ static bool fold_tcg_st_memcopy(OptContext *ctx, TCGOp *op)
     last = ofs + tcg_type_size(type) - 1;
     remove_mem_copy_in(ctx, ofs, last);
     record_mem_copy(ctx, type, src, ofs, last);
+    record_env_store(ctx, op, ofs, last);
     return true;
 }
 
@@ -2813,6 +2901,18 @@ void tcg_optimize(TCGContext *s)
         }
 
         def = &tcg_op_defs[opc];
+
+        /*
+         * Anything which may observe env, or which may leave the TB
+         * with env visible to the rest of qemu, keeps prior stores live.
+         */
+        if ((def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                           TCG_OPF_SIDE_EFFECTS)) ||
+            opc == INDEX_op_plugin_cb ||
+            opc == INDEX_op_plugin_mem_cb ||
+            opc == INDEX_op_dupm_vec) {
+            forget_env_stores(&ctx);
+        }
         init_arguments(&ctx, op, def->nb_oargs + def->nb_iargs);
         copy_propagate(&ctx, op, def->nb_oargs, def->nb_iargs);
 
@@ -29,6 +29,7 @@
 #include "qemu/memalign.h"
 #include "qemu/cacheinfo.h"
 #include "qemu/qtree.h"
+#include "qemu/bitmap.h"
 #include "qapi/error.h"
 #include "tcg/tcg.h"
 #include "exec/translation-block.h"
@@ -70,10 +71,17 @@ struct tcg_region_state {
     size_t total_size; /* size of entire buffer, >= n * stride */
 
     /* fields protected by the lock */
-    size_t current; /* current region index */
+    uint64_t *alloc_gen; /* per-region allocation order; 0 if free */
+    uint64_t last_gen; /* allocation counter */
     size_t agg_size_full; /* aggregate size of full regions */
 };
 
+/*
+ * At most 1/TCG_REGION_RECLAIM_DIV of the regions are recycled by a
+ * single call to tcg_region_reclaim().
+ */
+#define TCG_REGION_RECLAIM_DIV 4
+
 static struct tcg_region_state region;
 
 /*
@@ -191,10 +199,23 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+/* @p must point into the rw view of code_gen_buffer */
+static size_t tc_ptr_to_region_idx(const void *p)
 {
-    size_t region_idx;
+    ptrdiff_t offset;
+
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
 
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+{
     /*
      * Like tcg_splitwx_to_rw, with no assert.  The pc may come from
      * a signal handler over which the caller has no control.
@@ -205,19 +226,7 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
             return NULL;
         }
     }
-
-    if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
-    }
-    return region_trees + region_idx * tree_size;
+    return region_trees + tc_ptr_to_region_idx(p) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
@@ -359,12 +368,16 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
-        return true;
+    size_t i;
+
+    for (i = 0; i < region.n; i++) {
+        if (region.alloc_gen[i] == 0) {
+            tcg_region_assign(s, i);
+            region.alloc_gen[i] = ++region.last_gen;
+            return false;
+        }
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
-    return false;
+    return true;
 }
 
 /*
@@ -410,7 +423,8 @@ void tcg_region_reset_all(void)
     unsigned int i;
 
     qemu_mutex_lock(&region.lock);
-    region.current = 0;
+    memset(region.alloc_gen, 0, region.n * sizeof(*region.alloc_gen));
+    region.last_gen = 0;
     region.agg_size_full = 0;
 
     for (i = 0; i < n_ctxs; i++) {
@@ -422,6 +436,95 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+static gboolean tcg_region_collect_tb(gpointer key, gpointer value,
+                                      gpointer data)
+{
+    g_ptr_array_add(data, value);
+    return FALSE;
+}
+
+/*
+ * Recycle the least recently allocated regions, leaving alone those that
+ * are currently assigned to a TCG context.  @func is called on every TB
+ * found in the chosen regions, so that the caller can unlink them, before
+ * the regions are emptied and made available to tcg_region_alloc().
+ *
+ * Call from a safe-work context.  Returns the number of regions reclaimed;
+ * if zero, nothing has been done and the caller should fall back to
+ * tcg_region_reset_all().
+ */
+size_t tcg_region_reclaim(void (*func)(TranslationBlock *tb))
+{
+    unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
+    size_t max = DIV_ROUND_UP(region.n, TCG_REGION_RECLAIM_DIV);
+    g_autofree size_t *victims = g_new(size_t, max);
+    g_autofree unsigned long *busy = bitmap_new(region.n);
+    g_autoptr(GPtrArray) tbs = g_ptr_array_new();
+    size_t n_victims = 0;
+    size_t i;
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < n_ctxs; i++) {
+        const TCGContext *s = qatomic_read(&tcg_ctxs[i]);
+
+        set_bit(tc_ptr_to_region_idx(s->code_gen_buffer), busy);
+    }
+
+    while (n_victims < max) {
+        size_t best = region.n;
+
+        for (i = 0; i < region.n; i++) {
+            if (region.alloc_gen[i] && !test_bit(i, busy) &&
+                (best == region.n ||
+                 region.alloc_gen[i] < region.alloc_gen[best])) {
+                best = i;
+            }
+        }
+        if (best == region.n) {
+            break;
+        }
+        set_bit(best, busy);
+        victims[n_victims++] = best;
+    }
+    qemu_mutex_unlock(&region.lock);
+
+    if (n_victims == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < n_victims; i++) {
+        struct tcg_region_tree *rt = region_trees + victims[i] * tree_size;
+
+        qemu_mutex_lock(&rt->lock);
+        q_tree_foreach(rt->tree, tcg_region_collect_tb, tbs);
+        qemu_mutex_unlock(&rt->lock);
+    }
+
+    /* Called without locks held, as @func is likely to take page locks. */
+    for (i = 0; i < tbs->len; i++) {
+        func(g_ptr_array_index(tbs, i));
+    }
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < n_victims; i++) {
+        struct tcg_region_tree *rt = region_trees + victims[i] * tree_size;
+        void *start, *end;
+
+        qemu_mutex_lock(&rt->lock);
+        /* Increment the refcount first so that destroy acts as a reset */
+        q_tree_ref(rt->tree);
+        q_tree_destroy(rt->tree);
+        qemu_mutex_unlock(&rt->lock);
+
+        tcg_region_bounds(victims[i], &start, &end);
+        region.agg_size_full -= (end - start) - TCG_HIGHWATER;
+        region.alloc_gen[victims[i]] = 0;
+    }
+    qemu_mutex_unlock(&region.lock);
+
+    return n_victims;
+}
+
 static size_t tcg_n_regions(size_t tb_size, unsigned max_threads)
 {
 #ifdef CONFIG_USER_ONLY
@@ -435,17 +538,20 @@ static size_t tcg_n_regions(size_t tb_size, unsigned max_threads)
      * being of reasonable size. If that's not possible we make do by evenly
      * dividing the code_gen_buffer among the vCPUs.
      *
-     * Use a single region if all we have is one vCPU thread.
+     * Try to have more regions than threads, with each region being >= 2 MB.
      */
-    if (max_threads == 1) {
-        return 1;
-    }
+    n_regions = tb_size / (2 * MiB);
 
     /*
-     * Try to have more regions than threads, with each region being >= 2 MB.
-     * If we can't, then just allocate one region per vCPU thread.
+     * A single vCPU thread does not need more than one region, but having
+     * a few lets tcg_region_reclaim() recycle part of the buffer instead
+     * of flushing all of it.
      */
-    n_regions = tb_size / (2 * MiB);
+    if (max_threads == 1) {
+        return MAX(MIN(n_regions, 8), 1);
+    }
+
+    /* If we can't, then just allocate one region per vCPU thread. */
     if (n_regions <= max_threads) {
         return max_threads;
     }
@@ -793,6 +899,7 @@ void tcg_region_init(size_t tb_size, int splitwx, unsigned max_threads)
 
     /* init the region struct */
     qemu_mutex_init(&region.lock);
+    region.alloc_gen = g_new0(uint64_t, region.n);
 
     /*
      * Set guard pages in the rw buffer, as that's the one into which
@@ -11,7 +11,8 @@
 
 #if !defined(TCG_TARGET_HAS_v64) \
     && !defined(TCG_TARGET_HAS_v128) \
-    && !defined(TCG_TARGET_HAS_v256)
+    && !defined(TCG_TARGET_HAS_v256) \
+    && !defined(TCG_TARGET_HAS_v512)
 #define TCG_TARGET_MAYBE_vec            0
 #define TCG_TARGET_HAS_abs_vec          0
 #define TCG_TARGET_HAS_neg_vec          0
@@ -45,5 +46,8 @@
 #ifndef TCG_TARGET_HAS_v256
 #define TCG_TARGET_HAS_v256             0
 #endif
+#ifndef TCG_TARGET_HAS_v512
+#define TCG_TARGET_HAS_v512             0
+#endif
 
 #endif
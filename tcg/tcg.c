@@ -2077,6 +2077,7 @@ TCGTemp *tcg_temp_new_internal(TCGType type, TCGTempKind kind)
     case TCG_TYPE_V64:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         n = 1;
         break;
     case TCG_TYPE_I128:
@@ -2165,6 +2166,9 @@ TCGv_vec tcg_temp_new_vec(TCGType type)
     case TCG_TYPE_V256:
         assert(TCG_TARGET_HAS_v256);
         break;
+    case TCG_TYPE_V512:
+        assert(TCG_TARGET_HAS_v512);
+        break;
     default:
         g_assert_not_reached();
     }
@@ -2330,6 +2334,9 @@ bool tcg_op_supported(TCGOpcode op, TCGType type, unsigned flags)
     case TCG_TYPE_V256:
         has_type = TCG_TARGET_HAS_v256;
         break;
+    case TCG_TYPE_V512:
+        has_type = TCG_TARGET_HAS_v512;
+        break;
     default:
         has_type = false;
         break;
@@ -2705,6 +2712,7 @@ static char *tcg_get_arg_str_ptr(TCGContext *s, char *buf, int buf_size,
         case TCG_TYPE_V64:
         case TCG_TYPE_V128:
         case TCG_TYPE_V256:
+        case TCG_TYPE_V512:
             snprintf(buf, buf_size, "v%d$0x%" PRIx64,
                      64 << (ts->type - TCG_TYPE_V64), ts->val);
             break;
@@ -4453,8 +4461,9 @@ static void temp_allocate_frame(TCGContext *s, TCGTemp *ts)
     case TCG_TYPE_I128:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         /*
-         * Note that we do not require aligned storage for V256,
+         * Note that we do not require aligned storage for V256 or V512,
          * and that we provide alignment for I128 to match V128,
          * even if that's above what the host ABI requires.
          */
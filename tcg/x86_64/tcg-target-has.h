@@ -37,6 +37,8 @@
 #define TCG_TARGET_HAS_v64              have_avx1
 #define TCG_TARGET_HAS_v128             have_avx1
 #define TCG_TARGET_HAS_v256             have_avx2
+#define TCG_TARGET_HAS_v512             \
+    (have_avx512bw && have_avx512dq && have_avx512vl)
 
 #define TCG_TARGET_HAS_andc_vec         1
 #define TCG_TARGET_HAS_orc_vec          have_avx512vl
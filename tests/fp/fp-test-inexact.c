@@ -0,0 +1,125 @@
+/*
+ * fp-test-inexact.c - test the inexact flag of QEMU's softfloat
+ *
+ * The hardfloat fast paths may compute the inexact flag after the fact,
+ * from the host result.  Check it against the host FPU for operations
+ * whose results or residuals are close to the bottom of the exponent
+ * range.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#ifndef HW_POISON_H
+#error Must define HW_POISON_H to work around TARGET_* poisoning
+#endif
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include <fenv.h>
+#include "fpu/softfloat.h"
+
+typedef union {
+    double d;
+    float64 i;
+} ufloat64;
+
+typedef enum {
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+} Op;
+
+static const char * const op_names[] = {
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_SQRT] = "sqrt",
+};
+
+static int errors;
+
+static bool host_inexact(Op op, double a, double b, ufloat64 *r)
+{
+    volatile double va = a, vb = b;
+
+    feclearexcept(FE_ALL_EXCEPT);
+    switch (op) {
+    case OP_MUL:
+        r->d = va * vb;
+        break;
+    case OP_DIV:
+        r->d = va / vb;
+        break;
+    case OP_SQRT:
+        r->d = sqrt(va);
+        break;
+    }
+    return fetestexcept(FE_INEXACT);
+}
+
+static void test_op(Op op, double a, double b)
+{
+    float_status qsf = {0};
+    ufloat64 ua = { .d = a }, ub = { .d = b }, real, soft;
+    bool real_inexact, soft_inexact;
+
+    set_float_2nan_prop_rule(float_2nan_prop_s_ab, &qsf);
+    set_float_default_nan_pattern(0b01000000, &qsf);
+    set_float_rounding_mode(float_round_nearest_even, &qsf);
+
+    real_inexact = host_inexact(op, a, b, &real);
+    switch (op) {
+    case OP_MUL:
+        soft.i = float64_mul(ua.i, ub.i, &qsf);
+        break;
+    case OP_DIV:
+        soft.i = float64_div(ua.i, ub.i, &qsf);
+        break;
+    case OP_SQRT:
+        soft.i = float64_sqrt(ua.i, &qsf);
+        break;
+    }
+    soft_inexact = get_float_exception_flags(&qsf) & float_flag_inexact;
+
+    if (real.i == soft.i && real_inexact == soft_inexact) {
+        return;
+    }
+
+    printf("%s: %+.13a %+.13a\n"
+           "  sf: %+.13a inexact %d\n"
+           "host: %+.13a inexact %d\n\n",
+           op_names[op], a, b, soft.d, soft_inexact, real.d, real_inexact);
+
+    if (++errors == 20) {
+        exit(1);
+    }
+}
+
+/* Random double in [2**exp, 2**(exp + 1)) */
+static double random_double(int exp)
+{
+    return ldexp(1.0 + drand48(), exp);
+}
+
+int main(int ac, char **av)
+{
+    int i;
+
+    /* Exact results */
+    test_op(OP_MUL, 0x1p-600, 0x1p-420);
+    test_op(OP_MUL, 0x1.8p-500, 0x1.8p-500);
+    test_op(OP_DIV, 0x1.8p-1000, 0x1.8p0);
+    test_op(OP_DIV, 0x1p-1000, 0x1p-50);
+    test_op(OP_SQRT, 0x1.21p-1000, 0);
+
+    for (i = 0; i < 100000; ++i) {
+        int exp = -1022 + i % 128;
+
+        test_op(OP_MUL, random_double(-600), random_double(-420));
+        test_op(OP_MUL, random_double(exp / 2), random_double(exp - exp / 2));
+        test_op(OP_DIV, random_double(exp), random_double(0));
+        test_op(OP_DIV, random_double(exp), random_double(-60));
+        test_op(OP_SQRT, random_double(exp), 0);
+    }
+
+    return errors ? 1 : 0;
+}
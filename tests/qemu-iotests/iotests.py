@@ -364,6 +364,17 @@ def qemu_io(*args: str, check: bool = True, combine_stdio: bool = True
     return qemu_tool(*qemu_io_wrap_args(args),
                      check=check, combine_stdio=combine_stdio)
 
+def qemu_io_cmds(cmds: Iterable[str], *args: str, check: bool = True
+                 ) -> 'subprocess.CompletedProcess[str]':
+    """
+    Run QEMU_IO_PROG with one -c option for each command in @cmds,
+    followed by @args.
+    """
+    cmd_args: List[str] = []
+    for cmd in cmds:
+        cmd_args += ['-c', cmd]
+    return qemu_io(*cmd_args, *args, check=check)
+
 def qemu_io_log(*args: str, check: bool = True
                 ) -> 'subprocess.CompletedProcess[str]':
     result = qemu_io(*args, check=check)
@@ -1247,6 +1258,16 @@ def assert_qmp(self, d, path, value):
                              '"%s" is "%s", expected "%s"'
                              % (path, str(result), str(value)))
 
+    def assert_qemu_io(self, cmds: Iterable[str], *args: str,
+                       allow_errors: bool = False) -> None:
+        '''Run @cmds in qemu-io on the image given by @args, and assert
+           that all pattern verifications pass.  Unless @allow_errors is
+           set, also assert that no command failed.'''
+        result = qemu_io_cmds(cmds, *args)
+        self.assertNotIn('Pattern verification failed', result.stdout)
+        if not allow_errors:
+            self.assertNotIn('error', result.stdout)
+
     def assert_no_active_block_jobs(self):
         result = self.vm.qmp('query-block-jobs')
         self.assert_qmp(result, 'return', [])
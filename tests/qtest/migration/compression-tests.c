@@ -113,6 +113,31 @@ static void test_multifd_tcp_uadk(char *name, MigrateCommon *args)
 }
 #endif /* CONFIG_UADK */
 
+static void *
+migrate_hook_start_precopy_tcp_multifd_delta(QTestState *from,
+                                             QTestState *to)
+{
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    return migrate_hook_start_precopy_tcp_multifd_common(from, to, "delta");
+}
+
+static void test_multifd_tcp_delta(char *name, MigrateCommon *args)
+{
+    args->listen_uri = "defer";
+    args->start_hook = migrate_hook_start_precopy_tcp_multifd_delta;
+    args->iterations = 2;
+    /*
+     * Deltas are only sent for pages modified after the first round
+     * iteration.
+     */
+    args->live = true;
+
+    args->start.caps[MIGRATION_CAPABILITY_MULTIFD] = true;
+
+    test_precopy_common(args);
+}
+
 static void *
 migrate_hook_start_xbzrle(QTestState *from,
                           QTestState *to)
@@ -204,6 +229,9 @@ void migration_test_add_compression(MigrationTestEnv *env)
                        test_multifd_tcp_uadk);
 #endif
 
+    migration_test_add("/migration/multifd/tcp/plain/delta",
+                       test_multifd_tcp_delta);
+
     if (g_test_slow()) {
         migration_test_add("/migration/precopy/unix/xbzrle",
                            test_precopy_unix_xbzrle);
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "libqtest.h"
 #include "migration/framework.h"
+#include "migration/migration-qmp.h"
 #include "migration/migration-util.h"
 #include "qobject/qlist.h"
 #include "qemu/module.h"
@@ -39,6 +40,36 @@ static void test_postcopy_preempt(char *name, MigrateCommon *args)
     test_postcopy_common(args);
 }
 
+static void migrate_hook_end_postcopy_prefetch(QTestState *from,
+                                               QTestState *to,
+                                               void *opaque)
+{
+    /* The counter comes with the blocktime statistics */
+    if (migration_get_env()->uffd_feature_thread_id) {
+        /* The guest dirties its memory in order, so its faults are strided */
+        g_assert_cmpint(read_migrate_property_int(to,
+                                                  "postcopy-prefetch-pages"),
+                        >, 0);
+    }
+}
+
+static void test_postcopy_prefetch(char *name, MigrateCommon *args)
+{
+    args->start.caps[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH] = true;
+    args->end_hook = migrate_hook_end_postcopy_prefetch;
+
+    test_postcopy_common(args);
+}
+
+static void test_postcopy_preempt_prefetch(char *name, MigrateCommon *args)
+{
+    args->start.caps[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT] = true;
+    args->start.caps[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH] = true;
+    args->end_hook = migrate_hook_end_postcopy_prefetch;
+
+    test_postcopy_common(args);
+}
+
 static void test_postcopy_recovery(char *name, MigrateCommon *args)
 {
     test_postcopy_recovery_common(args, POSTCOPY_FAIL_NONE);
@@ -101,6 +132,11 @@ void migration_test_add_postcopy(MigrationTestEnv *env)
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
 
+        migration_test_add("/migration/postcopy/prefetch",
+                           test_postcopy_prefetch);
+        migration_test_add("/migration/postcopy/preempt/prefetch",
+                           test_postcopy_preempt_prefetch);
+
         migration_test_add(
             "/migration/postcopy/recovery/double-failures/handshake",
             test_postcopy_recovery_fail_handshake);
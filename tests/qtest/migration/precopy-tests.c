@@ -50,6 +50,30 @@ static void test_precopy_unix_plain(char *name, MigrateCommon *args)
     test_precopy_common(args);
 }
 
+static void migrate_hook_end_parallel_device_load(QTestState *from,
+                                                  QTestState *to,
+                                                  void *opaque)
+{
+    /*
+     * The guest enables A20 through port 0x92 before migration only, so
+     * the destination gets it from the parallel loaded port92 section.
+     */
+    g_assert_cmphex(qtest_inb(to, 0x92) & 2, ==, 2);
+}
+
+static void test_precopy_unix_parallel_device_load(char *name,
+                                                   MigrateCommon *args)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    args->listen_uri = uri;
+    args->connect_uri = uri;
+    args->end_hook = migrate_hook_end_parallel_device_load;
+    args->start.caps[MIGRATION_CAPABILITY_PARALLEL_DEVICE_LOAD] = true;
+
+    test_precopy_common(args);
+}
+
 static void test_precopy_unix_suspend_live(char *name, MigrateCommon *args)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -95,6 +119,28 @@ static void test_precopy_unix_dirty_ring(char *name, MigrateCommon *args)
     test_precopy_common(args);
 }
 
+static void test_precopy_unix_working_set(char *name, MigrateCommon *args)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    args->listen_uri = uri;
+    args->connect_uri = uri;
+    /*
+     * The guest keeps dirtying all of its test memory, so after the first
+     * iterations every dirty page is hot.  While the migration does not
+     * converge, the hot pages do not fit in the downtime limit and are
+     * sent in another pass.  Once the limit is raised, they are left for
+     * the switchover, and the memory check on the destination verifies
+     * that they are all sent then.
+     */
+    args->live = true;
+    args->iterations = 3;
+
+    args->start.caps[MIGRATION_CAPABILITY_WORKING_SET] = true;
+
+    test_precopy_common(args);
+}
+
 #ifdef CONFIG_RDMA
 
 #include <sys/resource.h>
@@ -1212,6 +1258,12 @@ void migration_test_add_precopy(MigrationTestEnv *env)
 
     migration_test_add("/migration/precopy/tcp/plain/switchover-ack",
                        test_precopy_tcp_switchover_ack);
+    migration_test_add("/migration/precopy/unix/working-set",
+                       test_precopy_unix_working_set);
+    if (env->is_x86) {
+        migration_test_add("/migration/precopy/unix/parallel-device-load",
+                           test_precopy_unix_parallel_device_load);
+    }
 
 #ifndef _WIN32
     migration_test_add("/migration/precopy/fd/tcp",
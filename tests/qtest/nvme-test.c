@@ -8,13 +8,18 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "qemu/module.h"
 #include "qemu/units.h"
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "libqos/libqos-malloc.h"
 #include "block/nvme.h"
 
+#define NVME_QUEUE_DEPTH    8
+#define NVME_TIMEOUT_US     (5 * G_USEC_PER_SEC)
+
 typedef struct QNvme QNvme;
 
 struct QNvme {
@@ -142,6 +147,162 @@ static void nvmetest_pmr_reg_test(void *obj, void *data, QGuestAllocator *alloc)
     qpci_iounmap(pdev, pmr_bar);
 }
 
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint64_t sq_addr;
+    uint64_t cq_addr;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+} NvmeTestQueue;
+
+static void nvmetest_queue_init(QTestState *qts, NvmeTestQueue *q,
+                                QGuestAllocator *alloc, uint16_t qid)
+{
+    q->qid = qid;
+    q->sq_addr = guest_alloc(alloc, NVME_QUEUE_DEPTH * sizeof(NvmeCmd));
+    q->cq_addr = guest_alloc(alloc, NVME_QUEUE_DEPTH * sizeof(NvmeCqe));
+    g_assert(QEMU_IS_ALIGNED(q->sq_addr, 4096));
+    g_assert(QEMU_IS_ALIGNED(q->cq_addr, 4096));
+    qtest_memset(qts, q->cq_addr, 0, NVME_QUEUE_DEPTH * sizeof(NvmeCqe));
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+}
+
+/* Submit @cmd on @q and wait for its completion, returns the status field */
+static uint16_t nvmetest_submit(QNvme *nvme, QPCIBar bar, NvmeTestQueue *q,
+                                NvmeCmd *cmd)
+{
+    QPCIDevice *pdev = &nvme->dev;
+    QTestState *qts = pdev->bus->qts;
+    gint64 start_time = g_get_monotonic_time();
+    uint64_t cqe_addr = q->cq_addr + q->cq_head * sizeof(NvmeCqe);
+    NvmeCqe cqe;
+
+    cmd->cid = cpu_to_le16(q->sq_tail);
+    qtest_memwrite(qts, q->sq_addr + q->sq_tail * sizeof(NvmeCmd),
+                   cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % NVME_QUEUE_DEPTH;
+    qpci_io_writel(pdev, bar, 0x1000 + 8 * q->qid, q->sq_tail);
+
+    for (;;) {
+        qtest_memread(qts, cqe_addr, &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TIMEOUT_US);
+        qtest_clock_step(qts, 100);
+    }
+
+    g_assert_cmpint(le16_to_cpu(cqe.sq_id), ==, q->qid);
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, le16_to_cpu(cmd->cid));
+
+    q->cq_head = (q->cq_head + 1) % NVME_QUEUE_DEPTH;
+    if (!q->cq_head) {
+        q->phase ^= 1;
+    }
+    qpci_io_writel(pdev, bar, 0x1000 + 8 * q->qid + 4, q->cq_head);
+
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+/* Run commands on an I/O queue pair that lives in an IOThread */
+static void nvmetest_iothread_io_test(void *obj, void *data,
+                                      QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    QPCIDevice *pdev = &nvme->dev;
+    QTestState *qts = pdev->bus->qts;
+    gint64 start_time;
+    NvmeTestQueue admin, io;
+    NvmeCmd cmd;
+    uint64_t buf_addr;
+    uint8_t buf[512];
+    QPCIBar bar;
+    int i;
+
+    qpci_device_enable(pdev);
+    bar = qpci_iomap(pdev, 0, NULL);
+
+    nvmetest_queue_init(qts, &admin, alloc, 0);
+    nvmetest_queue_init(qts, &io, alloc, 1);
+
+    qpci_io_writel(pdev, bar, 0x24, ((NVME_QUEUE_DEPTH - 1) << 16) |
+                                    (NVME_QUEUE_DEPTH - 1));
+    qpci_io_writeq(pdev, bar, 0x28, admin.sq_addr);
+    qpci_io_writeq(pdev, bar, 0x30, admin.cq_addr);
+    /* EN, 64 byte SQ entries, 16 byte CQ entries */
+    qpci_io_writel(pdev, bar, 0x14, 1 | (6 << 16) | (4 << 20));
+
+    start_time = g_get_monotonic_time();
+    while (!(qpci_io_readl(pdev, bar, 0x1c) & 1)) {
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TIMEOUT_US);
+        qtest_clock_step(qts, 100);
+    }
+
+    /* Create I/O CQ 1, physically contiguous, interrupts disabled */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_CQ;
+    cmd.dptr.prp1 = cpu_to_le64(io.cq_addr);
+    cmd.cdw10 = cpu_to_le32(((NVME_QUEUE_DEPTH - 1) << 16) | io.qid);
+    cmd.cdw11 = cpu_to_le32(1);
+    g_assert_cmpint(nvmetest_submit(nvme, bar, &admin, &cmd), ==,
+                    NVME_SUCCESS);
+
+    /* Create I/O SQ 1, physically contiguous, completing to CQ 1 */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_SQ;
+    cmd.dptr.prp1 = cpu_to_le64(io.sq_addr);
+    cmd.cdw10 = cpu_to_le32(((NVME_QUEUE_DEPTH - 1) << 16) | io.qid);
+    cmd.cdw11 = cpu_to_le32((io.qid << 16) | 1);
+    g_assert_cmpint(nvmetest_submit(nvme, bar, &admin, &cmd), ==,
+                    NVME_SUCCESS);
+
+    /* Wrap around the queues a few times to exercise the phase bit */
+    buf_addr = guest_alloc(alloc, sizeof(buf));
+    for (i = 0; i < 3 * NVME_QUEUE_DEPTH; i++) {
+        /* The drive reads as zeroes */
+        qtest_memset(qts, buf_addr, 0xaa, sizeof(buf));
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_READ;
+        cmd.nsid = cpu_to_le32(1);
+        cmd.dptr.prp1 = cpu_to_le64(buf_addr);
+        cmd.cdw10 = cpu_to_le32(i);
+        g_assert_cmpint(nvmetest_submit(nvme, bar, &io, &cmd), ==,
+                        NVME_SUCCESS);
+
+        qtest_memread(qts, buf_addr, buf, sizeof(buf));
+        g_assert(buffer_is_zero(buf, sizeof(buf)));
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_FLUSH;
+        cmd.nsid = cpu_to_le32(1);
+        g_assert_cmpint(nvmetest_submit(nvme, bar, &io, &cmd), ==,
+                        NVME_SUCCESS);
+    }
+
+    /* Deleting the queues stops them in the IOThread */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_DELETE_SQ;
+    cmd.cdw10 = cpu_to_le32(io.qid);
+    g_assert_cmpint(nvmetest_submit(nvme, bar, &admin, &cmd), ==,
+                    NVME_SUCCESS);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_DELETE_CQ;
+    cmd.cdw10 = cpu_to_le32(io.qid);
+    g_assert_cmpint(nvmetest_submit(nvme, bar, &admin, &cmd), ==,
+                    NVME_SUCCESS);
+
+    guest_free(alloc, buf_addr);
+    guest_free(alloc, io.sq_addr);
+    guest_free(alloc, io.cq_addr);
+    guest_free(alloc, admin.sq_addr);
+    guest_free(alloc, admin.cq_addr);
+    qpci_iounmap(pdev, bar);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -168,6 +329,12 @@ static void nvme_register_nodes(void)
     });
 
     qos_add_test("reg-read", "nvme", nvmetest_reg_read_test, NULL);
+
+    qos_add_test("iothread-io", "nvme", nvmetest_iothread_io_test,
+                 &(QOSGraphTestOptions) {
+        .edge.extra_device_opts = "iothread=nvme-iothread",
+        .edge.before_cmd_line = "-object iothread,id=nvme-iothread",
+    });
 }
 
 libqos_init(nvme_register_nodes);
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * The XMM registers live in env and are written with explicit stores,
+ * which the optimizer drops when a later store in the same block
+ * overwrites them.  Check that overwritten, partially overwritten and
+ * observed values are right, also when a fault interrupts the block.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <ucontext.h>
+
+static sigjmp_buf jmp_env;
+static uint64_t fault_xmm0[2];
+
+static void sigsegv(int sig, siginfo_t *info, void *puc)
+{
+    ucontext_t *uc = puc;
+
+    memcpy(fault_xmm0, &uc->uc_mcontext.fpregs->_xmm[0], sizeof(fault_xmm0));
+    siglongjmp(jmp_env, 1);
+}
+
+static void test_overwrite(void)
+{
+    uint64_t r[2];
+
+    asm volatile("movq %1, %%xmm0\n\t"
+                 "movq %2, %%xmm0\n\t"
+                 "movdqu %%xmm0, %0"
+                 : "=m"(r) : "r"(1ull), "r"(2ull) : "xmm0");
+    assert(r[0] == 2 && r[1] == 0);
+}
+
+static void test_partial_overwrite(void)
+{
+    uint64_t r[2];
+
+    asm volatile("movq %1, %%xmm0\n\t"
+                 "pinsrw $3, %k2, %%xmm0\n\t"
+                 "pinsrw $7, %k2, %%xmm0\n\t"
+                 "movdqu %%xmm0, %0"
+                 : "=m"(r) : "r"(0x1111111122222222ull), "r"(0x3333)
+                 : "xmm0");
+    assert(r[0] == 0x3333111122222222ull && r[1] == 0x3333000000000000ull);
+}
+
+static void test_read_between(void)
+{
+    uint64_t a, b;
+
+    asm volatile("movq %2, %%xmm0\n\t"
+                 "movq %%xmm0, %0\n\t"
+                 "movq %3, %%xmm0\n\t"
+                 "movq %%xmm0, %1"
+                 : "=r"(a), "=r"(b) : "r"(4ull), "r"(5ull) : "xmm0");
+    assert(a == 4 && b == 5);
+}
+
+static void test_fault(void)
+{
+    struct sigaction sa = {
+        .sa_sigaction = sigsegv,
+        .sa_flags = SA_SIGINFO,
+    };
+
+    assert(sigaction(SIGSEGV, &sa, NULL) == 0);
+
+    if (sigsetjmp(jmp_env, 1) == 0) {
+        asm volatile("movq %0, %%xmm0\n\t"
+                     "movq %1, %%xmm0\n\t"
+                     "movq (%2), %%xmm1\n\t"
+                     "movq %0, %%xmm0"
+                     : : "r"(6ull), "r"(7ull), "r"(NULL) : "xmm0", "xmm1");
+        assert(0);
+    }
+
+    /* The fault happens after the second store and before the third */
+    assert(fault_xmm0[0] == 7 && fault_xmm0[1] == 0);
+}
+
+int main(void)
+{
+    int i;
+
+    /* Also run the translated blocks a few times */
+    for (i = 0; i < 100; i++) {
+        test_overwrite();
+        test_partial_overwrite();
+        test_read_between();
+    }
+    test_fault();
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Translate enough distinct code to fill a small code buffer several
+ * times, so that the oldest code regions are recycled, and check that
+ * functions translated before and after a recycle run correctly.  The
+ * functions are then rewritten, which must invalidate their current
+ * translations but not the recycled ones.
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define NB_FUNCS    (128 * 1024)
+#define FUNC_SIZE   8
+
+typedef uint32_t (*func_t)(void);
+
+static uint8_t code[NB_FUNCS * FUNC_SIZE] __attribute__((aligned(4096)));
+
+/* mov $value, %eax; ret */
+static void write_func(int i, uint32_t value)
+{
+    uint8_t *p = &code[i * FUNC_SIZE];
+
+    p[0] = 0xb8;
+    p[1] = value;
+    p[2] = value >> 8;
+    p[3] = value >> 16;
+    p[4] = value >> 24;
+    p[5] = 0xc3;
+    p[6] = 0xcc;
+    p[7] = 0xcc;
+}
+
+static int call_funcs(uint32_t xor)
+{
+    int i;
+
+    for (i = 0; i < NB_FUNCS; i++) {
+        uint32_t value = ((func_t)&code[i * FUNC_SIZE])();
+
+        if (value != (i ^ xor)) {
+            ml_printf("FAIL: function %d returned %x, expected %x\n",
+                      i, value, i ^ xor);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; i < NB_FUNCS; i++) {
+        write_func(i, i);
+    }
+    if (call_funcs(0) || call_funcs(0)) {
+        return 1;
+    }
+
+    for (i = 0; i < NB_FUNCS; i++) {
+        write_func(i, i ^ 0x5a5a5a5a);
+    }
+    if (call_funcs(0x5a5a5a5a)) {
+        return 1;
+    }
+
+    ml_printf("PASS\n");
+    return 0;
+}
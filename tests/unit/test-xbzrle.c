@@ -173,6 +173,51 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_sparse(void)
+{
+    uint8_t *buffer = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *test = g_malloc(XBZRLE_PAGE_SIZE);
+    int i, j, rc, dlen;
+
+    for (i = 0; i < 1000; i++) {
+        int pos = 0;
+
+        for (j = 0; j < XBZRLE_PAGE_SIZE; j++) {
+            buffer[j] = g_test_rand_int();
+        }
+        memcpy(test, buffer, XBZRLE_PAGE_SIZE);
+
+        /* short nzruns of up to 72 bytes, separated by short zruns */
+        while (1) {
+            int zrun = g_test_rand_int_range(1, 32);
+            int nzrun = g_test_rand_int_range(1, 73);
+
+            if (pos + zrun + nzrun > XBZRLE_PAGE_SIZE) {
+                break;
+            }
+            pos += zrun;
+            for (j = 0; j < nzrun; j++) {
+                buffer[pos++] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+
+        dlen = xbzrle_encode_buffer(test, buffer, XBZRLE_PAGE_SIZE,
+                                    compressed, XBZRLE_PAGE_SIZE);
+        if (dlen == -1) {
+            continue;
+        }
+
+        rc = xbzrle_decode_buffer(compressed, dlen, test, XBZRLE_PAGE_SIZE);
+        g_assert(rc <= XBZRLE_PAGE_SIZE);
+        g_assert(memcmp(test, buffer, XBZRLE_PAGE_SIZE) == 0);
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +230,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_sparse", test_encode_decode_sparse);
 
     return g_test_run();
 }
@@ -387,6 +387,16 @@ aio_ctx_finalize(GSource *source)
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    for (int i = 0; i < ARRAY_SIZE(ctx->linux_io_uring_poll); i++) {
+        if (ctx->linux_io_uring_poll[i]) {
+            luring_poll_detach_aio_context(ctx->linux_io_uring_poll[i], ctx);
+            luring_poll_cleanup(ctx->linux_io_uring_poll[i]);
+            ctx->linux_io_uring_poll[i] = NULL;
+        }
+    }
+#endif
+
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
 
@@ -462,6 +472,27 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+LuringPollState *aio_setup_linux_io_uring_poll(AioContext *ctx, bool sqpoll,
+                                               Error **errp)
+{
+    if (!ctx->linux_io_uring_poll[sqpoll]) {
+        ctx->linux_io_uring_poll[sqpoll] = luring_poll_init(sqpoll, errp);
+        if (ctx->linux_io_uring_poll[sqpoll]) {
+            luring_poll_attach_aio_context(ctx->linux_io_uring_poll[sqpoll],
+                                           ctx);
+        }
+    }
+    return ctx->linux_io_uring_poll[sqpoll];
+}
+
+LuringPollState *aio_get_linux_io_uring_poll(AioContext *ctx, bool sqpoll)
+{
+    assert(ctx->linux_io_uring_poll[sqpoll]);
+    return ctx->linux_io_uring_poll[sqpoll];
+}
+#endif
+
 void aio_notify(AioContext *ctx)
 {
     /*
@@ -46,8 +46,11 @@
 #include "qemu/osdep.h"
 #include <poll.h>
 #include "qapi/error.h"
+#include "qemu/aio-wait.h"
 #include "qemu/defer-call.h"
+#include "qemu/lockable.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/units.h"
 #include "aio-posix.h"
 #include "trace.h"
 
@@ -441,6 +444,408 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
     return false;
 }
 
+/*
+ * Fixed buffers and files
+ *
+ * Unless I/O buffers and files are registered with the ring beforehand,
+ * the kernel pins the buffer pages and looks up the file on every request.
+ * Registrations belong to a ring, i.e. to an AioContext, but the users of
+ * aio_add_sqe() are not tied to one thread.  A global table therefore
+ * records what should be registered, and each AioContext brings its own
+ * ring up to date when it looks up a fixed buffer or file.  A slot has the
+ * same index in all rings.
+ *
+ * Memory is split into FDMON_FIXED_BUF_CHUNK sized buffers because the
+ * kernel limits the size of a single fixed buffer.
+ */
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+
+enum {
+    FDMON_FIXED_BUFS    = 1024,
+    FDMON_FIXED_FILES   = 256,
+    FDMON_FIXED_REGIONS = 64,
+};
+
+#define FDMON_FIXED_BUF_CHUNK (1 * GiB)
+
+typedef struct {
+    void *host;
+    size_t size;
+    unsigned first;     /* index of the first buffer slot */
+    unsigned refcnt;    /* 0 if the region is unused */
+} FdmonFixedRegion;
+
+/* Tables of one AioContext, only accessed in its thread */
+typedef struct FdmonFixed {
+    AioContext *ctx;
+    QLIST_ENTRY(FdmonFixed) next;
+
+    /* Value of fdmon_fixed.generation when the ring was last updated */
+    unsigned generation;
+
+    /* The kernel does not support sparse registration */
+    bool failed;
+
+    /*
+     * What is registered with the ring.  Slots whose update failed hold
+     * values that never match a lookup.
+     */
+    struct iovec bufs[FDMON_FIXED_BUFS];
+    int files[FDMON_FIXED_FILES];
+    FdmonFixedRegion regions[FDMON_FIXED_REGIONS];
+    unsigned nr_regions;
+} FdmonFixed;
+
+static struct {
+    QemuMutex lock;
+
+    /* Incremented whenever the tables below change */
+    unsigned generation;
+
+    struct iovec bufs[FDMON_FIXED_BUFS];
+    int files[FDMON_FIXED_FILES];    /* -1 for free slots */
+    FdmonFixedRegion regions[FDMON_FIXED_REGIONS];
+    unsigned nr_regions;            /* highest used region index + 1 */
+
+    QLIST_HEAD(, FdmonFixed) contexts;
+} fdmon_fixed;
+
+static void __attribute__((__constructor__)) fdmon_fixed_init(void)
+{
+    qemu_mutex_init(&fdmon_fixed.lock);
+    memset(fdmon_fixed.files, -1, sizeof(fdmon_fixed.files));
+}
+
+/* Bring the ring of @ctx up to date.  Called in the thread of @ctx. */
+static void fdmon_fixed_update(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_io_uring;
+    FdmonFixed *f = ctx->fdmon_fixed;
+    int i;
+
+    QEMU_LOCK_GUARD(&fdmon_fixed.lock);
+
+    if (!f) {
+        f = g_new0(FdmonFixed, 1);
+        f->ctx = ctx;
+        memset(f->files, -1, sizeof(f->files));
+        if (io_uring_register_buffers_sparse(ring, FDMON_FIXED_BUFS) < 0 ||
+            io_uring_register_files_sparse(ring, FDMON_FIXED_FILES) < 0) {
+            f->failed = true;
+        }
+        QLIST_INSERT_HEAD(&fdmon_fixed.contexts, f, next);
+        ctx->fdmon_fixed = f;
+    }
+
+    f->generation = fdmon_fixed.generation;
+    if (f->failed) {
+        return;
+    }
+
+    for (i = 0; i < FDMON_FIXED_BUFS; i++) {
+        struct iovec *iov = &fdmon_fixed.bufs[i];
+        __u64 tag = 0;
+
+        if (iov->iov_base == f->bufs[i].iov_base &&
+            iov->iov_len == f->bufs[i].iov_len) {
+            continue;
+        }
+
+        /* Pinning may fail, e.g. because of RLIMIT_MEMLOCK */
+        if (io_uring_register_buffers_update_tag(ring, i, iov, &tag, 1) == 1) {
+            f->bufs[i] = *iov;
+        } else {
+            f->bufs[i] = (struct iovec) { .iov_base = NULL, .iov_len = 1 };
+        }
+    }
+
+    for (i = 0; i < FDMON_FIXED_FILES; i++) {
+        int fd = fdmon_fixed.files[i];
+
+        if (fd == f->files[i]) {
+            continue;
+        }
+
+        if (io_uring_register_files_update(ring, i, &fd, 1) == 1) {
+            f->files[i] = fd;
+        } else {
+            f->files[i] = -2;
+        }
+    }
+
+    memcpy(f->regions, fdmon_fixed.regions, sizeof(f->regions));
+    f->nr_regions = fdmon_fixed.nr_regions;
+}
+
+static void fdmon_fixed_update_bh(void *opaque)
+{
+    fdmon_fixed_update(opaque);
+}
+
+/*
+ * Apply a removal to all rings right away, so that no ring keeps memory
+ * pinned or a file open after the caller is done with it.
+ */
+static void fdmon_fixed_update_all(void)
+{
+    g_autoptr(GPtrArray) contexts = g_ptr_array_new();
+    FdmonFixed *f;
+    unsigned i;
+
+    GLOBAL_STATE_CODE();
+
+    WITH_QEMU_LOCK_GUARD(&fdmon_fixed.lock) {
+        QLIST_FOREACH(f, &fdmon_fixed.contexts, next) {
+            if (!f->failed) {
+                aio_context_ref(f->ctx);
+                g_ptr_array_add(contexts, f->ctx);
+            }
+        }
+    }
+
+    for (i = 0; i < contexts->len; i++) {
+        AioContext *ctx = g_ptr_array_index(contexts, i);
+
+        if (ctx == qemu_get_current_aio_context()) {
+            fdmon_fixed_update(ctx);
+        } else {
+            aio_wait_bh_oneshot(ctx, fdmon_fixed_update_bh, ctx);
+        }
+        aio_context_unref(ctx);
+    }
+}
+
+/* Returns the up to date tables of the current AioContext, if any */
+static FdmonFixed *fdmon_fixed_get(void)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    FdmonFixed *f = ctx->fdmon_fixed;
+
+    if (!f || f->generation != qatomic_read(&fdmon_fixed.generation)) {
+        fdmon_fixed_update(ctx);
+        f = ctx->fdmon_fixed;
+    }
+    return f->failed ? NULL : f;
+}
+
+static void fdmon_fixed_destroy(AioContext *ctx)
+{
+    FdmonFixed *f = ctx->fdmon_fixed;
+
+    if (!f) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&fdmon_fixed.lock) {
+        QLIST_REMOVE(f, next);
+    }
+    g_free(f);
+    ctx->fdmon_fixed = NULL;
+}
+
+bool aio_register_fixed_buf(void *host, size_t size)
+{
+    unsigned nr_bufs = DIV_ROUND_UP(size, FDMON_FIXED_BUF_CHUNK);
+    FdmonFixedRegion *r = NULL;
+    unsigned i, first, n;
+
+    QEMU_LOCK_GUARD(&fdmon_fixed.lock);
+
+    for (i = 0; i < FDMON_FIXED_REGIONS; i++) {
+        FdmonFixedRegion *cur = &fdmon_fixed.regions[i];
+
+        if (cur->refcnt && cur->host == host && cur->size == size) {
+            cur->refcnt++;
+            return true;
+        }
+        if (!cur->refcnt && !r) {
+            r = cur;
+        }
+    }
+    if (!r) {
+        return false;
+    }
+
+    /* Find nr_bufs consecutive free buffer slots */
+    for (first = 0, n = 0; n < nr_bufs; first++) {
+        if (first >= FDMON_FIXED_BUFS) {
+            return false;
+        }
+        n = fdmon_fixed.bufs[first].iov_base ? 0 : n + 1;
+    }
+    first -= nr_bufs;
+
+    for (i = 0; i < nr_bufs; i++) {
+        size_t offset = (size_t)i * FDMON_FIXED_BUF_CHUNK;
+
+        fdmon_fixed.bufs[first + i] = (struct iovec) {
+            .iov_base = host + offset,
+            .iov_len = MIN(size - offset, FDMON_FIXED_BUF_CHUNK),
+        };
+    }
+
+    *r = (FdmonFixedRegion) {
+        .host = host,
+        .size = size,
+        .first = first,
+        .refcnt = 1,
+    };
+    i = r - fdmon_fixed.regions;
+    fdmon_fixed.nr_regions = MAX(fdmon_fixed.nr_regions, i + 1);
+
+    qatomic_inc(&fdmon_fixed.generation);
+    return true;
+}
+
+void aio_unregister_fixed_buf(void *host, size_t size)
+{
+    unsigned i;
+
+    WITH_QEMU_LOCK_GUARD(&fdmon_fixed.lock) {
+        FdmonFixedRegion *r = NULL;
+
+        for (i = 0; i < fdmon_fixed.nr_regions; i++) {
+            FdmonFixedRegion *cur = &fdmon_fixed.regions[i];
+
+            if (cur->refcnt && cur->host == host && cur->size == size) {
+                r = cur;
+                break;
+            }
+        }
+        if (!r || --r->refcnt) {
+            return;
+        }
+
+        for (i = 0; i < DIV_ROUND_UP(size, FDMON_FIXED_BUF_CHUNK); i++) {
+            fdmon_fixed.bufs[r->first + i] = (struct iovec) {};
+        }
+        qatomic_inc(&fdmon_fixed.generation);
+    }
+
+    fdmon_fixed_update_all();
+}
+
+bool aio_register_fixed_file(int fd)
+{
+    unsigned i;
+
+    QEMU_LOCK_GUARD(&fdmon_fixed.lock);
+
+    for (i = 0; i < FDMON_FIXED_FILES; i++) {
+        if (fdmon_fixed.files[i] == -1) {
+            fdmon_fixed.files[i] = fd;
+            qatomic_inc(&fdmon_fixed.generation);
+            return true;
+        }
+    }
+    return false;
+}
+
+void aio_unregister_fixed_file(int fd)
+{
+    unsigned i;
+
+    WITH_QEMU_LOCK_GUARD(&fdmon_fixed.lock) {
+        for (i = 0; i < FDMON_FIXED_FILES; i++) {
+            if (fdmon_fixed.files[i] == fd) {
+                break;
+            }
+        }
+        if (i == FDMON_FIXED_FILES) {
+            return;
+        }
+
+        fdmon_fixed.files[i] = -1;
+        qatomic_inc(&fdmon_fixed.generation);
+    }
+
+    fdmon_fixed_update_all();
+}
+
+int aio_get_fixed_buf(const void *base, size_t len)
+{
+    FdmonFixed *f = fdmon_fixed_get();
+    unsigned i;
+
+    if (!f) {
+        return -1;
+    }
+
+    for (i = 0; i < f->nr_regions; i++) {
+        FdmonFixedRegion *r = &f->regions[i];
+        uintptr_t offset = (uintptr_t)base - (uintptr_t)r->host;
+        unsigned idx;
+        struct iovec *iov;
+
+        if (!r->refcnt || (uintptr_t)base < (uintptr_t)r->host ||
+            offset >= r->size) {
+            continue;
+        }
+
+        idx = r->first + offset / FDMON_FIXED_BUF_CHUNK;
+        iov = &f->bufs[idx];
+        offset %= FDMON_FIXED_BUF_CHUNK;
+        if (iov->iov_base != base - offset || len > iov->iov_len - offset) {
+            return -1;
+        }
+        return idx;
+    }
+    return -1;
+}
+
+int aio_get_fixed_file(int fd)
+{
+    FdmonFixed *f = fdmon_fixed_get();
+    unsigned i;
+
+    if (!f) {
+        return -1;
+    }
+
+    for (i = 0; i < FDMON_FIXED_FILES; i++) {
+        if (f->files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#else /* !HAVE_IO_URING_REGISTER_BUFFERS_SPARSE */
+
+static void fdmon_fixed_destroy(AioContext *ctx)
+{
+}
+
+bool aio_register_fixed_buf(void *host, size_t size)
+{
+    return false;
+}
+
+void aio_unregister_fixed_buf(void *host, size_t size)
+{
+}
+
+bool aio_register_fixed_file(int fd)
+{
+    return false;
+}
+
+void aio_unregister_fixed_file(int fd)
+{
+}
+
+int aio_get_fixed_buf(const void *base, size_t len)
+{
+    return -1;
+}
+
+int aio_get_fixed_file(int fd)
+{
+    return -1;
+}
+
+#endif /* !HAVE_IO_URING_REGISTER_BUFFERS_SPARSE */
+
 static const FDMonOps fdmon_io_uring_ops = {
     .update = fdmon_io_uring_update,
     .wait = fdmon_io_uring_wait,
@@ -480,6 +885,7 @@ void fdmon_io_uring_destroy(AioContext *ctx)
         return;
     }
 
+    fdmon_fixed_destroy(ctx);
     io_uring_queue_exit(&ctx->fdmon_io_uring);
 
     /* Move handlers due to be removed onto the deleted list */